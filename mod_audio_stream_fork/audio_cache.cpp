@@ -0,0 +1,120 @@
+#include "audio_cache.h"
+
+#include <atomic>
+#include <iterator>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "stream_metrics.h"
+
+namespace {
+
+    struct cached_clip : audio_clip_t {
+        std::atomic<int> refs{1};       /* the cache's own, plus one per call playing it */
+        std::string id;
+        std::vector<uint8_t> pcm;
+    };
+
+    struct clip_cache {
+        std::mutex mutex;
+        size_t max_bytes = 0;
+        size_t bytes = 0;
+        std::list<cached_clip *> lru;   /* most recently played first */
+        std::unordered_map<std::string, std::list<cached_clip *>::iterator> index;
+    };
+
+    clip_cache cache;
+
+    void unref(const cached_clip *clip) {
+        auto *c = const_cast<cached_clip *>(clip);
+        if (c->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) delete c;
+    }
+
+    /* caller holds the mutex */
+    void drop(std::list<cached_clip *>::iterator it) {
+        cached_clip *clip = *it;
+        cache.bytes -= clip->len;
+        cache.index.erase(clip->id);
+        cache.lru.erase(it);
+        unref(clip);
+    }
+}
+
+extern "C" {
+
+    void audio_cache_init(size_t max_bytes) {
+        std::lock_guard<std::mutex> lock(cache.mutex);
+        cache.max_bytes = max_bytes;
+    }
+
+    void audio_cache_shutdown(void) {
+        std::lock_guard<std::mutex> lock(cache.mutex);
+        while (!cache.lru.empty()) {
+            drop(cache.lru.begin());
+        }
+        cache.max_bytes = 0;
+    }
+
+    switch_bool_t audio_cache_put(const char *id, const uint8_t *pcm, size_t len) {
+        if (!id || !len) return SWITCH_FALSE;
+
+        /* copied outside the lock: uploads do not hold up calls looking clips up */
+        auto *clip = new cached_clip();
+        clip->id = id;
+        clip->pcm.assign(pcm, pcm + len);
+        clip->data = clip->pcm.data();
+        clip->len = len;
+
+        std::lock_guard<std::mutex> lock(cache.mutex);
+        if (len > cache.max_bytes) {
+            delete clip;
+            return SWITCH_FALSE;
+        }
+        auto found = cache.index.find(clip->id);
+        if (found != cache.index.end()) {
+            drop(found->second);
+        }
+        while (cache.bytes + len > cache.max_bytes) {
+            drop(std::prev(cache.lru.end()));
+            stream_metrics_add(SM_CACHE_EVICTIONS, 1);
+        }
+        cache.lru.push_front(clip);
+        cache.index[clip->id] = cache.lru.begin();
+        cache.bytes += len;
+        return SWITCH_TRUE;
+    }
+
+    const audio_clip_t *audio_cache_get(const char *id) {
+        std::lock_guard<std::mutex> lock(cache.mutex);
+        auto found = cache.index.find(id);
+        if (found == cache.index.end()) {
+            stream_metrics_add(SM_CACHE_MISSES, 1);
+            return nullptr;
+        }
+        cache.lru.splice(cache.lru.begin(), cache.lru, found->second);
+        cached_clip *clip = *found->second;
+        clip->refs.fetch_add(1, std::memory_order_relaxed);
+        stream_metrics_add(SM_CACHE_HITS, 1);
+        return clip;
+    }
+
+    void audio_cache_release(const audio_clip_t *clip) {
+        if (clip) unref(static_cast<const cached_clip *>(clip));
+    }
+
+    cJSON *audio_cache_stats(void) {
+        cJSON *json = cJSON_CreateObject();
+        {
+            std::lock_guard<std::mutex> lock(cache.mutex);
+            cJSON_AddNumberToObject(json, "clips", (double) cache.lru.size());
+            cJSON_AddNumberToObject(json, "bytes", (double) cache.bytes);
+            cJSON_AddNumberToObject(json, "max_bytes", (double) cache.max_bytes);
+        }
+        cJSON_AddNumberToObject(json, "hits", (double) stream_metrics_counter(SM_CACHE_HITS));
+        cJSON_AddNumberToObject(json, "misses", (double) stream_metrics_counter(SM_CACHE_MISSES));
+        cJSON_AddNumberToObject(json, "evictions", (double) stream_metrics_counter(SM_CACHE_EVICTIONS));
+        return json;
+    }
+}
@@ -0,0 +1,45 @@
+#ifndef AUDIO_CACHE_H
+#define AUDIO_CACHE_H
+
+#include <switch.h>
+
+/*
+ * Module-wide cache of playback clips.
+ *
+ * The server uploads a clip once with cacheAudio and plays it on any call with
+ * playCached, instead of sending the same greeting or hold phrase as base64 on
+ * every call. Clips are stored decoded (8kHz L16, the playback format) and shared
+ * by all sessions; the least recently played ones are evicted once the total goes
+ * over the cap. A call plays a clip straight from the cache: it holds a reference
+ * until the last sample is in its playback buffer, so eviction or replacement
+ * never pulls a clip out from under a call.
+ */
+
+typedef struct audio_clip {
+    const uint8_t *data;        /* 8kHz L16 */
+    size_t len;
+} audio_clip_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* max_bytes 0 disables the cache: puts fail and every get misses */
+void audio_cache_init(size_t max_bytes);
+void audio_cache_shutdown(void);
+
+/* copies the clip in, replacing one with the same id; false when it is larger than the whole cache */
+switch_bool_t audio_cache_put(const char *id, const uint8_t *pcm, size_t len);
+
+/* a reference to the clip, to be released; NULL when it is not cached */
+const audio_clip_t *audio_cache_get(const char *id);
+void audio_cache_release(const audio_clip_t *clip);
+
+/* {"clips","bytes","max_bytes","hits","misses","evictions"} */
+cJSON *audio_cache_stats(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //AUDIO_CACHE_H
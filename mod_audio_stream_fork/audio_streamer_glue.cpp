@@ -8,18 +8,109 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <atomic>
+#include <algorithm>
+#include <cmath>
 #include <vector>
+#include <memory>
+#include <new>
+#include <thread>
 #include "base64.h"
+#include "stream_metrics.h"
+#include "json_arena.h"
+#include "json_scan.h"
+#include "audio_cache.h"
+#include "prompt_library.h"
+#ifdef HAVE_OPUS
+#include <opus/opus.h>
+#endif
 
 #define FRAME_SIZE_8000  320 /* 1000x0.02 (20ms)= 160 x(16bit= 2 bytes) 320 frame size*/
 
+/*
+ * Linear 16-bit PCM to μ-law conversion
+ * Standard ITU-T G.711 algorithm
+ */
+static inline uint8_t linear_to_ulaw(int16_t pcm_val)
+{
+    static const int16_t BIAS = 0x84;   /* Bias for linear code */
+    static const int16_t CLIP = 32635;
+    static const uint8_t exp_lut[256] = {
+        0,0,1,1,2,2,2,2,3,3,3,3,3,3,3,3,
+        4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,
+        5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,
+        5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,
+        6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,
+        6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,
+        6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,
+        6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,
+        7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
+        7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
+        7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
+        7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
+        7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
+        7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
+        7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
+        7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7
+    };
+    
+    int sign, exponent, mantissa;
+    uint8_t ulawbyte;
+    
+    /* Get the sign and the magnitude */
+    sign = (pcm_val >> 8) & 0x80;
+    if (sign != 0) pcm_val = -pcm_val;
+    if (pcm_val > CLIP) pcm_val = CLIP;
+    
+    /* Convert from 16 bit linear to ulaw */
+    pcm_val = pcm_val + BIAS;
+    exponent = exp_lut[(pcm_val >> 7) & 0xFF];
+    mantissa = (pcm_val >> (exponent + 3)) & 0x0F;
+    ulawbyte = ~(sign | (exponent << 4) | mantissa);
+    
+    return ulawbyte;
+}
+
+/* G.711 back to linear, ITU-T G.711 as above */
+static inline int16_t ulaw_to_linear(uint8_t u_val)
+{
+    u_val = ~u_val;
+    int t = ((u_val & 0x0F) << 3) + 0x84;
+    t <<= (u_val & 0x70) >> 4;
+    return (int16_t)((u_val & 0x80) ? (0x84 - t) : (t - 0x84));
+}
+
+static inline int16_t alaw_to_linear(uint8_t a_val)
+{
+    a_val ^= 0x55;
+    int t = (a_val & 0x0F) << 4;
+    const int seg = (a_val & 0x70) >> 4;
+    if (seg == 0) {
+        t += 8;
+    } else {
+        t = (t + 0x108) << (seg - 1);
+    }
+    return (int16_t)((a_val & 0x80) ? t : -t);
+}
+
+/*
+ * streamAudio held behind a feed, one chunk per block. Blocks are allocated and filled before
+ * playback_mutex is taken and only linked in under it; the held feed plays the first and steps
+ * down the chain, the first also knowing the last so a chunk is appended without a walk.
+ */
+struct held_chunk {
+    held_chunk *next = nullptr;
+    held_chunk *last = nullptr;
+    std::vector<uint8_t> pcm;
+};
+
 class AudioStreamer {
 public:
 
     AudioStreamer(const char* uuid, const char* wsUri, responseHandler_t callback, int deflate, int heart_beat,
                     bool suppressLog, const char* extra_headers, bool no_reconnect,
                     const char* tls_cafile, const char* tls_keyfile, const char* tls_certfile,
-                    bool tls_disable_hostname_validation): m_sessionId(uuid), m_notify(callback),
+                    bool tls_disable_hostname_validation, const char* metadata): m_sessionId(uuid), m_url(wsUri),
+                    m_metadata(metadata ? metadata : ""), m_notify(callback),
                     m_suppress_log(suppressLog), m_extra_headers(extra_headers), m_playFile(0){
 
         WebSocketHeaders hdrs;
@@ -76,7 +167,7 @@ public:
         // Setup a callback to be fired when a message or an event (open, close, error) is received
         client.setMessageCallback([this](const std::string& message) {
             if (this->isCleanedUp()) return;
-            eventCallback(MESSAGE, message.c_str());
+            messageCallback(message);
         });
 
         client.setOpenCallback([this]() {
@@ -139,24 +230,35 @@ public:
         auto *bug = get_media_bug(session);
         if(bug) {
             auto* tech_pvt = (private_t*) switch_core_media_bug_get_user_data(bug);
-            tech_pvt->close_requested = 1;
+            stream_state_set(tech_pvt, STREAM_STATE_CLOSE_REQUESTED);
             switch_core_media_bug_close(&bug, SWITCH_FALSE);
         }
     }
 
+    /* each destination gets the metadata it was started with, on its own connection only */
     inline void send_initial_metadata(switch_core_session_t *session) {
-        auto *bug = get_media_bug(session);
-        if(bug) {
-            auto* tech_pvt = (private_t*) switch_core_media_bug_get_user_data(bug);
-            if(tech_pvt && strlen(tech_pvt->initialMetadata) > 0) {
-                switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG,
-                                          "sending initial metadata %s\n", tech_pvt->initialMetadata);
-                writeText(tech_pvt->initialMetadata);
-            }
+        if(!m_metadata.empty()) {
+            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG,
+                                      "sending initial metadata %s\n", m_metadata.c_str());
+            sendText(m_metadata.c_str());
         }
     }
 
     void eventCallback(notifyEvent_t event, const char* message) {
+        switch (event) {
+            case CONNECT_SUCCESS:
+                stream_metrics_add(SM_CONNECT_SUCCESS, 1);
+                break;
+            case CONNECTION_DROPPED:
+                stream_metrics_add(SM_CONNECTION_DROPPED, 1);
+                break;
+            case CONNECT_ERROR:
+                stream_metrics_add(SM_CONNECT_ERROR, 1);
+                break;
+            case MESSAGE:
+                /* messages go through messageCallback */
+                break;
+        }
         switch_core_session_t* psession = switch_core_session_locate(m_sessionId.c_str());
         if(psession) {
             switch (event) {
@@ -172,51 +274,94 @@ public:
                     switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(psession), SWITCH_LOG_INFO, "connection error\n");
                     m_notify(psession, EVENT_ERROR, message);
 
-                    media_bug_close(psession);
+                    /* an added destination failing does not stop the others */
+                    if (isPrimary(psession)) {
+                        media_bug_close(psession);
+                    }
 
                     break;
                 case MESSAGE:
-                    std::string msg(message);
-                    if(processMessage(psession, msg) != SWITCH_TRUE) {
-                        m_notify(psession, EVENT_JSON, msg.c_str());
-                    }
-                    if(!m_suppress_log)
-                        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(psession), SWITCH_LOG_DEBUG, "response: %s\n", msg.c_str());
                     break;
             }
             switch_core_session_rwunlock(psession);
         }
     }
 
-    switch_bool_t processMessage(switch_core_session_t* session, std::string& message) {
+    /* Inbound messages, handled straight from the client's receive buffer */
+    void messageCallback(const std::string& message) {
+        stream_metrics_add(SM_MESSAGES_IN, 1);
+        stream_metrics_add(SM_BYTES_IN, message.size());
+        switch_core_session_t* psession = switch_core_session_locate(m_sessionId.c_str());
+        if(psession) {
+            const uint64_t msg_start = stream_metrics_now_ns();
+            private_t *tech_pvt = get_tech_pvt(psession);
+            switch_bool_t handled = processMessage(psession, tech_pvt, message);
+            stream_latency_record(SM_HIST_PROCESS_MESSAGE, tech_pvt ? &tech_pvt->stats->message : nullptr,
+                                  stream_metrics_now_ns() - msg_start, tech_pvt ? tech_pvt->stats->slow_ns : 0);
+            if(handled != SWITCH_TRUE) {
+                m_notify(psession, EVENT_JSON, message.c_str());
+            }
+            if(!m_suppress_log)
+                switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(psession), SWITCH_LOG_DEBUG, "response: %s\n", message.c_str());
+            switch_core_session_rwunlock(psession);
+        }
+    }
+
+    /* The channel stores the media bug, not tech_pvt directly */
+    private_t *get_tech_pvt(switch_core_session_t *session) {
+        auto *bug = get_media_bug(session);
+        return bug ? (private_t *) switch_core_media_bug_get_user_data(bug) : nullptr;
+    }
+
+    /* the destination the capture was started with, as opposed to one added with a later start */
+    bool isPrimary(switch_core_session_t *session) {
+        private_t *tech_pvt = get_tech_pvt(session);
+        return tech_pvt && __atomic_load_n(&tech_pvt->pAudioStreamer, __ATOMIC_ACQUIRE) == this;
+    }
+
+    switch_bool_t processMessage(switch_core_session_t* session, private_t *tech_pvt, const std::string& message) {
+        /* per-chunk control messages are recognised in place, everything else goes through cJSON */
+        json_msg_t msg;
+        const uint64_t scan_start = stream_metrics_now_ns();
+        if (json_scan_message(message.data(), message.size(), &msg)) {
+            stream_metrics_observe(SM_HIST_JSON_PARSE, stream_metrics_now_ns() - scan_start);
+            if (msg.type == JSON_MSG_STOP_AUDIO) {
+                stopAudio(session, tech_pvt);
+                return SWITCH_TRUE;
+            }
+            if (tech_pvt && tech_pvt->playback_buffer) {
+                return streamAudio(session, tech_pvt, msg.audio_data, msg.audio_len, msg.opus, nullptr, msg.id, msg.id_len,
+                                   msg.utterance, msg.utterance_len);
+            }
+            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
+                "(%s) streamAudio - missing data or buffer\n", m_sessionId.c_str());
+            return SWITCH_FALSE;
+        }
+
+        /* the tree, detached items included, must be deleted before this goes out of scope */
+        json_arena_scope arena;
+        const uint64_t parse_start = stream_metrics_now_ns();
         cJSON* json = cJSON_Parse(message.c_str());
+        stream_metrics_observe(SM_HIST_JSON_PARSE, stream_metrics_now_ns() - parse_start);
         switch_bool_t status = SWITCH_FALSE;
         if (!json) {
             return status;
         }
         
-        /* Get tech_pvt for playback buffer access 
-         * The channel stores the media bug, not tech_pvt directly.
-         * We need to get the bug first, then extract user_data.
-         */
-        switch_channel_t *channel = switch_core_session_get_channel(session);
-        switch_media_bug_t *bug = (switch_media_bug_t *)switch_channel_get_private(channel, MY_BUG_NAME);
-        private_t *tech_pvt = NULL;
-        if (bug) {
-            tech_pvt = (private_t *)switch_core_media_bug_get_user_data(bug);
-        }
-        
         const char* jsType = cJSON_GetObjectCstr(json, "type");
         
         // NETPLAY: stopAudio - clear playback buffer (barge-in)
         if(jsType && strcmp(jsType, "stopAudio") == 0) {
-            if (tech_pvt && tech_pvt->playback_buffer) {
+            stopAudio(session, tech_pvt);
+            status = SWITCH_TRUE;
+        }
+        // mark echoed by the server: the audio queued after it closes the round trip
+        else if(jsType && strcmp(jsType, "mark") == 0) {
+            cJSON* jsonData = cJSON_GetObjectItem(json, "data");
+            if (jsonData && tech_pvt && tech_pvt->playback_buffer) {
                 switch_mutex_lock(tech_pvt->playback_mutex);
-                switch_buffer_zero(tech_pvt->playback_buffer);
-                tech_pvt->playback_active = 0;
+                queue_mark(tech_pvt, jsonData);
                 switch_mutex_unlock(tech_pvt->playback_mutex);
-                switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, 
-                    "(%s) 🛑 Playback stopped (barge-in)\n", m_sessionId.c_str());
             }
             status = SWITCH_TRUE;
         }
@@ -224,69 +369,667 @@ public:
         else if(jsType && strcmp(jsType, "streamAudio") == 0) {
             cJSON* jsonData = cJSON_GetObjectItem(json, "data");
             if(jsonData && tech_pvt && tech_pvt->playback_buffer) {
-                cJSON* jsonAudio = cJSON_DetachItemFromObject(jsonData, "audioData");
+                cJSON* jsonAudio = cJSON_GetObjectItem(jsonData, "audioData");
                 const char* jsAudioDataType = cJSON_GetObjectCstr(jsonData, "audioDataType");
                 
-                if (jsAudioDataType && strcmp(jsAudioDataType, "raw") == 0 && jsonAudio && jsonAudio->valuestring) {
-                    std::string rawAudio;
-                    try {
-                        rawAudio = base64_decode(jsonAudio->valuestring);
-                    } catch (const std::exception& e) {
-                        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, 
-                            "(%s) base64 decode error: %s\n", m_sessionId.c_str(), e.what());
-                        cJSON_Delete(jsonAudio); 
-                        cJSON_Delete(json);
-                        return status;
-                    }
-                    
-                    switch_mutex_lock(tech_pvt->playback_mutex);
-                    
-                    /* Check for buffer overrun - if near full, discard oldest data */
-                    const switch_size_t buffer_capacity = 32000;  /* 2 seconds @ 8kHz L16 */
-                    const switch_size_t high_water_mark = buffer_capacity - rawAudio.size();
-                    switch_size_t current_size = switch_buffer_inuse(tech_pvt->playback_buffer);
-                    
-                    if (current_size > high_water_mark) {
-                        /* Buffer nearly full - discard oldest data to make room */
-                        switch_size_t to_discard = current_size - high_water_mark + rawAudio.size();
-                        char discard_buf[1024];
-                        while (to_discard > 0) {
-                            switch_size_t chunk = (to_discard > sizeof(discard_buf)) ? sizeof(discard_buf) : to_discard;
-                            switch_buffer_read(tech_pvt->playback_buffer, discard_buf, chunk);
-                            to_discard -= chunk;
-                        }
-                        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING, 
-                            "(%s) ⚠️ Buffer overrun - discarded old data\n", m_sessionId.c_str());
-                    }
-                    
-                    /* Write new audio to buffer */
-                    switch_buffer_write(tech_pvt->playback_buffer, rawAudio.data(), rawAudio.size());
-                    
-                    switch_size_t buffered = switch_buffer_inuse(tech_pvt->playback_buffer);
-                    switch_mutex_unlock(tech_pvt->playback_mutex);
-                    
-                    /* Log every 50 chunks or on significant events */
-                    static int chunk_count = 0;
-                    if (++chunk_count % 50 == 1 || buffered < 1000) {
-                        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, 
-                            "(%s) 📝 Buffer: +%zu bytes (total: %zu, active: %d)\n", 
-                            m_sessionId.c_str(), rawAudio.size(), buffered, tech_pvt->playback_active);
-                    }
-                    
-                    status = SWITCH_TRUE;
+                const bool opus = jsAudioDataType && strcmp(jsAudioDataType, "opus") == 0;
+                if (jsAudioDataType && (opus || strcmp(jsAudioDataType, "raw") == 0) && jsonAudio && jsonAudio->valuestring) {
+                    /* the id is only echoed back in its playbackAck, as JSON text */
+                    char id[STREAM_CHUNK_ID_MAX + 1];
+                    const size_t id_len = chunk_id_json(cJSON_GetObjectItem(jsonData, "id"), id, sizeof(id));
+                    const char* utterance = cJSON_GetObjectCstr(jsonData, "utterance");
+                    status = streamAudio(session, tech_pvt, jsonAudio->valuestring, strlen(jsonAudio->valuestring), opus,
+                                         cJSON_GetObjectItem(jsonData, "mark"), id_len ? id : nullptr, id_len,
+                                         utterance, utterance ? strlen(utterance) : 0);
                 }
-                
-                if (jsonAudio)
-                    cJSON_Delete(jsonAudio);
             } else {
                 switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, 
                     "(%s) streamAudio - missing data or buffer\n", m_sessionId.c_str());
             }
         }
+        // a clip uploaded once and played on any call with playCached
+        else if(jsType && strcmp(jsType, "cacheAudio") == 0) {
+            cJSON* jsonData = cJSON_GetObjectItem(json, "data");
+            const char* clipId = jsonData ? cJSON_GetObjectCstr(jsonData, "id") : nullptr;
+            const char* jsAudioDataType = jsonData ? cJSON_GetObjectCstr(jsonData, "audioDataType") : nullptr;
+            cJSON* jsonAudio = jsonData ? cJSON_GetObjectItem(jsonData, "audioData") : nullptr;
+            if (clipId && jsAudioDataType && strcmp(jsAudioDataType, "raw") == 0 && jsonAudio && jsonAudio->valuestring) {
+                status = cacheAudio(session, clipId, jsonAudio->valuestring, strlen(jsonAudio->valuestring));
+            } else {
+                switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
+                    "(%s) cacheAudio - missing id or raw audioData\n", m_sessionId.c_str());
+            }
+        }
+        else if(jsType && strcmp(jsType, "playCached") == 0) {
+            cJSON* jsonData = cJSON_GetObjectItem(json, "data");
+            cJSON* jsonId = jsonData ? cJSON_GetObjectItem(jsonData, "id") : nullptr;
+            if (jsonId && jsonId->type == cJSON_String && tech_pvt && tech_pvt->playback_buffer) {
+                status = playCached(session, tech_pvt, jsonId, cJSON_GetObjectItem(jsonData, "mark"),
+                                    cJSON_GetObjectCstr(jsonData, "utterance"));
+            } else {
+                switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
+                    "(%s) playCached - missing id or buffer\n", m_sessionId.c_str());
+            }
+        }
+        // a prompt of the library in audio_stream_prompt_dir
+        else if(jsType && strcmp(jsType, "playLocal") == 0) {
+            cJSON* jsonData = cJSON_GetObjectItem(json, "data");
+            const char* name = jsonData ? cJSON_GetObjectCstr(jsonData, "name") : nullptr;
+            if (name && tech_pvt && tech_pvt->playback_buffer) {
+                status = playLocal(session, tech_pvt, name, cJSON_GetObjectItem(jsonData, "mark"),
+                                   cJSON_GetObjectCstr(jsonData, "utterance"));
+            } else {
+                switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
+                    "(%s) playLocal - missing name or buffer\n", m_sessionId.c_str());
+            }
+        }
+        // cancel queued utterances: "utterance" only that one, "upTo" every one queued up to and including it
+        else if(jsType && strcmp(jsType, "cancelAudio") == 0) {
+            cJSON* jsonData = cJSON_GetObjectItem(json, "data");
+            const char* utterance = jsonData ? cJSON_GetObjectCstr(jsonData, "utterance") : nullptr;
+            const char* upTo = jsonData ? cJSON_GetObjectCstr(jsonData, "upTo") : nullptr;
+            if ((utterance || upTo) && tech_pvt && tech_pvt->playback_buffer) {
+                cancelAudio(session, tech_pvt, upTo ? upTo : utterance, upTo != nullptr);
+                status = SWITCH_TRUE;
+            } else {
+                switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
+                    "(%s) cancelAudio - missing utterance or buffer\n", m_sessionId.c_str());
+            }
+        }
         cJSON_Delete(json);
         return status;
     }
 
+    void stopAudio(switch_core_session_t* session, private_t *tech_pvt) {
+        if (tech_pvt && tech_pvt->playback_buffer) {
+            switch_mutex_lock(tech_pvt->playback_mutex);
+            switch_buffer_zero(tech_pvt->playback_buffer);
+            tech_pvt->playback_active = 0;
+            clear_feeds(tech_pvt->scratch->queue);
+            cancel_segments(tech_pvt, nullptr, false);
+            cut_chunks(tech_pvt, tech_pvt->playback_played, tech_pvt->playback_written);
+            tech_pvt->playback_played = tech_pvt->playback_written;
+            tech_pvt->marks_count = 0;
+            switch_mutex_unlock(tech_pvt->playback_mutex);
+#ifdef HAVE_OPUS
+            /* the next response is a new Opus stream */
+            if (!m_opus.empty()) {
+                opus_decoder_ctl((OpusDecoder *) m_opus.data(), OPUS_RESET_STATE);
+            }
+#endif
+            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, 
+                "(%s) 🛑 Playback stopped (barge-in)\n", m_sessionId.c_str());
+        }
+    }
+
+    /* leaves the rest of the playback buffer alone; the media thread tosses the cancelled audio when it gets there */
+    void cancelAudio(switch_core_session_t* session, private_t *tech_pvt, const char *utterance, bool up_to) {
+        switch_mutex_lock(tech_pvt->playback_mutex);
+        const uint32_t cancelled = cancel_segments(tech_pvt, utterance, up_to);
+        switch_mutex_unlock(tech_pvt->playback_mutex);
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO,
+            "(%s) 🛑 Playback cancelled %s utterance %s: %u segment(s)\n",
+            m_sessionId.c_str(), up_to ? "up to" : "", utterance, cancelled);
+    }
+
+    /*
+     * Decodes a base64 chunk into the playback buffer: raw 8kHz L16, or with opus one Opus packet decoded here
+     * to the same format, so the media thread still only copies. jsonMark, when given, is queued ahead of it;
+     * id, the chunk's "id" as JSON text, is acknowledged once the chunk has played out (STREAM_PLAYBACK_ACKS).
+     * The chunk joins the playback segment of utterance, see stream_segment_t.
+     */
+    switch_bool_t streamAudio(switch_core_session_t* session, private_t *tech_pvt, const char *audio, size_t audio_len,
+                              bool opus, cJSON *jsonMark, const char *id, size_t id_len,
+                              const char *utterance, size_t utterance_len) {
+#ifndef HAVE_OPUS
+        if (opus) {
+            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
+                "(%s) Opus streamAudio received but mod_audio_stream was built without libopus\n", m_sessionId.c_str());
+            return SWITCH_FALSE;
+        }
+#endif
+        if (utterance_len >= STREAM_UTTERANCE_MAX) {
+            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
+                "(%s) streamAudio utterance longer than %d characters\n", m_sessionId.c_str(), STREAM_UTTERANCE_MAX - 1);
+            return SWITCH_FALSE;
+        }
+        size_t raw_len = 0;
+        /* only ever grows, so steady-state chunks decode without allocating */
+        if (!decodeBase64(session, audio, audio_len, m_decoded, raw_len)) {
+            return SWITCH_FALSE;
+        }
+
+        const unsigned char *pcm = m_decoded.data();
+#ifdef HAVE_OPUS
+        if (opus) {
+            if (!decodeOpus(session, raw_len)) {
+                return SWITCH_FALSE;
+            }
+            pcm = (const unsigned char *) m_pcm;
+        }
+#endif
+        
+        return queueAudio(session, tech_pvt, pcm, raw_len, nullptr, opus, jsonMark, id, id_len, utterance, utterance_len);
+    }
+
+    /*
+     * Queues decoded playback behind what is queued already. pcm is copied into the playback buffer; a feed is
+     * played from where it is and its reference is released here when it is not queued. While a feed is queued,
+     * pcm is held behind it so the order is kept.
+     */
+    switch_bool_t queueAudio(switch_core_session_t* session, private_t *tech_pvt, const unsigned char *pcm, size_t raw_len,
+                             const stream_feed_t *feed, bool opus, cJSON *jsonMark, const char *id, size_t id_len,
+                             const char *utterance, size_t utterance_len) {
+        stream_queue_t *queue = tech_pvt->scratch->queue;
+        /* pcm that may have to wait behind a feed is copied before the media thread's lock is taken */
+        std::unique_ptr<held_chunk> chunk;
+        if (!feed && __atomic_load_n(&queue->feeds_count, __ATOMIC_RELAXED)) {
+            chunk = make_held(pcm, raw_len);
+        }
+        switch_mutex_lock(tech_pvt->playback_mutex);
+        if (!feed && !chunk && queue->feeds_count) {
+            /* a feed was queued meanwhile, from another destination */
+            switch_mutex_unlock(tech_pvt->playback_mutex);
+            chunk = make_held(pcm, raw_len);
+            if (!chunk) {
+                switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
+                    "(%s) playback dropped: no memory to hold %zu bytes behind a clip\n", m_sessionId.c_str(), raw_len);
+                return SWITCH_FALSE;
+            }
+            switch_mutex_lock(tech_pvt->playback_mutex);
+        }
+
+        /* in flight when the server cancelled its utterance; decoded all the same, an Opus stream goes on */
+        if (utterance_len && segment_cancelled(tech_pvt, utterance, utterance_len)) {
+            switch_mutex_unlock(tech_pvt->playback_mutex);
+            release_feed(feed);
+            return SWITCH_TRUE;
+        }
+        const bool held = feed || queue->feeds_count;
+        if (held && !can_hold(queue, feed, raw_len)) {
+            switch_mutex_unlock(tech_pvt->playback_mutex);
+            release_feed(feed);
+            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
+                "(%s) playback dropped: too much audio queued behind a clip\n", m_sessionId.c_str());
+            return SWITCH_FALSE;
+        }
+        if (!queue_segment(tech_pvt, utterance, utterance_len, opus, raw_len)) {
+            switch_mutex_unlock(tech_pvt->playback_mutex);
+            release_feed(feed);
+            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
+                "(%s) playback dropped: %d utterances already queued\n", m_sessionId.c_str(), STREAM_SEGMENTS_MAX);
+            return SWITCH_FALSE;
+        }
+
+        if (jsonMark) {
+            queue_mark(tech_pvt, jsonMark);
+        }
+
+        if (held) {
+            hold(queue, feed, chunk.release());
+        } else {
+            /* Check for buffer overrun - if near full, discard oldest data */
+            const switch_size_t buffer_capacity = 32000;  /* 2 seconds @ 8kHz L16 */
+            const switch_size_t high_water_mark = buffer_capacity - raw_len;
+            switch_size_t current_size = switch_buffer_inuse(tech_pvt->playback_buffer);
+
+            if (current_size > high_water_mark) {
+                /* Buffer nearly full - discard oldest data to make room */
+                switch_size_t to_discard = current_size - high_water_mark + raw_len;
+                char discard_buf[1024];
+                while (to_discard > 0) {
+                    switch_size_t chunk = (to_discard > sizeof(discard_buf)) ? sizeof(discard_buf) : to_discard;
+                    switch_size_t discarded = switch_buffer_read(tech_pvt->playback_buffer, discard_buf, chunk);
+                    skip_chunks(tech_pvt, tech_pvt->playback_played, tech_pvt->playback_played + discarded);
+                    skip_segments(tech_pvt, tech_pvt->playback_played, tech_pvt->playback_played + discarded);
+                    tech_pvt->playback_played += discarded;
+                    to_discard -= chunk;
+                }
+                stream_metrics_add(SM_PLAYBACK_OVERRUNS, 1);
+                __atomic_fetch_add(&tech_pvt->stats->playback_overruns, 1, __ATOMIC_RELAXED);
+                switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING,
+                    "(%s) ⚠️ Buffer overrun - discarded old data\n", m_sessionId.c_str());
+            }
+
+            /* Write new audio to buffer */
+            switch_buffer_write(tech_pvt->playback_buffer, pcm, raw_len);
+        }
+        const bool tracked = !id || queue_chunk(tech_pvt, id, id_len, this, raw_len);
+        tech_pvt->playback_written += raw_len;
+        
+        switch_size_t buffered = switch_buffer_inuse(tech_pvt->playback_buffer);
+        switch_mutex_unlock(tech_pvt->playback_mutex);
+
+        if (!tracked) {
+            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING,
+                "(%s) streamAudio id %.*s not acknowledged: too long or too many chunks pending\n",
+                m_sessionId.c_str(), (int) std::min(id_len, (size_t) 64), id);
+        }
+        
+        /* Log every 50 chunks or on significant events */
+        static int chunk_count = 0;
+        if (++chunk_count % 50 == 1 || buffered < 1000) {
+            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, 
+                "(%s) 📝 Buffer: +%zu bytes (total: %zu, active: %d)\n", 
+                m_sessionId.c_str(), raw_len, buffered, tech_pvt->playback_active);
+        }
+        
+        return SWITCH_TRUE;
+    }
+
+    /* Stores a clip the server will play on this or any other call with playCached */
+    switch_bool_t cacheAudio(switch_core_session_t* session, const char *clipId, const char *audio, size_t audio_len) {
+        /* not m_decoded: a clip is much larger than a chunk and only decoded once */
+        std::vector<unsigned char> pcm;
+        size_t raw_len = 0;
+        if (!decodeBase64(session, audio, audio_len, pcm, raw_len)) {
+            return SWITCH_FALSE;
+        }
+        raw_len &= ~(size_t) 1;
+        if (!audio_cache_put(clipId, pcm.data(), raw_len)) {
+            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
+                "(%s) cacheAudio %s: %zu bytes do not fit the clip cache\n", m_sessionId.c_str(), clipId, raw_len);
+            return SWITCH_FALSE;
+        }
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO,
+            "(%s) cacheAudio %s: %zums cached\n", m_sessionId.c_str(), clipId, raw_len / 16);
+        return SWITCH_TRUE;
+    }
+
+    /* Plays a cached clip from the cache; on a miss the server is told so it can send the audio instead */
+    switch_bool_t playCached(switch_core_session_t* session, private_t *tech_pvt, cJSON *jsonId, cJSON *jsonMark,
+                             const char *utterance) {
+        const size_t utterance_len = utterance ? strlen(utterance) : 0;
+        if (utterance_len >= STREAM_UTTERANCE_MAX) {
+            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
+                "(%s) playCached utterance longer than %d characters\n", m_sessionId.c_str(), STREAM_UTTERANCE_MAX - 1);
+            return SWITCH_FALSE;
+        }
+        const audio_clip_t *clip = audio_cache_get(jsonId->valuestring);
+        if (!clip) {
+            char id[STREAM_CHUNK_ID_MAX + 1];
+            char miss[STREAM_CHUNK_ID_MAX + 64];
+            const size_t id_len = chunk_id_json(jsonId, id, sizeof(id));
+            snprintf(miss, sizeof(miss), "{\"type\":\"cacheMiss\",\"id\":%s}", id_len && id_len < sizeof(id) ? id : "null");
+            reply(miss);
+            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING,
+                "(%s) playCached %s: not cached\n", m_sessionId.c_str(), jsonId->valuestring);
+            return SWITCH_FALSE;
+        }
+        const stream_feed_t feed = { clip->data, clip->len, 0, (void *) clip, release_clip, STREAM_FEED_L16, 0, nullptr };
+        return queueAudio(session, tech_pvt, nullptr, clip->len, &feed, false, jsonMark, nullptr, 0, utterance, utterance_len);
+    }
+
+    /* Plays a prompt of the library loaded from audio_stream_prompt_dir, straight from its mapping */
+    switch_bool_t playLocal(switch_core_session_t* session, private_t *tech_pvt, const char *name, cJSON *jsonMark,
+                            const char *utterance) {
+        const size_t utterance_len = utterance ? strlen(utterance) : 0;
+        if (utterance_len >= STREAM_UTTERANCE_MAX) {
+            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
+                "(%s) playLocal utterance longer than %d characters\n", m_sessionId.c_str(), STREAM_UTTERANCE_MAX - 1);
+            return SWITCH_FALSE;
+        }
+        const prompt_t *prompt = prompt_library_get(name);
+        if (!prompt) {
+            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING,
+                "(%s) playLocal %s: no such prompt\n", m_sessionId.c_str(), name);
+            return SWITCH_FALSE;
+        }
+        /* G.711 prompts are decoded a frame at a time as they are played, so every position counts L16 bytes */
+        const stream_feed_t feed = {
+            prompt->data, prompt->format == PROMPT_L16 ? prompt->len : prompt->len * sizeof(int16_t), 0,
+            (void *) prompt, release_prompt,
+            prompt->format == PROMPT_PCMU ? STREAM_FEED_PCMU : prompt->format == PROMPT_PCMA ? STREAM_FEED_PCMA : STREAM_FEED_L16,
+            0, nullptr
+        };
+        return queueAudio(session, tech_pvt, nullptr, feed.len, &feed, false, jsonMark, nullptr, 0, utterance, utterance_len);
+    }
+
+    bool decodeBase64(switch_core_session_t *session, const char *audio, size_t audio_len,
+                      std::vector<unsigned char> &out, size_t &raw_len) {
+        const uint64_t decode_start = stream_metrics_now_ns();
+        try {
+            if (out.size() < audio_len / 4 * 3 + 3) {
+                out.resize(audio_len / 4 * 3 + 3);
+            }
+            raw_len = base64_decode(audio, audio_len, out.data());
+            stream_metrics_observe(SM_HIST_BASE64_DECODE, stream_metrics_now_ns() - decode_start);
+        } catch (const std::exception& e) {
+            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, 
+                "(%s) base64 decode error: %s\n", m_sessionId.c_str(), e.what());
+            return false;
+        }
+        return true;
+    }
+
+#ifdef HAVE_OPUS
+    /* Replaces packet_len bytes of Opus in m_decoded by the PCM length in m_pcm; any encoded rate decodes to 8kHz directly */
+    bool decodeOpus(switch_core_session_t *session, size_t &packet_len) {
+        const uint64_t decode_start = stream_metrics_now_ns();
+        if (m_opus.empty()) {
+            m_opus.resize(opus_decoder_get_size(1));
+            const int err = opus_decoder_init((OpusDecoder *) m_opus.data(), 8000, 1);
+            if (err != OPUS_OK) {
+                m_opus.clear();
+                switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
+                    "(%s) Opus decoder init error: %s\n", m_sessionId.c_str(), opus_strerror(err));
+                return false;
+            }
+        }
+        const int samples = opus_decode((OpusDecoder *) m_opus.data(), m_decoded.data(), (opus_int32) packet_len,
+                                        m_pcm, OPUS_DECODE_MAX, 0);
+        if (samples < 0) {
+            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
+                "(%s) Opus decode error: %s\n", m_sessionId.c_str(), opus_strerror(samples));
+            return false;
+        }
+        packet_len = (size_t) samples * sizeof(int16_t);
+        stream_metrics_observe(SM_HIST_OPUS_DECODE, stream_metrics_now_ns() - decode_start);
+        return true;
+    }
+#endif
+
+    /* caller holds playback_mutex */
+    static void queue_mark(private_t *tech_pvt, cJSON *jsonMark) {
+        cJSON *seq = cJSON_GetObjectItem(jsonMark, "seq");
+        cJSON *ts = cJSON_GetObjectItem(jsonMark, "ts");
+        cJSON *recvTs = cJSON_GetObjectItem(jsonMark, "recvTs");
+        cJSON *sendTs = cJSON_GetObjectItem(jsonMark, "sendTs");
+        const uint64_t now = stream_metrics_now_ns();
+
+        if (!ts || ts->type != cJSON_Number || ts->valuedouble <= 0) return;
+        const uint64_t sent_ns = (uint64_t)ts->valuedouble * 1000;
+        if (sent_ns > now) return;
+        if (tech_pvt->marks_count == MAX_PENDING_MARKS) {
+            /* oldest never played out (stopped or discarded response) */
+            tech_pvt->marks_head = (tech_pvt->marks_head + 1) % MAX_PENDING_MARKS;
+            tech_pvt->marks_count--;
+        }
+
+        stream_mark_t *mark = &tech_pvt->marks[(tech_pvt->marks_head + tech_pvt->marks_count) % MAX_PENDING_MARKS];
+        mark->seq = seq && seq->type == cJSON_Number ? (uint32_t)seq->valuedouble : 0;
+        mark->sent_ns = sent_ns;
+        mark->echo_ns = now;
+        mark->server_ns = -1;
+        if (recvTs && sendTs && recvTs->type == cJSON_Number && sendTs->type == cJSON_Number &&
+            sendTs->valuedouble >= recvTs->valuedouble) {
+            mark->server_ns = (int64_t)((sendTs->valuedouble - recvTs->valuedouble) * 1000000.0);
+        }
+        mark->position = tech_pvt->playback_written;
+        tech_pvt->marks_count++;
+    }
+
+    /*
+     * A string or number "id" written back as JSON into out; cap when it does not fit, so queue_chunk
+     * rejects it, and 0 when there is no usable id.
+     */
+    static size_t chunk_id_json(const cJSON *jsonId, char *out, size_t cap) {
+        if (!jsonId) return 0;
+        if (jsonId->type == cJSON_Number) {
+            const double v = jsonId->valuedouble;
+            const bool integral = v > -9e15 && v < 9e15 && v == (double)(int64_t) v;
+            const int n = integral ? snprintf(out, cap, "%lld", (long long) v) : snprintf(out, cap, "%.17g", v);
+            return n < 0 ? 0 : std::min((size_t) n, cap);
+        }
+        if (jsonId->type != cJSON_String || !jsonId->valuestring) return 0;
+        size_t n = 0;
+        out[n++] = '"';
+        for (const unsigned char *c = (const unsigned char *) jsonId->valuestring; *c; c++) {
+            if (n + 7 >= cap) {
+                out[n] = '\0';
+                return cap;
+            }
+            if (*c == '"' || *c == '\\') {
+                out[n++] = '\\';
+                out[n++] = (char) *c;
+            } else if (*c < 0x20) {
+                n += snprintf(out + n, cap - n, "\\u%04x", *c);
+            } else {
+                out[n++] = (char) *c;
+            }
+        }
+        out[n++] = '"';
+        out[n] = '\0';
+        return n;
+    }
+
+    /*
+     * caller holds playback_mutex; the chunk about to be added at playback_written. Only with STREAM_PLAYBACK_ACKS,
+     * returns false when the id is too long or the queue is full, the chunk then plays without an ack.
+     */
+    static bool queue_chunk(private_t *tech_pvt, const char *id, size_t id_len, void *origin, size_t len) {
+        stream_report_t *report = tech_pvt->scratch->report;
+        if (!report || !report->acks) return true;
+        if (id_len >= STREAM_CHUNK_ID_MAX || report->chunks_count == STREAM_CHUNKS_MAX) return false;
+
+        stream_chunk_t *chunk = &report->chunks[(report->chunks_head + report->chunks_count) % STREAM_CHUNKS_MAX];
+        chunk->start = tech_pvt->playback_written;
+        chunk->end = tech_pvt->playback_written + len;
+        chunk->skipped = 0;
+        chunk->heard = 0;
+        chunk->origin = origin;
+        chunk->interrupted = 0;
+        memcpy(chunk->id, id, id_len);
+        chunk->id[id_len] = '\0';
+        report->chunks_count++;
+        return true;
+    }
+
+    /* caller holds playback_mutex; playback bytes [from, to) were discarded unplayed */
+    static void skip_chunks(private_t *tech_pvt, uint64_t from, uint64_t to) {
+        stream_report_t *report = tech_pvt->scratch->report;
+        if (!report) return;
+        for (uint32_t i = 0; i < report->chunks_count; i++) {
+            stream_chunk_t *chunk = &report->chunks[(report->chunks_head + i) % STREAM_CHUNKS_MAX];
+            if (chunk->start >= to) break;
+            const uint64_t lo = std::max(chunk->start, from);
+            const uint64_t hi = std::min(chunk->end, to);
+            if (hi > lo) chunk->skipped += hi - lo;
+        }
+    }
+
+    /*
+     * caller holds playback_mutex; playback [from, to) is dropped (stopAudio, cancelAudio): its chunks are acknowledged
+     * as cut. The walk starts at chunk first; returns the first one ending past to, where the next, later range starts.
+     */
+    static uint32_t cut_chunks(private_t *tech_pvt, uint64_t from, uint64_t to, uint32_t first = 0) {
+        stream_report_t *report = tech_pvt->scratch->report;
+        if (!report) return first;
+        const uint64_t played = tech_pvt->playback_played;
+        uint32_t next = first;
+        for (uint32_t i = first; i < report->chunks_count; i++) {
+            stream_chunk_t *chunk = &report->chunks[(report->chunks_head + i) % STREAM_CHUNKS_MAX];
+            if (chunk->start >= to) break;
+            if (chunk->end <= to) next = i + 1;
+            if (chunk->interrupted || chunk->end <= played || chunk->end <= from) continue;
+            const uint64_t heard = played > chunk->start ? std::min(played, chunk->end) - chunk->start : 0;
+            chunk->heard = heard > chunk->skipped ? heard - chunk->skipped : 0;
+            chunk->interrupted = 1;
+        }
+        return next;
+    }
+
+    /*
+     * caller holds playback_mutex; the chunk about to be added at playback_written extends the last segment when it
+     * continues the same utterance. false when STREAM_SEGMENTS_MAX segments are queued already.
+     */
+    static bool queue_segment(private_t *tech_pvt, const char *utterance, size_t len, bool opus, size_t raw_len) {
+        stream_queue_t *queue = tech_pvt->scratch->queue;
+        if (queue->count) {
+            stream_segment_t *tail = &queue->segments[(queue->head + queue->count - 1) % STREAM_SEGMENTS_MAX];
+            if (!tail->cancelled && tail->end == tech_pvt->playback_written &&
+                strncmp(tail->id, utterance ? utterance : "", len) == 0 && tail->id[len] == '\0') {
+                tail->end += raw_len;
+                return true;
+            }
+        }
+        if (queue->count == STREAM_SEGMENTS_MAX) return false;
+
+        stream_segment_t *segment = &queue->segments[(queue->head + queue->count) % STREAM_SEGMENTS_MAX];
+        segment->start = tech_pvt->playback_written;
+        segment->end = tech_pvt->playback_written + raw_len;
+        segment->skipped = 0;
+        segment->heard = 0;
+        segment->cancelled = 0;
+        segment->started = 0;
+        segment->opus = opus ? 1 : 0;
+        if (len) memcpy(segment->id, utterance, len);
+        segment->id[len] = '\0';
+        queue->count++;
+        return true;
+    }
+
+    static void release_feed(const stream_feed_t *feed) {
+        if (feed && feed->release) feed->release(feed->ref);
+    }
+
+    static void release_clip(void *ref) {
+        audio_cache_release((const audio_clip_t *) ref);
+    }
+
+    static void release_prompt(void *ref) {
+        prompt_library_release((const prompt_t *) ref);
+    }
+
+    /* nullptr when out of memory */
+    static std::unique_ptr<held_chunk> make_held(const uint8_t *pcm, size_t len) {
+        try {
+            std::unique_ptr<held_chunk> chunk(new held_chunk());
+            chunk->pcm.assign(pcm, pcm + len);
+            chunk->last = chunk.get();
+            return chunk;
+        } catch (const std::bad_alloc &) {
+            return nullptr;
+        }
+    }
+
+    /* ref is the chunk being played, the rest of the chain goes with it */
+    static void release_held(void *ref) {
+        auto *chunk = (held_chunk *) ref;
+        while (chunk) {
+            held_chunk *next = chunk->next;
+            delete chunk;
+            chunk = next;
+        }
+    }
+
+    /* the media thread, under playback_mutex: the chunk played is done with */
+    static int next_held(stream_feed_t *feed) {
+        auto *chunk = (held_chunk *) feed->ref;
+        held_chunk *next = chunk->next;
+        if (!next) return 0;
+        next->last = chunk->last;
+        delete chunk;
+        feed->ref = next;
+        feed->data = next->pcm.data();
+        feed->len = next->pcm.size();
+        feed->offset = 0;
+        feed->more -= feed->len;
+        return 1;
+    }
+
+    static stream_feed_t *tail_feed(stream_queue_t *queue) {
+        return queue->feeds_count ? &queue->feeds[(queue->feeds_head + queue->feeds_count - 1) % STREAM_FEEDS_MAX] : nullptr;
+    }
+
+    /* caller holds playback_mutex */
+    static bool can_hold(stream_queue_t *queue, const stream_feed_t *feed, size_t len) {
+        const stream_feed_t *tail = tail_feed(queue);
+        if (!feed && tail && tail->release == release_held) {
+            return tail->len - tail->offset + tail->more + len <= STREAM_FEED_HELD_MAX;
+        }
+        return queue->feeds_count < STREAM_FEEDS_MAX;
+    }
+
+    /* caller holds playback_mutex and checked can_hold; takes the feed or the chunk, only links them in */
+    static void hold(stream_queue_t *queue, const stream_feed_t *feed, held_chunk *chunk) {
+        stream_feed_t *tail = tail_feed(queue);
+        if (!feed && tail && tail->release == release_held) {
+            auto *first = (held_chunk *) tail->ref;
+            first->last->next = chunk;
+            first->last = chunk;
+            tail->more += chunk->pcm.size();
+            return;
+        }
+        stream_feed_t *slot = &queue->feeds[(queue->feeds_head + queue->feeds_count) % STREAM_FEEDS_MAX];
+        if (feed) {
+            *slot = *feed;
+        } else {
+            slot->data = chunk->pcm.data();
+            slot->len = chunk->pcm.size();
+            slot->offset = 0;
+            slot->ref = chunk;
+            slot->release = release_held;
+            slot->format = STREAM_FEED_L16;
+            slot->more = 0;
+            slot->next = next_held;
+        }
+        queue->feeds_count++;
+    }
+
+    /* caller holds playback_mutex, or the session is going away */
+    static void clear_feeds(stream_queue_t *queue) {
+        while (queue->feeds_count) {
+            release_feed(&queue->feeds[queue->feeds_head]);
+            queue->feeds_head = (queue->feeds_head + 1) % STREAM_FEEDS_MAX;
+            queue->feeds_count--;
+        }
+    }
+
+    /* caller holds playback_mutex; a segment of this utterance is queued and was cancelled */
+    static bool segment_cancelled(private_t *tech_pvt, const char *utterance, size_t len) {
+        const stream_queue_t *queue = tech_pvt->scratch->queue;
+        for (uint32_t i = 0; i < queue->count && queue->cancelled; i++) {
+            const stream_segment_t *segment = &queue->segments[(queue->head + i) % STREAM_SEGMENTS_MAX];
+            if (segment->cancelled && strncmp(segment->id, utterance, len) == 0 && segment->id[len] == '\0') return true;
+        }
+        return false;
+    }
+
+    /*
+     * caller holds playback_mutex; cancels the queued segments of utterance, with up_to all of them up to and
+     * including its last one, with no utterance all of them. The audio stays in the buffer until the media thread
+     * reaches it; segments and chunks are both in playback order, so one pass over each. Returns how many were
+     * cancelled.
+     */
+    static uint32_t cancel_segments(private_t *tech_pvt, const char *utterance, bool up_to) {
+        stream_queue_t *queue = tech_pvt->scratch->queue;
+        uint32_t last = queue->count;
+        if (utterance && up_to) {
+            for (last = queue->count; last > 0; last--) {
+                if (strcmp(queue->segments[(queue->head + last - 1) % STREAM_SEGMENTS_MAX].id, utterance) == 0) break;
+            }
+            if (!last) return 0;
+        }
+        const uint64_t played = tech_pvt->playback_played;
+        uint32_t cancelled = 0;
+        uint32_t chunk = 0;
+        for (uint32_t i = 0; i < last; i++) {
+            stream_segment_t *segment = &queue->segments[(queue->head + i) % STREAM_SEGMENTS_MAX];
+            if (segment->cancelled || segment->end <= played) continue;
+            if (utterance && !up_to && strcmp(segment->id, utterance) != 0) continue;
+            const uint64_t heard = played > segment->start ? played - segment->start : 0;
+            segment->heard = heard > segment->skipped ? heard - segment->skipped : 0;
+            segment->cancelled = 1;
+            queue->cancelled++;
+            chunk = cut_chunks(tech_pvt, segment->start, segment->end, chunk);
+            cancelled++;
+        }
+        return cancelled;
+    }
+
+    /* caller holds playback_mutex; playback bytes [from, to) were discarded unplayed */
+    static void skip_segments(private_t *tech_pvt, uint64_t from, uint64_t to) {
+        stream_queue_t *queue = tech_pvt->scratch->queue;
+        for (uint32_t i = 0; i < queue->count; i++) {
+            stream_segment_t *segment = &queue->segments[(queue->head + i) % STREAM_SEGMENTS_MAX];
+            if (segment->start >= to) break;
+            const uint64_t lo = std::max(segment->start, from);
+            const uint64_t hi = std::min(segment->end, to);
+            if (hi > lo) segment->skipped += hi - lo;
+        }
+    }
+
     ~AudioStreamer()= default;
 
     void disconnect() {
@@ -298,14 +1041,59 @@ public:
         return client.isConnected();
     }
 
-    void writeBinary(uint8_t* buffer, size_t len) {
-        if(!this->isConnected()) return;
-        client.sendBinary(buffer, len);
+    /*
+     * Fan-out: every destination added with a later start on the same call hangs off the first one.
+     * The chain is only appended to while the streamer is pinned and deleted as a whole by finish,
+     * so the media thread walks it without a lock.
+     */
+    AudioStreamer *next() const {
+        return m_next.load(std::memory_order_acquire);
+    }
+
+    void addDestination(AudioStreamer *destination) {
+        AudioStreamer *tail = this;
+        AudioStreamer *expected = nullptr;
+        while (!tail->m_next.compare_exchange_weak(expected, destination, std::memory_order_acq_rel)) {
+            if (expected) tail = expected;
+            expected = nullptr;
+        }
+    }
+
+    bool anyConnected() {
+        for (AudioStreamer *d = this; d; d = d->next()) {
+            if (d->isConnected()) return true;
+        }
+        return false;
+    }
+
+    /* captured audio and control messages go to every destination; one that is down only drops its own copy */
+    void writeBinary(const uint8_t* buffer, size_t len) {
+        for (AudioStreamer *d = this; d; d = d->next()) {
+            d->sendBinary(buffer, len);
+        }
     }
 
     void writeText(const char* text) {
-        if(!this->isConnected()) return;
-        client.sendMessage(text, strlen(text));
+        const size_t len = strlen(text);
+        for (AudioStreamer *d = this; d; d = d->next()) {
+            d->sendText(text, len);
+        }
+    }
+
+    /* to this destination only: a playbackAck goes back where its chunk came from */
+    void reply(const char* text) {
+        sendText(text, strlen(text));
+    }
+
+    /* "destinations" entry of the session stats */
+    cJSON *destinationStats() {
+        cJSON *json = cJSON_CreateObject();
+        cJSON_AddStringToObject(json, "url", m_url.c_str());
+        cJSON_AddBoolToObject(json, "connected", isConnected());
+        cJSON_AddNumberToObject(json, "messages", (double)m_messagesOut.load(std::memory_order_relaxed));
+        cJSON_AddNumberToObject(json, "bytes", (double)m_bytesOut.load(std::memory_order_relaxed));
+        cJSON_AddNumberToObject(json, "dropped", (double)m_dropped.load(std::memory_order_relaxed));
+        return json;
     }
 
     void deleteFiles() {
@@ -327,47 +1115,1282 @@ public:
     }
 
 private:
+    void sendBinary(const uint8_t* buffer, size_t len) {
+        if(!this->isConnected()) {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        client.sendBinary(buffer, len);
+        countOut(len);
+    }
+
+    void sendText(const char* text, size_t len) {
+        if(!this->isConnected()) {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        client.sendMessage(text, len);
+        countOut(len);
+    }
+
+    void sendText(const char* text) {
+        sendText(text, strlen(text));
+    }
+
+    void countOut(size_t len) {
+        m_messagesOut.fetch_add(1, std::memory_order_relaxed);
+        m_bytesOut.fetch_add(len, std::memory_order_relaxed);
+        stream_metrics_add(SM_MESSAGES_OUT, 1);
+        stream_metrics_add(SM_BYTES_OUT, len);
+    }
+
     std::string m_sessionId;
+    std::string m_url;
+    std::string m_metadata;     /* sent on connect, see send_initial_metadata */
     responseHandler_t m_notify;
     WebSocketClient client;
     bool m_suppress_log;
     const char* m_extra_headers;
     int m_playFile;
     std::unordered_set<std::string> m_Files;
+    std::vector<unsigned char> m_decoded;   /* streamAudio decode buffer, websocket thread only */
+#ifdef HAVE_OPUS
+    static const int OPUS_DECODE_MAX = 960;     /* 120ms at 8kHz, the longest Opus packet */
+    std::vector<unsigned char> m_opus;      /* OpusDecoder, created with the first Opus chunk, websocket thread only */
+    int16_t m_pcm[OPUS_DECODE_MAX];
+#endif
     std::atomic<bool> m_cleanedUp{false};
+    std::atomic<AudioStreamer *> m_next{nullptr};
+    std::atomic<uint64_t> m_messagesOut{0};
+    std::atomic<uint64_t> m_bytesOut{0};
+    std::atomic<uint64_t> m_dropped{0};     /* messages not sent because this destination was not connected */
 };
 
 
-namespace {
+namespace {
+
+    const size_t SCRATCH_ALIGN = 64;
+
+    size_t scratch_align(size_t n) {
+        return (n + SCRATCH_ALIGN - 1) & ~(SCRATCH_ALIGN - 1);
+    }
+
+    /* One pool block for all stream_frame buffers, each on its own cache line, instead of ~40 KB of stack per tick */
+    stream_scratch_t *create_scratch(switch_memory_pool_t *pool, bool resample, int sampling, int channels,
+                                     bool g711, size_t packet_len, bool reference) {
+        /* speex may emit a few samples more than the nominal 20ms depending on filter phase */
+        const size_t resampled_frames = resample ? (size_t)sampling / 50 + 8 : 0;
+        const size_t resampled_bytes = resampled_frames * channels * sizeof(int16_t);
+        /* 20ms streams encode a media bug frame or a resampler run at a time, larger input in chunks;
+         * batched streams encode straight into the packet */
+        const size_t l16_max = std::max((size_t)FRAME_SIZE_8000 * channels, resampled_bytes);
+        const size_t g711_len = g711 && !packet_len ? l16_max / 2 : 0;
+
+        /* mix-type reference reads a mono frame and widens it to stereo in place */
+        const size_t frame_len = SWITCH_RECOMMENDED_BUFFER_SIZE * (reference ? 2 : 1);
+        const size_t far_frames = reference ? SWITCH_RECOMMENDED_BUFFER_SIZE / sizeof(int16_t) : 0;
+
+        const size_t frame_off = scratch_align(sizeof(stream_scratch_t));
+        const size_t resampled_off = frame_off + scratch_align(frame_len);
+        const size_t packet_off = resampled_off + scratch_align(resampled_bytes);
+        const size_t g711_off = packet_off + scratch_align(packet_len);
+        const size_t far_off = g711_off + scratch_align(g711_len);
+        const size_t total = far_off + scratch_align(far_frames * sizeof(int16_t));
+
+        auto *block = (uint8_t *) switch_core_alloc(pool, total + SCRATCH_ALIGN);
+        if (!block) return nullptr;
+        auto *base = (uint8_t *) scratch_align((uintptr_t) block);
+
+        auto *scratch = (stream_scratch_t *) base;
+        scratch->frame = base + frame_off;
+        scratch->resampled = resampled_bytes ? (int16_t *)(base + resampled_off) : nullptr;
+        scratch->packet = packet_len ? base + packet_off : nullptr;
+        scratch->g711 = g711_len ? base + g711_off : nullptr;
+        scratch->far = far_frames ? (int16_t *)(base + far_off) : nullptr;
+        scratch->reference = nullptr;
+        scratch->resampled_frames = (uint32_t) resampled_frames;
+        scratch->packet_len = (uint32_t) packet_len;
+        scratch->packet_fill = 0;
+        scratch->g711_len = (uint32_t) g711_len;
+        scratch->far_frames = (uint32_t) far_frames;
+        return scratch;
+    }
+
+    /* below this zero-crossing rate a quiet frame is background noise, above it an unvoiced consonant */
+    const uint32_t VAD_FRICATIVE_HZ = 2000;
+
+    stream_vad_t *create_vad(switch_memory_pool_t *pool, uint32_t rate, int channels, int threshold_dbfs,
+                             uint32_t hangover_ms, uint32_t preroll_ms) {
+        auto *vad = (stream_vad_t *) switch_core_alloc(pool, sizeof(stream_vad_t));
+        if (!vad) return nullptr;
+        const double amplitude = 32768.0 * pow(10.0, threshold_dbfs / 20.0);
+        vad->threshold = (uint64_t)(amplitude * amplitude);
+        vad->rate = rate;
+        vad->channels = (uint32_t) channels;
+        vad->hangover_samples = (uint32_t)((uint64_t)hangover_ms * rate / 1000);
+        /* whole sample frames, so every replayed piece stays aligned */
+        vad->preroll_len = (uint32_t)((uint64_t)preroll_ms * rate / 1000) * channels * sizeof(int16_t);
+        if (vad->preroll_len) {
+            vad->preroll = (uint8_t *) switch_core_alloc(pool, vad->preroll_len);
+            if (!vad->preroll) return nullptr;
+        }
+        return vad;
+    }
+
+    /*
+     * Energy and zero crossings of the first channel, the caller in every stereo mix (the other
+     * channel is the callee or the playback reference). Plain loops the compiler vectorizes.
+     */
+    bool vad_is_speech(const stream_vad_t *vad, const int16_t *pcm, uint32_t samples) {
+        const uint32_t channels = vad->channels;
+        const uint32_t n = samples * channels;
+        if (!samples) return false;
+
+        int64_t energy = 0;
+        for (uint32_t i = 0; i < n; i += channels) {
+            energy += (int32_t) pcm[i] * pcm[i];
+        }
+        uint32_t crossings = 0;
+        for (uint32_t i = channels; i < n; i += channels) {
+            crossings += (pcm[i] ^ pcm[i - channels]) < 0;
+        }
+
+        const uint64_t mean = (uint64_t) energy / samples;
+        if (mean >= vad->threshold) return true;
+        return mean >= vad->threshold / 4 &&
+               (uint64_t) crossings * vad->rate >= (uint64_t) VAD_FRICATIVE_HZ * 2 * samples;
+    }
+
+    void vad_preroll_push(stream_vad_t *vad, const uint8_t *data, uint32_t len) {
+        const uint32_t cap = vad->preroll_len;
+        if (!cap) return;
+        if (len >= cap) {
+            memcpy(vad->preroll, data + len - cap, cap);
+            vad->preroll_head = 0;
+            vad->preroll_fill = cap;
+            return;
+        }
+        const uint32_t first = std::min(len, cap - vad->preroll_head);
+        memcpy(vad->preroll + vad->preroll_head, data, first);
+        memcpy(vad->preroll, data + first, len - first);
+        vad->preroll_head = (vad->preroll_head + len) % cap;
+        vad->preroll_fill = std::min(vad->preroll_fill + len, cap);
+    }
+
+    inline uint32_t vad_preroll_samples(const stream_vad_t *vad) {
+        return vad->preroll_fill / (vad->channels * sizeof(int16_t));
+    }
+
+    void send_silence(AudioStreamer *pAudioStreamer, const stream_vad_t *vad, uint32_t samples) {
+        if (!samples) return;
+        char msg[64];
+        snprintf(msg, sizeof(msg), "{\"type\":\"silence\",\"ms\":%llu}",
+                 (unsigned long long)((uint64_t)samples * 1000 / vad->rate));
+        pAudioStreamer->writeText(msg);
+    }
+
+    /* tail_ms 0 leaves out the echo canceller, denoise_db/agc_dbfs 0 the preprocess stage or its half */
+    stream_dsp_t *create_dsp(switch_memory_pool_t *pool, uint32_t rate, uint32_t tail_ms,
+                             int denoise_db, int agc_dbfs) {
+        auto *dsp = (stream_dsp_t *) switch_core_alloc(pool, sizeof(stream_dsp_t));
+        if (!dsp) return nullptr;
+        dsp->block = rate / 100;
+        if (tail_ms) {
+            dsp->echo = speex_echo_state_init(STREAM_REF_FRAME, (int)(tail_ms * 8));
+            if (!dsp->echo) return nullptr;
+            int echo_rate = 8000;
+            speex_echo_ctl(dsp->echo, SPEEX_ECHO_SET_SAMPLING_RATE, &echo_rate);
+        }
+        if (denoise_db || agc_dbfs) {
+            dsp->preprocess = speex_preprocess_state_init((int) dsp->block, (int) rate);
+            if (!dsp->preprocess) {
+                /* tech_pvt->dsp is never set, so cleanup would not find the canceller */
+                if (dsp->echo) speex_echo_state_destroy(dsp->echo);
+                return nullptr;
+            }
+            int denoise = denoise_db ? 1 : 0;
+            int agc = agc_dbfs ? 1 : 0;
+            speex_preprocess_ctl(dsp->preprocess, SPEEX_PREPROCESS_SET_DENOISE, &denoise);
+            speex_preprocess_ctl(dsp->preprocess, SPEEX_PREPROCESS_SET_AGC, &agc);
+            if (denoise) speex_preprocess_ctl(dsp->preprocess, SPEEX_PREPROCESS_SET_NOISE_SUPPRESS, &denoise_db);
+            if (agc) {
+                /* the AGC target is a sample amplitude */
+                float level = (float)(32768.0 * pow(10.0, agc_dbfs / 20.0));
+                speex_preprocess_ctl(dsp->preprocess, SPEEX_PREPROCESS_SET_AGC_LEVEL, &level);
+            }
+            /* lets the noise suppressor also take out the residual echo the canceller reports */
+            if (dsp->echo) speex_preprocess_ctl(dsp->preprocess, SPEEX_PREPROCESS_SET_ECHO_STATE, dsp->echo);
+        }
+        return dsp;
+    }
+
+#ifdef HAVE_OPUS
+    /* frames of 20ms per packet; bitrate 0 leaves it to libopus (about 11 kbps at 8kHz mono, 19 kbps at 16kHz) */
+    stream_opus_t *create_opus(switch_memory_pool_t *pool, int rate, int channels, int frames, int bitrate,
+                               int complexity, int *err) {
+        *err = OPUS_ALLOC_FAIL;
+        auto *opus = (stream_opus_t *) switch_core_alloc(pool, sizeof(stream_opus_t));
+        if (!opus) return nullptr;
+        opus->frame_samples = (uint32_t)(rate / 50 * frames);
+        opus->channels = (uint32_t) channels;
+        opus->encoder = (OpusEncoder *) switch_core_alloc(pool, opus_encoder_get_size(channels));
+        opus->pcm = (int16_t *) switch_core_alloc(pool, opus->frame_samples * channels * sizeof(int16_t));
+        if (!opus->encoder || !opus->pcm) return nullptr;
+        *err = opus_encoder_init(opus->encoder, rate, channels, OPUS_APPLICATION_VOIP);
+        if (*err != OPUS_OK) return nullptr;
+        opus_encoder_ctl(opus->encoder, OPUS_SET_BITRATE(bitrate ? bitrate : OPUS_AUTO));
+        opus_encoder_ctl(opus->encoder, OPUS_SET_COMPLEXITY(complexity));
+        opus_encoder_ctl(opus->encoder, OPUS_SET_SIGNAL(OPUS_SIGNAL_VOICE));
+        return opus;
+    }
+#endif
+
+    stream_reference_t *create_reference(switch_memory_pool_t *pool, uint32_t rate) {
+        auto *reference = (stream_reference_t *) switch_core_alloc(pool, sizeof(stream_reference_t));
+        if (!reference) return nullptr;
+        reference->rate = rate;
+        if (rate != 8000) {
+            int err;
+            reference->resampler = speex_resampler_init(1, 8000, rate, SWITCH_RESAMPLE_QUALITY, &err);
+            if (err != 0) return nullptr;
+        }
+        return reference;
+    }
+
+    stream_drift_t *create_drift(switch_memory_pool_t *pool, uint32_t target_ms) {
+        auto *drift = (stream_drift_t *) switch_core_alloc(pool, sizeof(stream_drift_t));
+        if (!drift) return nullptr;
+        int err;
+        drift->resampler = speex_resampler_init(1, 8000, 8000, SWITCH_RESAMPLE_QUALITY, &err);
+        if (err != 0) return nullptr;
+        drift->target = target_ms * 8;
+        return drift;
+    }
+
+    /*
+     * Once per playing tick with the buffered samples. The depth is smoothed over ~1.3s (64 ticks) so chunk
+     * arrivals do not move the rate; what lies beyond 10ms of target is worked off over 10s, at most
+     * STREAM_DRIFT_MAX_PPM, in 100ppm steps so the resampler filter is rarely rebuilt.
+     */
+    void drift_track(stream_drift_t *drift, uint32_t depth) {
+        int64_t depth_q8 = (int64_t) depth << 8;
+        if (drift->primed) {
+            depth_q8 = drift->depth_q8 + (depth_q8 - drift->depth_q8) / 64;
+        }
+        drift->primed = 1;
+        __atomic_store_n(&drift->depth_q8, depth_q8, __ATOMIC_RELAXED);
+
+        const int64_t deadband = 80;
+        const int64_t error = (depth_q8 >> 8) - (int64_t) drift->target;
+        const int64_t excess = error > deadband ? error - deadband : error < -deadband ? error + deadband : 0;
+        int64_t ppm = excess * 1000000 / (8000 * 10) / 100 * 100;
+        if (ppm > STREAM_DRIFT_MAX_PPM) ppm = STREAM_DRIFT_MAX_PPM;
+        if (ppm < -STREAM_DRIFT_MAX_PPM) ppm = -STREAM_DRIFT_MAX_PPM;
+        if (ppm != drift->ppm) {
+            speex_resampler_set_rate_frac(drift->resampler, (spx_uint32_t)(1000000 + ppm), 1000000, 8000, 8000);
+            __atomic_store_n(&drift->ppm, (int32_t) ppm, __ATOMIC_RELAXED);
+        }
+    }
+
+    /* playback stopped (buffer ran dry, stopAudio): the next one starts from its own depth at the nominal rate */
+    void drift_reset(stream_drift_t *drift) {
+        drift->primed = 0;
+        if (drift->ppm) {
+            speex_resampler_set_rate_frac(drift->resampler, 1000000, 1000000, 8000, 8000);
+            __atomic_store_n(&drift->ppm, 0, __ATOMIC_RELAXED);
+        }
+        speex_resampler_reset_mem(drift->resampler);
+    }
+
+    /* one frame of samples out of the playback buffer at the corrected rate; returns the bytes it took */
+    switch_size_t drift_read(stream_drift_t *drift, switch_buffer_t *buffer, int16_t *out, uint32_t samples) {
+        const switch_size_t peeked = switch_buffer_peek(buffer, drift->in, sizeof(drift->in));
+        spx_uint32_t in_len = (spx_uint32_t)(peeked / sizeof(int16_t));
+        spx_uint32_t out_len = samples;
+        speex_resampler_process_int(drift->resampler, 0, drift->in, &in_len, out, &out_len);
+        if (out_len < samples) {
+            memset(out + out_len, 0, (samples - out_len) * sizeof(int16_t));
+        }
+        switch_buffer_toss(buffer, in_len * sizeof(int16_t));
+        return in_len * sizeof(int16_t);
+    }
+
+    stream_wsola_t *create_wsola(switch_memory_pool_t *pool, uint32_t target_ms, uint32_t threshold_ms) {
+        auto *wsola = (stream_wsola_t *) switch_core_alloc(pool, sizeof(stream_wsola_t));
+        if (!wsola) return nullptr;
+        wsola->target = target_ms * 8;
+        wsola->threshold = threshold_ms * 8;
+        for (int i = 0; i < STREAM_WSOLA_HOP; i++) {
+            wsola->fade[i] = (float)(0.5 - 0.5 * cos(3.14159265358979323846 * i / STREAM_WSOLA_HOP));
+        }
+        return wsola;
+    }
+
+    /* the head feed's block is all in: on to its next one, or the next feed */
+    void feeds_pop(stream_queue_t *queue) {
+        stream_feed_t *feed = &queue->feeds[queue->feeds_head];
+        if (feed->next && feed->next(feed)) return;
+        if (feed->release) feed->release(feed->ref);
+        queue->feeds_head = (queue->feeds_head + 1) % STREAM_FEEDS_MAX;
+        queue->feeds_count--;
+    }
+
+    /* queued behind the playback buffer, not in it yet */
+    switch_size_t feeds_bytes(const stream_queue_t *queue) {
+        switch_size_t bytes = 0;
+        for (uint32_t i = 0; i < queue->feeds_count; i++) {
+            const stream_feed_t *feed = &queue->feeds[(queue->feeds_head + i) % STREAM_FEEDS_MAX];
+            bytes += feed->len - feed->offset + feed->more;
+        }
+        return bytes;
+    }
+
+    /* tops the playback buffer up to level bytes from the queued feeds, releasing each once it is all in */
+    void feeds_fill(private_t *tech_pvt, switch_size_t level) {
+        stream_queue_t *queue = tech_pvt->scratch->queue;
+        switch_size_t inuse = switch_buffer_inuse(tech_pvt->playback_buffer);
+        while (queue->feeds_count && inuse < level) {
+            stream_feed_t *feed = &queue->feeds[queue->feeds_head];
+            switch_size_t n = std::min(level - inuse, feed->len - feed->offset);
+            if (feed->format == STREAM_FEED_L16) {
+                switch_buffer_write(tech_pvt->playback_buffer, feed->data + feed->offset, n);
+            } else {
+                int16_t pcm[160];
+                const uint8_t *g711 = feed->data + feed->offset / sizeof(int16_t);
+                n = std::min<switch_size_t>(n, sizeof(pcm)) & ~(switch_size_t) 1;
+                if (!n) break;
+                for (switch_size_t i = 0; i < n / sizeof(int16_t); i++) {
+                    pcm[i] = feed->format == STREAM_FEED_PCMU ? ulaw_to_linear(g711[i]) : alaw_to_linear(g711[i]);
+                }
+                switch_buffer_write(tech_pvt->playback_buffer, pcm, n);
+            }
+            feed->offset += n;
+            inuse += n;
+            if (feed->offset == feed->len) feeds_pop(queue);
+        }
+    }
+
+    /* steps past n bytes of the queued feeds, which the playback buffer has no room for ahead of them */
+    void feeds_skip(private_t *tech_pvt, uint64_t n) {
+        stream_queue_t *queue = tech_pvt->scratch->queue;
+        while (n && queue->feeds_count) {
+            stream_feed_t *feed = &queue->feeds[queue->feeds_head];
+            const switch_size_t step = (switch_size_t) std::min<uint64_t>(n, feed->len - feed->offset);
+            feed->offset += step;
+            tech_pvt->playback_played += step;
+            n -= step;
+            if (feed->offset == feed->len) feeds_pop(queue);
+        }
+    }
+
+    /*
+     * Tosses the cancelled audio playback has reached, marks queued in it included, down into the queued feeds
+     * when it goes past the playback buffer. Returns the bytes that can be read before the next cancelled segment,
+     * all of them when there is none.
+     */
+    uint64_t segments_skip(private_t *tech_pvt) {
+        const stream_queue_t *queue = tech_pvt->scratch->queue;
+        for (uint32_t i = 0; i < queue->count; i++) {
+            const stream_segment_t *segment = &queue->segments[(queue->head + i) % STREAM_SEGMENTS_MAX];
+            if (!segment->cancelled || segment->end <= tech_pvt->playback_played) continue;
+            if (segment->start > tech_pvt->playback_played) return segment->start - tech_pvt->playback_played;
+            const switch_size_t toss = (switch_size_t) std::min<uint64_t>(segment->end - tech_pvt->playback_played,
+                                                                          switch_buffer_inuse(tech_pvt->playback_buffer));
+            switch_buffer_toss(tech_pvt->playback_buffer, toss);
+            tech_pvt->playback_played += toss;
+            if (tech_pvt->playback_played < segment->end) feeds_skip(tech_pvt, segment->end - tech_pvt->playback_played);
+            while (tech_pvt->marks_count && tech_pvt->marks[tech_pvt->marks_head].position < tech_pvt->playback_played) {
+                tech_pvt->marks_head = (tech_pvt->marks_head + 1) % MAX_PENDING_MARKS;
+                tech_pvt->marks_count--;
+            }
+            if (tech_pvt->playback_played < segment->end) return 0;
+        }
+        return UINT64_MAX;
+    }
+
+    /* cancelled audio still ahead in the playback buffer: not part of its depth */
+    switch_size_t segments_cancelled_bytes(const private_t *tech_pvt) {
+        const stream_queue_t *queue = tech_pvt->scratch->queue;
+        const uint64_t buffered_end = tech_pvt->playback_played + switch_buffer_inuse(tech_pvt->playback_buffer);
+        switch_size_t bytes = 0;
+        for (uint32_t i = 0; i < queue->count; i++) {
+            const stream_segment_t *segment = &queue->segments[(queue->head + i) % STREAM_SEGMENTS_MAX];
+            const uint64_t start = std::max(segment->start, tech_pvt->playback_played);
+            const uint64_t end = std::min(segment->end, buffered_end);
+            if (segment->cancelled && end > start) {
+                bytes += end - start;
+            }
+        }
+        return bytes;
+    }
+
+    /* a plain read of len bytes that steps over cancelled segments, padded with silence if the buffer runs short */
+    void segments_read(private_t *tech_pvt, uint8_t *out, switch_size_t len) {
+        switch_size_t n = 0;
+        while (n < len) {
+            const switch_size_t want = (switch_size_t) std::min<uint64_t>(len - n, segments_skip(tech_pvt));
+            const switch_size_t got = want ? switch_buffer_read(tech_pvt->playback_buffer, out + n, want) : 0;
+            if (!got) break;
+            tech_pvt->playback_played += got;
+            n += got;
+        }
+        memset(out + n, 0, len - n);
+    }
+
+    /* segment_start/segment_stop of an utterance; audio without one has no events */
+    void fire_segment_event(switch_core_session_t *session, private_t *tech_pvt, const stream_segment_t &segment, bool stop) {
+        cJSON *root = cJSON_CreateObject();
+        cJSON_AddStringToObject(root, "utterance", segment.id);
+        cJSON_AddStringToObject(root, "audioDataType", segment.opus ? "opus" : "raw");
+        if (stop) {
+            const uint64_t played = segment.cancelled ? segment.heard : segment.end - segment.start - segment.skipped;
+            cJSON_AddNumberToObject(root, "playedMs", (double)(played / 16));
+            cJSON_AddBoolToObject(root, "cancelled", segment.cancelled);
+        }
+        char *json_str = cJSON_PrintUnformatted(root);
+        tech_pvt->responseHandler(session, stop ? EVENT_SEGMENT_STOP : EVENT_SEGMENT_START, json_str);
+        cJSON_Delete(root);
+        switch_safe_free(json_str);
+    }
+
+    stream_report_t *create_report(switch_memory_pool_t *pool, uint32_t status_ms, bool acks) {
+        auto *report = (stream_report_t *) switch_core_alloc(pool, sizeof(stream_report_t));
+        if (!report) return nullptr;
+        report->status_interval_ns = (uint64_t) status_ms * 1000000;
+        report->acks = acks ? 1 : 0;
+        return report;
+    }
+
+    /* once per playing tick with the buffered samples: starts, paces and ends a catch-up */
+    void wsola_track(stream_wsola_t *wsola, uint32_t depth) {
+        if (!wsola->active && depth > wsola->threshold) {
+            __atomic_store_n(&wsola->active, 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&wsola->episodes, wsola->episodes + 1, __ATOMIC_RELAXED);
+            wsola->lead = 0;
+        } else if (wsola->active && depth <= wsola->target) {
+            __atomic_store_n(&wsola->active, 0, __ATOMIC_RELAXED);
+        }
+        if (!wsola->active) return;
+        /* full speed above threshold, easing off towards target so the end of a catch-up is not heard */
+        wsola->skip = depth >= wsola->threshold ? STREAM_WSOLA_SKIP_MAX :
+                1 + (STREAM_WSOLA_SKIP_MAX - 1) * (depth - wsola->target) / (wsola->threshold - wsola->target);
+    }
+
+    /* offset in x (at least lo) whose first hop best matches x[0..hop), the natural continuation */
+    uint32_t wsola_seek(const int16_t *x, uint32_t lo, uint32_t hi, uint32_t nominal) {
+        uint32_t best = nominal;
+        double best_score = -1.0;
+        auto score = [x](uint32_t rel) {
+            int64_t corr = 0, energy = 0;
+            for (int i = 0; i < STREAM_WSOLA_HOP; i++) {
+                corr += (int64_t) x[i] * x[rel + i];
+                energy += (int64_t) x[rel + i] * x[rel + i];
+            }
+            return energy ? (double) corr * (double) (corr < 0 ? -corr : corr) / (double) energy : 0.0;
+        };
+        /* every other offset first, then the neighbours of the best one */
+        for (uint32_t rel = lo; rel <= hi; rel += 2) {
+            const double sc = score(rel);
+            if (sc > best_score) {
+                best_score = sc;
+                best = rel;
+            }
+        }
+        const uint32_t coarse = best;
+        for (uint32_t rel = coarse > lo ? coarse - 1 : lo; rel <= coarse + 1 && rel <= hi; rel += 2) {
+            const double sc = score(rel);
+            if (sc > best_score) {
+                best_score = sc;
+                best = rel;
+            }
+        }
+        return best;
+    }
+
+    /*
+     * One frame of samples out of the playback buffer, sped up by wsola->skip. The buffer head is always the
+     * tail of the previous step's segment; each step fades it out into the chosen segment and tosses what
+     * lies before that segment's own tail. At normal speed the chosen segment is the tail itself and the
+     * output is the input unchanged. Returns the bytes taken.
+     */
+    switch_size_t wsola_read(stream_wsola_t *wsola, switch_buffer_t *buffer, int16_t *out, uint32_t samples) {
+        switch_size_t taken = 0;
+        for (uint32_t off = 0; off + STREAM_WSOLA_HOP <= samples; off += STREAM_WSOLA_HOP) {
+            const uint32_t avail = (uint32_t)(switch_buffer_peek(buffer, wsola->in, sizeof(wsola->in)) / sizeof(int16_t));
+            if (avail < STREAM_WSOLA_HOP) {
+                memset(out + off, 0, (samples - off) * sizeof(int16_t));
+                break;
+            }
+            uint32_t rel = 0;
+            if (avail == STREAM_WSOLA_IN_MAX) {
+                /* a match past nominal leaves lead negative; the search window stays inside in[] either way */
+                wsola->lead = std::min<int32_t>(std::max<int32_t>(wsola->lead + (int32_t) wsola->skip, 0),
+                                                STREAM_WSOLA_IN_MAX - STREAM_WSOLA_HOP - STREAM_WSOLA_SEEK);
+                const int32_t nominal = wsola->lead;
+                const int32_t lo = std::max<int32_t>(nominal - STREAM_WSOLA_SEEK, 0);
+                const int32_t hi = std::min<int32_t>(nominal + STREAM_WSOLA_SEEK, (int32_t) avail - STREAM_WSOLA_HOP);
+                rel = wsola_seek(wsola->in, (uint32_t) lo, (uint32_t) hi, (uint32_t) nominal);
+                wsola->lead -= (int32_t) rel;
+            }
+            /* the search stays inside what was peeked; never toss past it whatever it returned */
+            rel = std::min(rel, avail - STREAM_WSOLA_HOP);
+            const int16_t *x = wsola->in;
+            for (int i = 0; i < STREAM_WSOLA_HOP; i++) {
+                const float f = wsola->fade[i];
+                out[off + i] = (int16_t) lrintf(x[i] * (1.0f - f) + x[rel + i] * f);
+            }
+            switch_buffer_toss(buffer, (rel + STREAM_WSOLA_HOP) * sizeof(int16_t));
+            taken += (rel + STREAM_WSOLA_HOP) * sizeof(int16_t);
+            __atomic_store_n(&wsola->saved, wsola->saved + rel, __ATOMIC_RELAXED);
+        }
+        return taken;
+    }
+
+    /* pcm NULL when nothing was injected: the far end was silent for that long */
+    void reference_push(stream_reference_t *reference, const int16_t *pcm, uint32_t samples) {
+        for (uint32_t off = 0; off + STREAM_REF_FRAME <= samples; off += STREAM_REF_FRAME) {
+            if (reference->count == STREAM_REF_SLOTS) {
+                /* capture is not being consumed (paused, not connected): keep the latest */
+                reference->head = (reference->head + 1) % STREAM_REF_SLOTS;
+                reference->count--;
+            }
+            int16_t *slot = reference->slots[(reference->head + reference->count) % STREAM_REF_SLOTS];
+            if (pcm) {
+                memcpy(slot, pcm + off, sizeof(reference->slots[0]));
+            } else {
+                memset(slot, 0, sizeof(reference->slots[0]));
+            }
+            reference->count++;
+        }
+    }
+
+    /* the next 10ms of 8kHz reference, valid until the next push */
+    const int16_t *reference_pop(stream_reference_t *reference) {
+        if (!reference->count) return reference->silence;
+        const int16_t *slot = reference->slots[reference->head];
+        reference->head = (reference->head + 1) % STREAM_REF_SLOTS;
+        reference->count--;
+        return slot;
+    }
+
+    /* the reference for samples captured at the read rate; short reads are padded with silence */
+    void reference_read(stream_reference_t *reference, int16_t *out, uint32_t samples) {
+        uint32_t done = 0;
+        const uint32_t blocks = (uint32_t)((uint64_t)samples * 8000 / reference->rate / STREAM_REF_FRAME);
+        for (uint32_t b = 0; b < blocks && done < samples; b++) {
+            const int16_t *slot = reference_pop(reference);
+            if (!reference->resampler) {
+                memcpy(out + done, slot, sizeof(reference->slots[0]));
+                done += STREAM_REF_FRAME;
+                continue;
+            }
+            spx_uint32_t in_len = STREAM_REF_FRAME;
+            spx_uint32_t out_len = samples - done;
+            speex_resampler_process_int(reference->resampler, 0, slot, &in_len, out + done, &out_len);
+            done += out_len;
+        }
+        if (done < samples) {
+            memset(out + done, 0, (samples - done) * sizeof(int16_t));
+        }
+    }
+
+    /* Helper function to encode L16 PCM to G.711 
+     * 
+     * Note: G.711 requires 8kHz audio. If input is not 8kHz, encoding will fail.
+     * The caller must ensure proper sample rate before calling this function.
+     * 
+     * L16 @ 8kHz: 160 samples = 320 bytes per 20ms frame
+     * G.711 @ 8kHz: 160 samples = 160 bytes per 20ms frame (1 byte per sample)
+     */
+    size_t encode_g711(private_t *tech_pvt, const uint8_t *pcm_data, size_t pcm_len, uint8_t *g711_data, size_t g711_buflen) {
+        if (!tech_pvt || !tech_pvt->codec_initialized) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, 
+                "encode_g711: codec not initialized\n");
+            return 0;
+        }
+        
+        if (!pcm_data || pcm_len == 0) {
+            return 0;
+        }
+        
+        /* Validate buffer size: G.711 output is half the size of L16 input */
+        size_t expected_output = pcm_len / 2;
+        if (g711_buflen < expected_output) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, 
+                "encode_g711: output buffer too small (%zu < %zu)\n", g711_buflen, expected_output);
+            return 0;
+        }
+        
+        uint32_t encoded_len = (uint32_t)g711_buflen;
+        uint32_t encoded_rate = 8000;
+        unsigned int flags = 0;
+        
+        switch_status_t status = switch_core_codec_encode(
+            &tech_pvt->write_codec,
+            NULL,
+            (void *)pcm_data,
+            (uint32_t)pcm_len,
+            8000,  /* G.711 is always 8kHz */
+            g711_data,
+            &encoded_len,
+            &encoded_rate,
+            &flags
+        );
+        
+        if (status != SWITCH_STATUS_SUCCESS) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, 
+                "encode_g711: switch_core_codec_encode failed (pcm_len=%zu)\n", pcm_len);
+            return 0;
+        }
+        
+        return (size_t)encoded_len;
+    }
+
+    /*
+     * stream_frame pipeline: media bug frames -> filter -> gate -> resampler -> packetizer -> encoder -> websocket.
+     * Each stage is a policy and every combination is instantiated up front; select_pipeline picks
+     * one per call at init, so the per-tick path has no configuration checks. A new stage is a new
+     * policy plus a line in the matching select_* function.
+     */
+
+    /* Encoders: send one L16 block as a websocket message, or encode it into a packet being filled */
+    struct l16_encoder {
+        static const size_t PCM_BYTES_PER_BYTE = 1;
+
+        static size_t encode(private_t *, const uint8_t *pcm, size_t len, uint8_t *out, size_t) {
+            memcpy(out, pcm, len);
+            return len;
+        }
+
+        static void write(private_t *, AudioStreamer *pAudioStreamer, const uint8_t *pcm, size_t len) {
+            pAudioStreamer->writeBinary(pcm, len);
+        }
+
+        static void flush(private_t *, AudioStreamer *) {}
+    };
+
+    struct g711_encoder {
+        static const size_t PCM_BYTES_PER_BYTE = 2;
+
+        static size_t encode(private_t *tech_pvt, const uint8_t *pcm, size_t len, uint8_t *out, size_t out_len) {
+            return encode_g711(tech_pvt, pcm, len, out, out_len);
+        }
+
+        /* in chunks when the block exceeds the encoder scratch */
+        static void write(private_t *tech_pvt, AudioStreamer *pAudioStreamer, const uint8_t *pcm, size_t len) {
+            stream_scratch_t *scratch = tech_pvt->scratch;
+            const size_t chunk = (size_t)scratch->g711_len * 2;
+            while (len > 0) {
+                const size_t n = std::min(len, chunk);
+                size_t g711_len = encode_g711(tech_pvt, pcm, n, scratch->g711, scratch->g711_len);
+                if (g711_len > 0) {
+                    pAudioStreamer->writeBinary(scratch->g711, g711_len);
+                }
+                pcm += n;
+                len -= n;
+            }
+        }
+
+        static void flush(private_t *, AudioStreamer *) {}
+    };
+
+#ifdef HAVE_OPUS
+    /*
+     * Blocks of any length are collected until they span the packet, which is then encoded and sent as one
+     * message. STREAM_BUFFER_SIZE is the Opus frame duration, so frame_packetizer is the only packetizer.
+     */
+    struct opus_encoder {
+        static void write(private_t *tech_pvt, AudioStreamer *pAudioStreamer, const uint8_t *pcm, size_t len) {
+            stream_opus_t *opus = tech_pvt->scratch->opus;
+            const size_t packet_bytes = (size_t)opus->frame_samples * opus->channels * sizeof(int16_t);
+            while (len > 0) {
+                const size_t n = std::min(len, packet_bytes - opus->pcm_fill);
+                memcpy((uint8_t *) opus->pcm + opus->pcm_fill, pcm, n);
+                opus->pcm_fill += n;
+                pcm += n;
+                len -= n;
+                if (opus->pcm_fill == packet_bytes) {
+                    encode(opus, pAudioStreamer);
+                }
+            }
+        }
+
+        /* Opus only takes whole frames: the rest of a partly collected packet is silence */
+        static void flush(private_t *tech_pvt, AudioStreamer *pAudioStreamer) {
+            stream_opus_t *opus = tech_pvt->scratch->opus;
+            if (!opus->pcm_fill) return;
+            const size_t packet_bytes = (size_t)opus->frame_samples * opus->channels * sizeof(int16_t);
+            memset((uint8_t *) opus->pcm + opus->pcm_fill, 0, packet_bytes - opus->pcm_fill);
+            encode(opus, pAudioStreamer);
+        }
+
+        static void encode(stream_opus_t *opus, AudioStreamer *pAudioStreamer) {
+            opus->pcm_fill = 0;
+            const opus_int32 len = opus_encode(opus->encoder, opus->pcm, (int) opus->frame_samples,
+                                               opus->packet, (opus_int32) sizeof(opus->packet));
+            if (len < 0) {
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "opus_encode failed: %s\n", opus_strerror(len));
+                return;
+            }
+            pAudioStreamer->writeBinary(opus->packet, (size_t) len);
+        }
+    };
+#endif
+
+    /* Packetizers, one per tick: 20ms sends every block, larger STREAM_BUFFER_SIZE batches blocks into one message */
+    template <typename Encoder>
+    class frame_packetizer {
+    public:
+        frame_packetizer(private_t *tech_pvt, AudioStreamer *pAudioStreamer) : m_tech_pvt(tech_pvt), m_streamer(pAudioStreamer) {}
+
+        void push(const uint8_t *pcm, size_t len) {
+            Encoder::write(m_tech_pvt, m_streamer, pcm, len);
+        }
+
+        void flush() {
+            Encoder::flush(m_tech_pvt, m_streamer);
+        }
+
+    private:
+        private_t *m_tech_pvt;
+        AudioStreamer *m_streamer;
+    };
+
+    /*
+     * Blocks are encoded straight into the scratch packet, which is sent as is once it holds exactly
+     * STREAM_BUFFER_SIZE worth; a block straddling two packets is split, nothing is dropped. The fill
+     * level carries over between ticks.
+     */
+    template <typename Encoder>
+    class buffered_packetizer {
+    public:
+        buffered_packetizer(private_t *tech_pvt, AudioStreamer *pAudioStreamer) : m_tech_pvt(tech_pvt), m_streamer(pAudioStreamer),
+            m_scratch(tech_pvt->scratch), m_size(tech_pvt->scratch->packet_len / Encoder::PCM_BYTES_PER_BYTE) {}
+
+        void push(const uint8_t *pcm, size_t len) {
+            while (len > 0) {
+                const size_t n = std::min(len, (m_size - m_scratch->packet_fill) * Encoder::PCM_BYTES_PER_BYTE);
+                m_scratch->packet_fill += Encoder::encode(m_tech_pvt, pcm, n, m_scratch->packet + m_scratch->packet_fill,
+                                                          m_size - m_scratch->packet_fill);
+                pcm += n;
+                len -= n;
+                if (m_scratch->packet_fill >= m_size) {
+                    flush();
+                }
+            }
+        }
+
+        /* sends a partly filled packet early, e.g. when the gate stops the stream */
+        void flush() {
+            if (!m_scratch->packet_fill) return;
+            m_streamer->writeBinary(m_scratch->packet, m_scratch->packet_fill);
+            m_scratch->packet_fill = 0;
+        }
+
+    private:
+        private_t *m_tech_pvt;
+        AudioStreamer *m_streamer;
+        stream_scratch_t *m_scratch;
+        const size_t m_size;
+    };
+
+    /* Resamplers: turn one media bug frame into L16 blocks at the streaming rate */
+    struct no_resampler {
+        template <typename Packetizer>
+        static void process(private_t *, const switch_frame_t &frame, Packetizer &out) {
+            out.push((const uint8_t *) frame.data, frame.datalen);
+        }
+    };
+
+    template <int Channels>
+    struct speex_resampler {
+        template <typename Packetizer>
+        static void process(private_t *tech_pvt, const switch_frame_t &frame, Packetizer &out) {
+            stream_scratch_t *scratch = tech_pvt->scratch;
+            spx_int16_t *resampled = scratch->resampled;
+            const spx_int16_t *in = (const spx_int16_t *) frame.data;
+            spx_uint32_t in_left = frame.samples;
+
+            /* scratch holds 20ms of output, frames from a longer ptime take more than one run */
+            while (in_left > 0) {
+                spx_uint32_t in_len = in_left;
+                spx_uint32_t out_len = scratch->resampled_frames;
+                if (Channels == 1) {
+                    speex_resampler_process_int(tech_pvt->resampler, 0, in, &in_len, resampled, &out_len);
+                } else {
+                    speex_resampler_process_interleaved_int(tech_pvt->resampler, in, &in_len, resampled, &out_len);
+                }
+                in += in_len * Channels;
+                in_left -= in_len;
+
+                if (out_len > 0) {
+                    out.push((const uint8_t *) resampled, out_len * Channels * sizeof(spx_int16_t));
+                } else if (in_len == 0) {
+                    break;
+                }
+            }
+        }
+    };
+
+    /* Filters: clean up a captured frame in place before anything else looks at it */
+    struct no_filter {
+        static void process(private_t *, switch_frame_t &) {}
+    };
+
+    /*
+     * STREAM_AEC, STREAM_DENOISE, STREAM_AGC: 10ms blocks of the mono capture go through the echo
+     * canceller, then the preprocessor, before any resampling. The far-end reference is the playback
+     * stream_playback_frame injected on the same READ ticks, so unlike a canceller downstream there is
+     * no delay to estimate beyond the echo path itself. Each stage is timed per frame into the stats.
+     */
+    struct dsp_filter {
+        static void process(private_t *tech_pvt, switch_frame_t &frame) {
+            stream_dsp_t *dsp = tech_pvt->dsp;
+            stream_reference_t *reference = tech_pvt->scratch->reference;
+            auto *pcm = (int16_t *) frame.data;
+            uint64_t echo_ns = 0, preprocess_ns = 0;
+            for (uint32_t off = 0; off + dsp->block <= frame.samples; off += dsp->block) {
+                uint64_t start = stream_metrics_now_ns();
+                if (dsp->echo) {
+                    speex_echo_cancellation(dsp->echo, pcm + off, reference_pop(reference), dsp->out);
+                    memcpy(pcm + off, dsp->out, sizeof(dsp->out));
+                    const uint64_t now = stream_metrics_now_ns();
+                    echo_ns += now - start;
+                    start = now;
+                }
+                if (dsp->preprocess) {
+                    speex_preprocess_run(dsp->preprocess, pcm + off);
+                    preprocess_ns += stream_metrics_now_ns() - start;
+                }
+            }
+            if (dsp->echo) stream_latency_record(SM_HIST_AEC, &tech_pvt->stats->aec, echo_ns, 0);
+            if (dsp->preprocess) stream_latency_record(SM_HIST_PREPROCESS, &tech_pvt->stats->preprocess, preprocess_ns, 0);
+        }
+    };
+
+    /*
+     * mix-type reference: the mono capture becomes channel 0 of a stereo frame whose channel 1 is the
+     * playback injected on the same ticks, so a remote canceller gets a sample-aligned reference.
+     * The frame buffer is twice the read size, the widening runs back to front in place.
+     */
+    struct reference_filter {
+        static void process(private_t *tech_pvt, switch_frame_t &frame) {
+            stream_scratch_t *scratch = tech_pvt->scratch;
+            const uint32_t samples = std::min(frame.samples, scratch->far_frames);
+            reference_read(scratch->reference, scratch->far, samples);
+
+            auto *pcm = (int16_t *) frame.data;
+            for (uint32_t i = samples; i-- > 0;) {
+                pcm[2 * i + 1] = scratch->far[i];
+                pcm[2 * i] = pcm[i];
+            }
+            frame.samples = samples;
+            frame.datalen = samples * 2 * sizeof(int16_t);
+            frame.channels = 2;
+        }
+    };
+
+    /* Runs two filters in turn, e.g. preprocessing before the mix-type reference widening */
+    template <typename First, typename Second>
+    struct filter_chain {
+        static void process(private_t *tech_pvt, switch_frame_t &frame) {
+            First::process(tech_pvt, frame);
+            Second::process(tech_pvt, frame);
+        }
+    };
+
+    /* Gates: decide per media bug frame whether it is streamed at all */
+    struct no_gate {
+        template <typename Resampler, typename Packetizer>
+        static void process(private_t *tech_pvt, AudioStreamer *, const switch_frame_t &frame, Packetizer &out) {
+            Resampler::process(tech_pvt, frame, out);
+        }
+    };
+
+    /*
+     * STREAM_VAD: once the hangover after the last speech frame runs out, frames are not streamed.
+     * The latest of them are kept as pre-roll and replayed at the next speech onset so word starts
+     * are not clipped; the rest is reported as {"type":"silence","ms":N} messages, sent at the onset
+     * and at least every second, so the server can keep its timeline.
+     */
+    struct vad_gate {
+        template <typename Resampler, typename Packetizer>
+        static void process(private_t *tech_pvt, AudioStreamer *pAudioStreamer, const switch_frame_t &frame, Packetizer &out) {
+            stream_vad_t *vad = tech_pvt->vad;
+            stream_stats_t *stats = tech_pvt->stats;
+            __atomic_store_n(&stats->vad_frames, stats->vad_frames + 1, __ATOMIC_RELAXED);
+            stream_metrics_add(SM_VAD_FRAMES, 1);
+
+            if (vad_is_speech(vad, (const int16_t *) frame.data, frame.samples)) {
+                if (!vad->active) {
+                    send_silence(pAudioStreamer, vad, vad->pending_samples - vad_preroll_samples(vad));
+                    replay<Resampler>(tech_pvt, vad, out);
+                    vad->pending_samples = 0;
+                    vad->active = 1;
+                }
+                vad->hang_left = vad->hangover_samples;
+                Resampler::process(tech_pvt, frame, out);
+                return;
+            }
+
+            if (vad->active) {
+                if (vad->hang_left > 0) {
+                    vad->hang_left -= std::min(vad->hang_left, frame.samples);
+                    Resampler::process(tech_pvt, frame, out);
+                    return;
+                }
+                /* end of the talk spurt: do not hold its tail in a partly filled packet */
+                vad->active = 0;
+                out.flush();
+            }
+
+            __atomic_store_n(&stats->vad_suppressed, stats->vad_suppressed + 1, __ATOMIC_RELAXED);
+            stream_metrics_add(SM_VAD_SUPPRESSED, 1);
+            vad_preroll_push(vad, (const uint8_t *) frame.data, frame.datalen);
+            vad->pending_samples += frame.samples;
+            const uint32_t unreported = vad->pending_samples - vad_preroll_samples(vad);
+            if (unreported >= vad->rate) {
+                send_silence(pAudioStreamer, vad, unreported);
+                vad->pending_samples -= unreported;
+            }
+        }
+
+        template <typename Resampler, typename Packetizer>
+        static void replay(private_t *tech_pvt, stream_vad_t *vad, Packetizer &out) {
+            if (!vad->preroll_fill) return;
+            const uint32_t start = (vad->preroll_head + vad->preroll_len - vad->preroll_fill) % vad->preroll_len;
+            const uint32_t first = std::min(vad->preroll_fill, vad->preroll_len - start);
+            replay_span<Resampler>(tech_pvt, vad, vad->preroll + start, first, out);
+            replay_span<Resampler>(tech_pvt, vad, vad->preroll, vad->preroll_fill - first, out);
+            vad->preroll_head = 0;
+            vad->preroll_fill = 0;
+        }
+
+        template <typename Resampler, typename Packetizer>
+        static void replay_span(private_t *tech_pvt, const stream_vad_t *vad, uint8_t *data, uint32_t len, Packetizer &out) {
+            if (!len) return;
+            switch_frame_t frame = {};
+            frame.data = data;
+            frame.datalen = len;
+            frame.samples = len / (vad->channels * sizeof(int16_t));
+            Resampler::process(tech_pvt, frame, out);
+        }
+    };
+
+    template <typename Filter, typename Gate, typename Resampler, template <typename> class Packetizer, typename Encoder>
+    void run_pipeline(private_t *tech_pvt, void *streamer, switch_media_bug_t *bug) {
+        auto *pAudioStreamer = static_cast<AudioStreamer *>(streamer);
+        Packetizer<Encoder> out(tech_pvt, pAudioStreamer);
+        switch_frame_t frame = {};
+        frame.data = tech_pvt->scratch->frame;
+        frame.buflen = SWITCH_RECOMMENDED_BUFFER_SIZE;
+
+        while (switch_core_media_bug_read(bug, &frame, SWITCH_TRUE) == SWITCH_STATUS_SUCCESS) {
+            if (!frame.datalen) continue;
+            tech_pvt->samples_sent += frame.samples;
+            Filter::process(tech_pvt, frame);
+            Gate::template process<Resampler>(tech_pvt, pAudioStreamer, frame, out);
+        }
+    }
+
+    template <typename Filter, typename Gate, typename Resampler, template <typename> class Packetizer>
+    stream_frame_pipeline_t select_encoder(const private_t *tech_pvt) {
+        /* codec_initialized only for PCMU/PCMA */
+        return tech_pvt->codec_initialized ? run_pipeline<Filter, Gate, Resampler, Packetizer, g711_encoder>
+                                           : run_pipeline<Filter, Gate, Resampler, Packetizer, l16_encoder>;
+    }
+
+    template <typename Filter, typename Gate, typename Resampler>
+    stream_frame_pipeline_t select_packetizer(const private_t *tech_pvt) {
+#ifdef HAVE_OPUS
+        if (tech_pvt->audio_format == AUDIO_FORMAT_OPUS) {
+            return run_pipeline<Filter, Gate, Resampler, frame_packetizer, opus_encoder>;
+        }
+#endif
+        return tech_pvt->rtp_packets == 1 ? select_encoder<Filter, Gate, Resampler, frame_packetizer>(tech_pvt)
+                                          : select_encoder<Filter, Gate, Resampler, buffered_packetizer>(tech_pvt);
+    }
+
+    template <typename Filter, typename Gate>
+    stream_frame_pipeline_t select_resampler(const private_t *tech_pvt) {
+        if (!tech_pvt->resampler) return select_packetizer<Filter, Gate, no_resampler>(tech_pvt);
+        return tech_pvt->channels == 1 ? select_packetizer<Filter, Gate, speex_resampler<1>>(tech_pvt)
+                                       : select_packetizer<Filter, Gate, speex_resampler<2>>(tech_pvt);
+    }
+
+    template <typename Filter>
+    stream_frame_pipeline_t select_gate(const private_t *tech_pvt) {
+        return tech_pvt->vad ? select_resampler<Filter, vad_gate>(tech_pvt) : select_resampler<Filter, no_gate>(tech_pvt);
+    }
+
+    stream_frame_pipeline_t select_pipeline(const private_t *tech_pvt) {
+        if (tech_pvt->dsp) {
+            return tech_pvt->reference ? select_gate<filter_chain<dsp_filter, reference_filter>>(tech_pvt)
+                                       : select_gate<dsp_filter>(tech_pvt);
+        }
+        return tech_pvt->reference ? select_gate<reference_filter>(tech_pvt) : select_gate<no_filter>(tech_pvt);
+    }
+
+    /* connection settings, read per destination so a later start can use different ones */
+    struct ws_options {
+        int deflate = 0;
+        int heart_beat = 0;
+        bool suppress_log = false;
+        const char *extra_headers = nullptr;
+        bool no_reconnect = false;
+        const char *tls_cafile = nullptr;
+        const char *tls_keyfile = nullptr;
+        const char *tls_certfile = nullptr;
+        bool tls_disable_hostname_validation = false;
+    };
+
+    void read_ws_options(switch_channel_t *channel, ws_options &ws) {
+        if (switch_channel_var_true(channel, "STREAM_MESSAGE_DEFLATE")) {
+            ws.deflate = 1;
+        }
+
+        if (switch_channel_var_true(channel, "STREAM_SUPPRESS_LOG")) {
+            ws.suppress_log = true;
+        }
+
+        if (switch_channel_var_true(channel, "STREAM_NO_RECONNECT")) {
+            ws.no_reconnect = true;
+        }
+
+        ws.tls_cafile = switch_channel_get_variable(channel, "STREAM_TLS_CA_FILE");
+        ws.tls_keyfile = switch_channel_get_variable(channel, "STREAM_TLS_KEY_FILE");
+        ws.tls_certfile = switch_channel_get_variable(channel, "STREAM_TLS_CERT_FILE");
+
+        if (switch_channel_var_true(channel, "STREAM_TLS_DISABLE_HOSTNAME_VALIDATION")) {
+            ws.tls_disable_hostname_validation = true;
+        }
+
+        const char* heartBeat = switch_channel_get_variable(channel, "STREAM_HEART_BEAT");
+        if (heartBeat) {
+            char *endptr;
+            long value = strtol(heartBeat, &endptr, 10);
+            if (*endptr == '\0' && value <= INT_MAX && value >= INT_MIN) {
+                ws.heart_beat = (int) value;
+            }
+        }
+
+        ws.extra_headers = switch_channel_get_variable(channel, "STREAM_EXTRA_HEADERS");
+    }
+
+    /* per-stream settings from the channel variables; a value out of range keeps the default */
+    struct stream_options {
+        ws_options ws;
+        int rtp_packets = 1;            /* 20ms burst */
+        uint32_t slow_tick_us = SM_DEFAULT_SLOW_US;
+        uint32_t mark_interval_ms = 0;
+        bool vad = false;
+        int vad_threshold_dbfs = -45;
+        uint32_t vad_hangover_ms = 400;
+        uint32_t vad_preroll_ms = 200;
+        bool aec = false;
+        uint32_t aec_tail_ms = 256;
+        bool denoise = false;
+        int denoise_db = -15;
+        bool agc = false;
+        int agc_dbfs = -12;
+        int opus_bitrate = 0;
+        int opus_complexity = 5;
+        bool drift = false;
+        uint32_t playback_target_ms = 100;
+        bool catchup = false;
+        uint32_t catchup_ms = 500;
+        uint32_t status_ms = 0;
+        bool acks = false;
+    };
+
+    void read_stream_options(switch_core_session_t *session, stream_options &options) {
+        const char* buffer_size = NULL;
+        switch_channel_t *channel = switch_core_session_get_channel(session);
+
+        read_ws_options(channel, options.ws);
+
+        if ((buffer_size = switch_channel_get_variable(channel, "STREAM_BUFFER_SIZE"))) {
+            int bSize = atoi(buffer_size);
+            if(bSize % 20 != 0) {
+                switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING, "%s: Buffer size of %s is not a multiple of 20ms. Using default 20ms.\n",
+                                  switch_channel_get_name(channel), buffer_size);
+            } else if(bSize >= 20){
+                options.rtp_packets = bSize/20;
+            }
+        }
+
+        const char* slowTick = switch_channel_get_variable(channel, "STREAM_SLOW_TICK_US");
+        if (slowTick) {
+            char *endptr;
+            long value = strtol(slowTick, &endptr, 10);
+            if (*endptr == '\0' && value >= 0 && value <= INT_MAX) {
+                options.slow_tick_us = (uint32_t) value;
+            }
+        }
+
+        const char* markInterval = switch_channel_get_variable(channel, "STREAM_MARK_INTERVAL_MS");
+        if (markInterval) {
+            char *endptr;
+            long value = strtol(markInterval, &endptr, 10);
+            if (*endptr == '\0' && value >= 0 && value <= INT_MAX) {
+                options.mark_interval_ms = (uint32_t) value;
+            }
+        }
+
+        if (switch_channel_var_true(channel, "STREAM_VAD")) {
+            options.vad = true;
+        }
+
+        const char* vadThreshold = switch_channel_get_variable(channel, "STREAM_VAD_THRESHOLD");
+        if (vadThreshold) {
+            char *endptr;
+            long value = strtol(vadThreshold, &endptr, 10);
+            if (*endptr == '\0' && value >= -96 && value <= 0) {
+                options.vad_threshold_dbfs = (int) value;
+            }
+        }
+
+        const char* vadHangover = switch_channel_get_variable(channel, "STREAM_VAD_HANGOVER_MS");
+        if (vadHangover) {
+            char *endptr;
+            long value = strtol(vadHangover, &endptr, 10);
+            if (*endptr == '\0' && value >= 0 && value <= 60000) {
+                options.vad_hangover_ms = (uint32_t) value;
+            }
+        }
+
+        if (switch_channel_var_true(channel, "STREAM_AEC")) {
+            options.aec = true;
+        }
+
+        const char* aecTail = switch_channel_get_variable(channel, "STREAM_AEC_TAIL_MS");
+        if (aecTail) {
+            char *endptr;
+            long value = strtol(aecTail, &endptr, 10);
+            if (*endptr == '\0' && value >= 20 && value <= 1000) {
+                options.aec_tail_ms = (uint32_t) value;
+            }
+        }
+
+        const char* vadPreroll = switch_channel_get_variable(channel, "STREAM_VAD_PREROLL_MS");
+        if (vadPreroll) {
+            char *endptr;
+            long value = strtol(vadPreroll, &endptr, 10);
+            if (*endptr == '\0' && value >= 0 && value <= 5000) {
+                options.vad_preroll_ms = (uint32_t) value;
+            }
+        }
+
+        if (switch_channel_var_true(channel, "STREAM_DENOISE")) {
+            options.denoise = true;
+        }
+
+        const char* denoiseLevel = switch_channel_get_variable(channel, "STREAM_DENOISE_LEVEL");
+        if (denoiseLevel) {
+            char *endptr;
+            long value = strtol(denoiseLevel, &endptr, 10);
+            if (*endptr == '\0' && value >= -60 && value <= -1) {
+                options.denoise_db = (int) value;
+            }
+        }
+
+        if (switch_channel_var_true(channel, "STREAM_AGC")) {
+            options.agc = true;
+        }
+
+        const char* agcLevel = switch_channel_get_variable(channel, "STREAM_AGC_LEVEL");
+        if (agcLevel) {
+            char *endptr;
+            long value = strtol(agcLevel, &endptr, 10);
+            if (*endptr == '\0' && value >= -40 && value <= -1) {
+                options.agc_dbfs = (int) value;
+            }
+        }
+
+        const char* opusBitrate = switch_channel_get_variable(channel, "STREAM_OPUS_BITRATE");
+        if (opusBitrate) {
+            char *endptr;
+            long value = strtol(opusBitrate, &endptr, 10);
+            if (*endptr == '\0' && value >= 6000 && value <= 510000) {
+                options.opus_bitrate = (int) value;
+            }
+        }
+
+        const char* opusComplexity = switch_channel_get_variable(channel, "STREAM_OPUS_COMPLEXITY");
+        if (opusComplexity) {
+            char *endptr;
+            long value = strtol(opusComplexity, &endptr, 10);
+            if (*endptr == '\0' && value >= 0 && value <= 10) {
+                options.opus_complexity = (int) value;
+            }
+        }
+
+        if (switch_channel_var_true(channel, "STREAM_PLAYBACK_DRIFT")) {
+            options.drift = true;
+        }
+
+        const char* playbackTarget = switch_channel_get_variable(channel, "STREAM_PLAYBACK_TARGET_MS");
+        if (playbackTarget) {
+            char *endptr;
+            long value = strtol(playbackTarget, &endptr, 10);
+            if (*endptr == '\0' && value >= 40 && value <= 1500) {
+                options.playback_target_ms = (uint32_t) value;
+            }
+        }
+
+        if (switch_channel_var_true(channel, "STREAM_PLAYBACK_CATCHUP")) {
+            options.catchup = true;
+        }
+
+        const char* catchupThreshold = switch_channel_get_variable(channel, "STREAM_PLAYBACK_CATCHUP_MS");
+        if (catchupThreshold) {
+            char *endptr;
+            long value = strtol(catchupThreshold, &endptr, 10);
+            if (*endptr == '\0' && value >= 100 && value <= 1900) {
+                options.catchup_ms = (uint32_t) value;
+            }
+        }
+
+        const char* statusInterval = switch_channel_get_variable(channel, "STREAM_PLAYBACK_STATUS_MS");
+        if (statusInterval) {
+            char *endptr;
+            long value = strtol(statusInterval, &endptr, 10);
+            if (*endptr == '\0' && (value == 0 || (value >= 100 && value <= 60000))) {
+                options.status_ms = (uint32_t) value;
+            }
+        }
+
+        if (switch_channel_var_true(channel, "STREAM_PLAYBACK_ACKS")) {
+            options.acks = true;
+        }
+    }
 
     switch_status_t stream_data_init(private_t *tech_pvt, switch_core_session_t *session, char *wsUri,
-                                     uint32_t sampling, int desiredSampling, int channels, int audio_format, char *metadata, responseHandler_t responseHandler,
-                                     int deflate, int heart_beat, bool suppressLog, int rtp_packets, const char* extra_headers,
-                                     bool no_reconnect, const char *tls_cafile, const char *tls_keyfile,
-                                     const char *tls_certfile, bool tls_disable_hostname_validation)
+                                     uint32_t sampling, int desiredSampling, int channels, bool reference, int audio_format,
+                                     char *metadata, responseHandler_t responseHandler, const stream_options &options)
     {
         int err; //speex
 
         switch_memory_pool_t *pool = switch_core_session_get_pool(session);
 
-        memset(tech_pvt, 0, sizeof(private_t));
-
-        /* Use strncpy with explicit null-termination to prevent buffer overread */
-        strncpy(tech_pvt->sessionId, switch_core_session_get_uuid(session), MAX_SESSION_ID - 1);
-        tech_pvt->sessionId[MAX_SESSION_ID - 1] = '\0';
-        strncpy(tech_pvt->ws_uri, wsUri, MAX_WS_URI - 1);
-        tech_pvt->ws_uri[MAX_WS_URI - 1] = '\0';
+        /* tech_pvt comes zeroed from the session pool, strings are sized to their content */
+        tech_pvt->sessionId = switch_core_session_strdup(session, switch_core_session_get_uuid(session));
+        tech_pvt->ws_uri = switch_core_session_strdup(session, wsUri);
         tech_pvt->sampling = desiredSampling;
         tech_pvt->responseHandler = responseHandler;
-        tech_pvt->rtp_packets = rtp_packets;
+        tech_pvt->rtp_packets = options.rtp_packets;
         tech_pvt->channels = channels;
-        tech_pvt->audio_paused = 0;
+        tech_pvt->reference = reference ? 1 : 0;
         tech_pvt->audio_format = audio_format;
         tech_pvt->codec_initialized = 0;
 
-        if (metadata) {
-            strncpy(tech_pvt->initialMetadata, metadata, MAX_METADATA_LEN - 1);
-            tech_pvt->initialMetadata[MAX_METADATA_LEN - 1] = '\0';
+        tech_pvt->stats = (stream_stats_t *) switch_core_alloc(pool, sizeof(stream_stats_t));
+        tech_pvt->stats->slow_ns = (uint64_t)options.slow_tick_us * 1000;
+        tech_pvt->stats->last_server_ns = -1;
+        tech_pvt->mark_interval_ns = (uint64_t)options.mark_interval_ms * 1000000;
+
+        if (!zstr(metadata)) {
+            tech_pvt->initialMetadata = switch_core_strndup(pool, metadata, MAX_METADATA_LEN - 1);
         }
 
         /* Calculate buffer length with overflow protection
@@ -376,22 +2399,109 @@ namespace {
          * Max reasonable values: 48kHz, 2 channels, 10 rtp_packets = 320 * 6 * 2 * 10 = 38400
          */
         const size_t buflen = ((size_t)FRAME_SIZE_8000 * (size_t)desiredSampling / 8000) * 
-                              (size_t)channels * (size_t)rtp_packets;
+                              (size_t)channels * (size_t)options.rtp_packets;
 
-        auto* as = new AudioStreamer(tech_pvt->sessionId, wsUri, responseHandler, deflate, heart_beat,
-                                        suppressLog, extra_headers, no_reconnect,
-                                        tls_cafile, tls_keyfile, tls_certfile, tls_disable_hostname_validation);
+#ifndef HAVE_OPUS
+        if (audio_format == AUDIO_FORMAT_OPUS) {
+            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
+                "(%s) Opus requested but mod_audio_stream was built without libopus\n", tech_pvt->sessionId);
+            return SWITCH_STATUS_FALSE;
+        }
+#endif
 
-        tech_pvt->pAudioStreamer = static_cast<void *>(as);
+        tech_pvt->scratch = create_scratch(pool, desiredSampling != (int) sampling, desiredSampling, channels,
+                                           audio_format == AUDIO_FORMAT_PCMU || audio_format == AUDIO_FORMAT_PCMA,
+                                           options.rtp_packets > 1 && audio_format != AUDIO_FORMAT_OPUS ? buflen : 0, reference);
+        if (!tech_pvt->scratch) {
+            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
+                "%s: Error allocating stream buffers.\n", tech_pvt->sessionId);
+            return SWITCH_STATUS_FALSE;
+        }
 
-        switch_mutex_init(&tech_pvt->mutex, SWITCH_MUTEX_NESTED, pool);
-        
-        if (switch_buffer_create(pool, &tech_pvt->sbuffer, buflen) != SWITCH_STATUS_SUCCESS) {
+        /* turned off below when the capture cannot take them */
+        bool aec = options.aec, denoise = options.denoise, agc = options.agc;
+        if (aec && (sampling != 8000 || channels != 1)) {
+            /* the reference is the 8kHz mono playback, the canceller runs on captured frames as read */
+            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING,
+                "%s: STREAM_AEC needs an 8kHz mono capture (read rate %u, %d channels), echo cancellation disabled.\n",
+                tech_pvt->sessionId, sampling, channels);
+            aec = false;
+        }
+        if ((denoise || agc) && channels != 1 && !reference) {
+            /* the preprocessor tracks one signal; a stereo capture is two */
+            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING,
+                "%s: STREAM_DENOISE/STREAM_AGC need a mono capture (%d channels), preprocessing disabled.\n",
+                tech_pvt->sessionId, channels);
+            denoise = agc = false;
+        }
+        if (aec || denoise || agc) {
+            tech_pvt->dsp = create_dsp(pool, sampling, aec ? options.aec_tail_ms : 0, denoise ? options.denoise_db : 0, agc ? options.agc_dbfs : 0);
+            if (!tech_pvt->dsp) {
+                switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
+                    "%s: Error allocating capture DSP state.\n", tech_pvt->sessionId);
+                return SWITCH_STATUS_FALSE;
+            }
+        }
+
+        if ((tech_pvt->dsp && tech_pvt->dsp->echo) || reference) {
+            tech_pvt->scratch->reference = create_reference(pool, sampling);
+            if (!tech_pvt->scratch->reference) {
+                switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
+                    "%s: Error allocating playback reference.\n", tech_pvt->sessionId);
+                return SWITCH_STATUS_FALSE;
+            }
+        }
+
+        if (options.drift) {
+            tech_pvt->scratch->drift = create_drift(pool, options.playback_target_ms);
+            if (!tech_pvt->scratch->drift) {
+                switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
+                    "%s: Error allocating playback drift compensation.\n", tech_pvt->sessionId);
+                return SWITCH_STATUS_FALSE;
+            }
+        }
+
+        if (options.catchup) {
+            uint32_t catchup_ms = options.catchup_ms;
+            if (catchup_ms < options.playback_target_ms + 40) {
+                switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING,
+                    "(%s) STREAM_PLAYBACK_CATCHUP_MS must exceed STREAM_PLAYBACK_TARGET_MS by 40ms, using %ums\n",
+                    tech_pvt->sessionId, options.playback_target_ms + 40);
+                catchup_ms = options.playback_target_ms + 40;
+            }
+            tech_pvt->scratch->wsola = create_wsola(pool, options.playback_target_ms, catchup_ms);
+            if (!tech_pvt->scratch->wsola) {
+                switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
+                    "%s: Error allocating playback catch-up.\n", tech_pvt->sessionId);
+                return SWITCH_STATUS_FALSE;
+            }
+        }
+
+        tech_pvt->scratch->queue = (stream_queue_t *) switch_core_alloc(pool, sizeof(stream_queue_t));
+        if (!tech_pvt->scratch->queue) {
             switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
-                "%s: Error creating switch buffer.\n", tech_pvt->sessionId);
+                "%s: Error allocating playback queue.\n", tech_pvt->sessionId);
             return SWITCH_STATUS_FALSE;
         }
-        
+
+        if (options.status_ms || options.acks) {
+            tech_pvt->scratch->report = create_report(pool, options.status_ms, options.acks);
+            if (!tech_pvt->scratch->report) {
+                switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
+                    "%s: Error allocating playback reporting.\n", tech_pvt->sessionId);
+                return SWITCH_STATUS_FALSE;
+            }
+        }
+
+        if (options.vad) {
+            tech_pvt->vad = create_vad(pool, sampling, channels, options.vad_threshold_dbfs, options.vad_hangover_ms, options.vad_preroll_ms);
+            if (!tech_pvt->vad) {
+                switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
+                    "%s: Error allocating VAD state.\n", tech_pvt->sessionId);
+                return SWITCH_STATUS_FALSE;
+            }
+        }
+
         /* NETPLAY: Create playback buffer for streaming audio from WebSocket */
         /* Buffer size: 2 seconds of L16 audio @ 8kHz = 8000 * 2 * 2 = 32000 bytes */
         const size_t playback_buflen = 32000;
@@ -426,14 +2536,6 @@ namespace {
                 switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
                     "(%s) G.711 (%s) requires 8kHz sample rate, got %d Hz\n", 
                     tech_pvt->sessionId, codec_name, desiredSampling);
-                /* Clean up AudioStreamer before returning to prevent memory leak */
-                if (tech_pvt->pAudioStreamer) {
-                    auto* as = static_cast<AudioStreamer*>(tech_pvt->pAudioStreamer);
-                    as->markCleanedUp();
-                    as->disconnect();
-                    delete as;
-                    tech_pvt->pAudioStreamer = nullptr;
-                }
                 return SWITCH_STATUS_FALSE;
             }
             
@@ -452,14 +2554,6 @@ namespace {
                                        pool) != SWITCH_STATUS_SUCCESS) {
                 switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
                     "(%s) Failed to initialize %s codec\n", tech_pvt->sessionId, codec_name);
-                /* Clean up AudioStreamer before returning to prevent memory leak */
-                if (tech_pvt->pAudioStreamer) {
-                    auto* as = static_cast<AudioStreamer*>(tech_pvt->pAudioStreamer);
-                    as->markCleanedUp();
-                    as->disconnect();
-                    delete as;
-                    tech_pvt->pAudioStreamer = nullptr;
-                }
                 return SWITCH_STATUS_FALSE;
             }
             tech_pvt->codec_initialized = 1;
@@ -467,25 +2561,125 @@ namespace {
                 "(%s) %s codec initialized successfully\n", tech_pvt->sessionId, codec_name);
         }
 
+#ifdef HAVE_OPUS
+        if (audio_format == AUDIO_FORMAT_OPUS) {
+            int frames = options.rtp_packets;
+            if (frames > STREAM_OPUS_FRAMES_MAX) {
+                switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING,
+                    "(%s) Opus packets hold at most %dms, sending %dms packets\n",
+                    tech_pvt->sessionId, STREAM_OPUS_FRAMES_MAX * 20, STREAM_OPUS_FRAMES_MAX * 20);
+                frames = STREAM_OPUS_FRAMES_MAX;
+            }
+            int opus_err;
+            tech_pvt->scratch->opus = create_opus(pool, desiredSampling, channels, frames, options.opus_bitrate, options.opus_complexity, &opus_err);
+            if (!tech_pvt->scratch->opus) {
+                switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
+                    "(%s) Failed to initialize Opus encoder: %s\n", tech_pvt->sessionId, opus_strerror(opus_err));
+                return SWITCH_STATUS_FALSE;
+            }
+            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO,
+                "(%s) Opus encoder initialized, %dms packets, bitrate %d, complexity %d\n",
+                tech_pvt->sessionId, frames * 20, options.opus_bitrate, options.opus_complexity);
+        }
+#endif
+
+        /* last: it connects right away, so nothing above may fail with it already talking to the server */
+        const ws_options &ws = options.ws;
+        auto* as = new AudioStreamer(tech_pvt->sessionId, wsUri, responseHandler, ws.deflate, ws.heart_beat,
+                                        ws.suppress_log, ws.extra_headers, ws.no_reconnect,
+                                        ws.tls_cafile, ws.tls_keyfile, ws.tls_certfile, ws.tls_disable_hostname_validation,
+                                        tech_pvt->initialMetadata);
+
+        tech_pvt->pAudioStreamer = static_cast<void *>(as);
+
+        tech_pvt->pipeline = select_pipeline(tech_pvt);
+
         switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "(%s) stream_data_init\n", tech_pvt->sessionId);
 
         return SWITCH_STATUS_SUCCESS;
     }
 
+    void report_round_trip(switch_core_session_t *session, private_t *tech_pvt, const stream_mark_t &mark, uint64_t played_ns) {
+        const uint64_t total_ns = played_ns - mark.sent_ns;
+        const uint64_t echo_ns = mark.echo_ns - mark.sent_ns;
+        const uint64_t network_ns = (mark.server_ns >= 0 && echo_ns > (uint64_t)mark.server_ns) ? echo_ns - mark.server_ns : echo_ns;
+        const uint64_t playout_ns = played_ns - mark.echo_ns;
+
+        stream_latency_record(SM_HIST_ROUND_TRIP, &tech_pvt->stats->round_trip, total_ns, 0);
+        __atomic_store_n(&tech_pvt->stats->last_network_ns, network_ns, __ATOMIC_RELAXED);
+        __atomic_store_n(&tech_pvt->stats->last_server_ns, mark.server_ns, __ATOMIC_RELAXED);
+        __atomic_store_n(&tech_pvt->stats->last_playout_ns, playout_ns, __ATOMIC_RELAXED);
+
+        cJSON *root = cJSON_CreateObject();
+        cJSON_AddNumberToObject(root, "seq", mark.seq);
+        cJSON_AddNumberToObject(root, "total_ms", (double)total_ns / 1e6);
+        cJSON_AddNumberToObject(root, "network_rtt_ms", (double)network_ns / 1e6);
+        cJSON_AddNumberToObject(root, "server_ms", mark.server_ns >= 0 ? (double)mark.server_ns / 1e6 : -1.0);
+        cJSON_AddNumberToObject(root, "playout_ms", (double)playout_ns / 1e6);
+        char *json_str = cJSON_PrintUnformatted(root);
+        tech_pvt->responseHandler(session, EVENT_LATENCY, json_str);
+        cJSON_Delete(root);
+        switch_safe_free(json_str);
+    }
+
+    void send_mark(private_t *tech_pvt, AudioStreamer *pAudioStreamer, uint64_t now) {
+        char mark[128];
+        snprintf(mark, sizeof(mark), "{\"type\":\"mark\",\"seq\":%u,\"ts\":%llu,\"samples\":%llu}",
+                 ++tech_pvt->mark_seq, (unsigned long long)(now / 1000), (unsigned long long)tech_pvt->samples_sent);
+        pAudioStreamer->writeText(mark);
+        tech_pvt->next_mark_ns = now + tech_pvt->mark_interval_ns;
+    }
+
+    void send_playback_ack(const stream_chunk_t &chunk) {
+        const uint64_t played = chunk.interrupted ? chunk.heard : chunk.end - chunk.start - chunk.skipped;
+        char ack[128];
+        snprintf(ack, sizeof(ack), "{\"type\":\"playbackAck\",\"id\":%s,\"playedMs\":%llu%s}",
+                 chunk.id, (unsigned long long)(played / 16), chunk.interrupted ? ",\"interrupted\":true" : "");
+        static_cast<AudioStreamer *>(chunk.origin)->reply(ack);
+    }
+
+    /* buffered is the playback backlog in bytes; playedMs counts what reached the call, not what was received */
+    void send_playback_status(private_t *tech_pvt, AudioStreamer *pAudioStreamer, switch_size_t buffered, int playing) {
+        const stream_report_t *report = tech_pvt->scratch->report;
+        char status[192];
+        snprintf(status, sizeof(status),
+                 "{\"type\":\"playbackStatus\",\"bufferedMs\":%llu,\"playedMs\":%llu,\"underruns\":%llu,\"overruns\":%llu,\"playing\":%s}",
+                 (unsigned long long)(buffered / 16), (unsigned long long)(report->injected / 16),
+                 (unsigned long long)__atomic_load_n(&tech_pvt->stats->playback_underruns, __ATOMIC_RELAXED),
+                 (unsigned long long)__atomic_load_n(&tech_pvt->stats->playback_overruns, __ATOMIC_RELAXED),
+                 playing ? "true" : "false");
+        pAudioStreamer->writeText(status);
+    }
+
     void destroy_tech_pvt(private_t* tech_pvt) {
         switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "%s destroy_tech_pvt\n", tech_pvt->sessionId);
         if (tech_pvt->resampler) {
             speex_resampler_destroy(tech_pvt->resampler);
             tech_pvt->resampler = nullptr;
         }
+        if (tech_pvt->scratch && tech_pvt->scratch->reference && tech_pvt->scratch->reference->resampler) {
+            speex_resampler_destroy(tech_pvt->scratch->reference->resampler);
+            tech_pvt->scratch->reference->resampler = nullptr;
+        }
+        if (tech_pvt->scratch && tech_pvt->scratch->drift && tech_pvt->scratch->drift->resampler) {
+            speex_resampler_destroy(tech_pvt->scratch->drift->resampler);
+            tech_pvt->scratch->drift->resampler = nullptr;
+        }
+        if (tech_pvt->dsp && tech_pvt->dsp->preprocess) {
+            speex_preprocess_state_destroy(tech_pvt->dsp->preprocess);
+            tech_pvt->dsp->preprocess = nullptr;
+        }
+        if (tech_pvt->dsp && tech_pvt->dsp->echo) {
+            speex_echo_state_destroy(tech_pvt->dsp->echo);
+            tech_pvt->dsp->echo = nullptr;
+        }
+        if (tech_pvt->scratch && tech_pvt->scratch->queue) {
+            AudioStreamer::clear_feeds(tech_pvt->scratch->queue);
+        }
         if (tech_pvt->codec_initialized) {
             switch_core_codec_destroy(&tech_pvt->write_codec);
             tech_pvt->codec_initialized = 0;
         }
-        if (tech_pvt->mutex) {
-            switch_mutex_destroy(tech_pvt->mutex);
-            tech_pvt->mutex = nullptr;
-        }
         /*if (tech_pvt->pAudioStreamer) {
             auto* as = (AudioStreamer *) tech_pvt->pAudioStreamer;
             delete as;
@@ -493,10 +2687,34 @@ namespace {
         }*/
     }
 
+    /*
+     * pAudioStreamer is read without a lock: readers bump streamer_refs and then check
+     * STREAM_STATE_CLEANUP, cleanup sets the flag and then waits for the refs to drain
+     * before deleting. Either the reader sees the flag or cleanup sees the ref.
+     */
+    AudioStreamer *acquire_streamer(private_t *tech_pvt) {
+        __atomic_fetch_add(&tech_pvt->streamer_refs, 1, __ATOMIC_SEQ_CST);
+        auto *pAudioStreamer = stream_state_test(tech_pvt, STREAM_STATE_CLEANUP) ? nullptr :
+                static_cast<AudioStreamer *>(__atomic_load_n(&tech_pvt->pAudioStreamer, __ATOMIC_ACQUIRE));
+        if (!pAudioStreamer) {
+            __atomic_fetch_sub(&tech_pvt->streamer_refs, 1, __ATOMIC_RELEASE);
+        }
+        return pAudioStreamer;
+    }
+
+    inline void release_streamer(private_t *tech_pvt) {
+        __atomic_fetch_sub(&tech_pvt->streamer_refs, 1, __ATOMIC_RELEASE);
+    }
+
+    /* the whole fan-out chain; nothing else holds it once the refs are drained */
     void finish(AudioStreamer* audioStreamer) {
-        audioStreamer->markCleanedUp();
-        audioStreamer->disconnect();
-        delete audioStreamer;
+        while (audioStreamer) {
+            AudioStreamer *next = audioStreamer->next();
+            audioStreamer->markCleanedUp();
+            audioStreamer->disconnect();
+            delete audioStreamer;
+            audioStreamer = next;
+        }
     }
 
 }
@@ -588,8 +2806,11 @@ extern "C" {
         auto *tech_pvt = (private_t*) switch_core_media_bug_get_user_data(bug);
 
         if (!tech_pvt) return SWITCH_STATUS_FALSE;
-        auto *pAudioStreamer = static_cast<AudioStreamer *>(tech_pvt->pAudioStreamer);
-        if (pAudioStreamer && text) pAudioStreamer->writeText(text);
+        auto *pAudioStreamer = acquire_streamer(tech_pvt);
+        if (pAudioStreamer) {
+            if (text) pAudioStreamer->writeText(text);
+            release_streamer(tech_pvt);
+        }
 
         return SWITCH_STATUS_SUCCESS;
     }
@@ -606,74 +2827,103 @@ extern "C" {
         if (!tech_pvt) return SWITCH_STATUS_FALSE;
 
         switch_core_media_bug_flush(bug);
-        tech_pvt->audio_paused = pause;
+        if (pause) {
+            stream_state_set(tech_pvt, STREAM_STATE_PAUSED);
+        } else {
+            stream_state_clear(tech_pvt, STREAM_STATE_PAUSED);
+        }
         return SWITCH_STATUS_SUCCESS;
     }
 
-    switch_status_t stream_session_init(switch_core_session_t *session,
-                                        responseHandler_t responseHandler,
-                                        uint32_t samples_per_second,
-                                        char *wsUri,
-                                        int sampling,
-                                        int channels,
-                                        int audio_format,
-                                        char* metadata,
-                                        void **ppUserData)
-    {
-        int deflate = 0;
-        int heart_beat = 0;
-        bool suppressLog = false;
-        const char* buffer_size = NULL;
-        const char* extra_headers = NULL;
-        int rtp_packets = 1; //20ms burst
-        bool no_reconnect = false;
-        const char* tls_cafile = NULL;
-        const char* tls_keyfile = NULL;
-        const char* tls_certfile = NULL;
-        bool tls_disable_hostname_validation = false;
-
+    switch_status_t stream_session_stats(switch_core_session_t *session, switch_stream_handle_t *stream) {
         switch_channel_t *channel = switch_core_session_get_channel(session);
-
-        if (switch_channel_var_true(channel, "STREAM_MESSAGE_DEFLATE")) {
-            deflate = 1;
+        auto *bug = (switch_media_bug_t*) switch_channel_get_private(channel, MY_BUG_NAME);
+        if (!bug) {
+            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "stream_session_stats failed because no bug\n");
+            return SWITCH_STATUS_FALSE;
         }
+        auto *tech_pvt = (private_t*) switch_core_media_bug_get_user_data(bug);
 
-        if (switch_channel_var_true(channel, "STREAM_SUPPRESS_LOG")) {
-            suppressLog = true;
+        if (!tech_pvt || !tech_pvt->stats) return SWITCH_STATUS_FALSE;
+
+        cJSON *json = cJSON_CreateObject();
+        cJSON_AddStringToObject(json, "uuid", tech_pvt->sessionId);
+        cJSON_AddNumberToObject(json, "slow_threshold_us", (double)(tech_pvt->stats->slow_ns / 1000));
+        cJSON_AddNumberToObject(json, "skipped_ticks", (double)__atomic_load_n(&tech_pvt->stats->skipped_ticks, __ATOMIC_RELAXED));
+        cJSON_AddItemToObject(json, "tick", lat_hist_summary(&tech_pvt->stats->tick));
+        cJSON_AddItemToObject(json, "message", lat_hist_summary(&tech_pvt->stats->message));
+        cJSON *round_trip = lat_hist_summary(&tech_pvt->stats->round_trip);
+        const int64_t last_server_ns = __atomic_load_n(&tech_pvt->stats->last_server_ns, __ATOMIC_RELAXED);
+        cJSON_AddNumberToObject(round_trip, "last_network_rtt_ms", (double)__atomic_load_n(&tech_pvt->stats->last_network_ns, __ATOMIC_RELAXED) / 1e6);
+        cJSON_AddNumberToObject(round_trip, "last_server_ms", last_server_ns >= 0 ? (double)last_server_ns / 1e6 : -1.0);
+        cJSON_AddNumberToObject(round_trip, "last_playout_ms", (double)__atomic_load_n(&tech_pvt->stats->last_playout_ns, __ATOMIC_RELAXED) / 1e6);
+        cJSON_AddItemToObject(json, "round_trip", round_trip);
+        if (tech_pvt->vad) {
+            const uint64_t frames = __atomic_load_n(&tech_pvt->stats->vad_frames, __ATOMIC_RELAXED);
+            const uint64_t suppressed = __atomic_load_n(&tech_pvt->stats->vad_suppressed, __ATOMIC_RELAXED);
+            cJSON *vad = cJSON_CreateObject();
+            cJSON_AddNumberToObject(vad, "frames", (double)frames);
+            cJSON_AddNumberToObject(vad, "suppressed", (double)suppressed);
+            cJSON_AddNumberToObject(vad, "suppressed_ratio", frames ? (double)suppressed / (double)frames : 0.0);
+            cJSON_AddItemToObject(json, "vad", vad);
         }
-
-        if (switch_channel_var_true(channel, "STREAM_NO_RECONNECT")) {
-            no_reconnect = true;
+        if (tech_pvt->dsp && tech_pvt->dsp->echo) {
+            cJSON_AddItemToObject(json, "aec", lat_hist_summary(&tech_pvt->stats->aec));
         }
-
-        tls_cafile = switch_channel_get_variable(channel, "STREAM_TLS_CA_FILE");
-        tls_keyfile = switch_channel_get_variable(channel, "STREAM_TLS_KEY_FILE");
-        tls_certfile = switch_channel_get_variable(channel, "STREAM_TLS_CERT_FILE");
-
-        if (switch_channel_var_true(channel, "STREAM_TLS_DISABLE_HOSTNAME_VALIDATION")) {
-            tls_disable_hostname_validation = true;
+        if (tech_pvt->dsp && tech_pvt->dsp->preprocess) {
+            cJSON_AddItemToObject(json, "preprocess", lat_hist_summary(&tech_pvt->stats->preprocess));
         }
-
-        const char* heartBeat = switch_channel_get_variable(channel, "STREAM_HEART_BEAT");
-        if (heartBeat) {
-            char *endptr;
-            long value = strtol(heartBeat, &endptr, 10);
-            if (*endptr == '\0' && value <= INT_MAX && value >= INT_MIN) {
-                heart_beat = (int) value;
+        if (tech_pvt->playback_buffer) {
+            const stream_drift_t *drift = tech_pvt->scratch->drift;
+            const stream_wsola_t *wsola = tech_pvt->scratch->wsola;
+            cJSON *playback = cJSON_CreateObject();
+            cJSON_AddNumberToObject(playback, "underruns", (double)__atomic_load_n(&tech_pvt->stats->playback_underruns, __ATOMIC_RELAXED));
+            cJSON_AddNumberToObject(playback, "overruns", (double)__atomic_load_n(&tech_pvt->stats->playback_overruns, __ATOMIC_RELAXED));
+            if (drift || wsola) {
+                cJSON_AddNumberToObject(playback, "target_ms", (double)((drift ? drift->target : wsola->target) / 8));
+            }
+            if (drift) {
+                cJSON_AddNumberToObject(playback, "depth_ms", (double)__atomic_load_n(&drift->depth_q8, __ATOMIC_RELAXED) / 256.0 / 8.0);
+                cJSON_AddNumberToObject(playback, "drift_ppm", (double)__atomic_load_n(&drift->ppm, __ATOMIC_RELAXED));
             }
+            if (wsola) {
+                cJSON_AddNumberToObject(playback, "catchup_ms", (double)(wsola->threshold / 8));
+                cJSON_AddBoolToObject(playback, "catching_up", __atomic_load_n(&wsola->active, __ATOMIC_RELAXED));
+                cJSON_AddNumberToObject(playback, "catchups", (double)__atomic_load_n(&wsola->episodes, __ATOMIC_RELAXED));
+                cJSON_AddNumberToObject(playback, "caught_up_ms", (double)__atomic_load_n(&wsola->saved, __ATOMIC_RELAXED) / 8.0);
+            }
+            cJSON_AddItemToObject(json, "playback", playback);
         }
-
-        if ((buffer_size = switch_channel_get_variable(channel, "STREAM_BUFFER_SIZE"))) {
-            int bSize = atoi(buffer_size);
-            if(bSize % 20 != 0) {
-                switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING, "%s: Buffer size of %s is not a multiple of 20ms. Using default 20ms.\n",
-                                  switch_channel_get_name(channel), buffer_size);
-            } else if(bSize >= 20){
-                rtp_packets = bSize/20;
+        AudioStreamer *as = acquire_streamer(tech_pvt);
+        if (as) {
+            cJSON *destinations = cJSON_CreateArray();
+            for (AudioStreamer *d = as; d; d = d->next()) {
+                cJSON_AddItemToArray(destinations, d->destinationStats());
             }
+            cJSON_AddItemToObject(json, "destinations", destinations);
+            release_streamer(tech_pvt);
         }
 
-        extra_headers = switch_channel_get_variable(channel, "STREAM_EXTRA_HEADERS");
+        char *json_str = cJSON_PrintUnformatted(json);
+        stream->write_function(stream, "%s\n", json_str);
+        cJSON_Delete(json);
+        switch_safe_free(json_str);
+        return SWITCH_STATUS_SUCCESS;
+    }
+
+    switch_status_t stream_session_init(switch_core_session_t *session,
+                                        responseHandler_t responseHandler,
+                                        uint32_t samples_per_second,
+                                        char *wsUri,
+                                        int sampling,
+                                        int channels,
+                                        int reference,
+                                        int audio_format,
+                                        char* metadata,
+                                        void **ppUserData)
+    {
+        stream_options options;
+        read_stream_options(session, options);
 
         // allocate per-session tech_pvt
         auto* tech_pvt = (private_t *) switch_core_session_alloc(session, sizeof(private_t));
@@ -682,72 +2932,74 @@ extern "C" {
             switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "error allocating memory!\n");
             return SWITCH_STATUS_FALSE;
         }
-        if (SWITCH_STATUS_SUCCESS != stream_data_init(tech_pvt, session, wsUri, samples_per_second, sampling, channels, audio_format, metadata, responseHandler, deflate, heart_beat,
-                                                        suppressLog, rtp_packets, extra_headers, no_reconnect, tls_cafile, tls_keyfile, tls_certfile, tls_disable_hostname_validation)) {
+        if (SWITCH_STATUS_SUCCESS != stream_data_init(tech_pvt, session, wsUri, samples_per_second, sampling, channels, reference != 0,
+                                                      audio_format, metadata, responseHandler, options)) {
             destroy_tech_pvt(tech_pvt);
             return SWITCH_STATUS_FALSE;
         }
 
         *ppUserData = tech_pvt;
+        stream_metrics_add(SM_STREAMS_STARTED, 1);
 
         return SWITCH_STATUS_SUCCESS;
     }
 
-    /* Helper function to encode L16 PCM to G.711 
-     * 
-     * Note: G.711 requires 8kHz audio. If input is not 8kHz, encoding will fail.
-     * The caller must ensure proper sample rate before calling this function.
-     * 
-     * L16 @ 8kHz: 160 samples = 320 bytes per 20ms frame
-     * G.711 @ 8kHz: 160 samples = 160 bytes per 20ms frame (1 byte per sample)
+    /*
+     * A further start on a call that is already streaming: the existing capture, resample and
+     * encode run once and every frame goes to this destination too. Only the connection is new,
+     * so the mix type, rate and format have to match what the capture was started with.
      */
-    static size_t encode_g711(private_t *tech_pvt, const uint8_t *pcm_data, size_t pcm_len, uint8_t *g711_data, size_t g711_buflen) {
-        if (!tech_pvt || !tech_pvt->codec_initialized) {
-            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, 
-                "encode_g711: codec not initialized\n");
-            return 0;
-        }
-        
-        if (!pcm_data || pcm_len == 0) {
-            return 0;
+    switch_status_t stream_session_add_destination(switch_core_session_t *session, char *wsUri, int sampling,
+                                                   int channels, int reference, int audio_format, char *metadata) {
+        switch_channel_t *channel = switch_core_session_get_channel(session);
+        auto *bug = (switch_media_bug_t*) switch_channel_get_private(channel, MY_BUG_NAME);
+        if (!bug) {
+            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "stream_session_add_destination failed because no bug\n");
+            return SWITCH_STATUS_FALSE;
         }
-        
-        /* Validate buffer size: G.711 output is half the size of L16 input */
-        size_t expected_output = pcm_len / 2;
-        if (g711_buflen < expected_output) {
-            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, 
-                "encode_g711: output buffer too small (%zu < %zu)\n", g711_buflen, expected_output);
-            return 0;
+        auto *tech_pvt = (private_t*) switch_core_media_bug_get_user_data(bug);
+        if (!tech_pvt) return SWITCH_STATUS_FALSE;
+
+        if (tech_pvt->sampling != sampling || tech_pvt->channels != channels ||
+            tech_pvt->reference != (reference ? 1 : 0) || tech_pvt->audio_format != audio_format) {
+            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
+                "(%s) already streaming to %s, another destination must use the same mix type, sampling rate and format\n",
+                tech_pvt->sessionId, tech_pvt->ws_uri);
+            return SWITCH_STATUS_FALSE;
         }
-        
-        uint32_t encoded_len = (uint32_t)g711_buflen;
-        uint32_t encoded_rate = 8000;
-        unsigned int flags = 0;
-        
-        switch_status_t status = switch_core_codec_encode(
-            &tech_pvt->write_codec,
-            NULL,
-            (void *)pcm_data,
-            (uint32_t)pcm_len,
-            8000,  /* G.711 is always 8kHz */
-            g711_data,
-            &encoded_len,
-            &encoded_rate,
-            &flags
-        );
-        
-        if (status != SWITCH_STATUS_SUCCESS) {
-            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, 
-                "encode_g711: switch_core_codec_encode failed (pcm_len=%zu)\n", pcm_len);
-            return 0;
+
+        AudioStreamer *head = acquire_streamer(tech_pvt);
+        if (!head) return SWITCH_STATUS_FALSE;
+
+        int destinations = 0;
+        for (AudioStreamer *d = head; d; d = d->next()) destinations++;
+        if (destinations >= MAX_DESTINATIONS) {
+            release_streamer(tech_pvt);
+            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
+                "(%s) already streaming to %d destinations\n", tech_pvt->sessionId, destinations);
+            return SWITCH_STATUS_FALSE;
         }
-        
-        return (size_t)encoded_len;
+
+        ws_options ws;
+        read_ws_options(channel, ws);
+        const std::string destinationMetadata = zstr(metadata) ? std::string() :
+                std::string(metadata, strnlen(metadata, MAX_METADATA_LEN - 1));
+
+        auto *as = new AudioStreamer(tech_pvt->sessionId, wsUri, tech_pvt->responseHandler, ws.deflate, ws.heart_beat,
+                                     ws.suppress_log, ws.extra_headers, ws.no_reconnect,
+                                     ws.tls_cafile, ws.tls_keyfile, ws.tls_certfile, ws.tls_disable_hostname_validation,
+                                     destinationMetadata.c_str());
+        head->addDestination(as);
+        release_streamer(tech_pvt);
+
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO,
+            "(%s) added destination %s\n", tech_pvt->sessionId, wsUri);
+        return SWITCH_STATUS_SUCCESS;
     }
 
     switch_bool_t stream_frame(switch_media_bug_t *bug) {
         auto *tech_pvt = (private_t *)switch_core_media_bug_get_user_data(bug);
-        if (!tech_pvt || tech_pvt->audio_paused) return SWITCH_TRUE;
+        if (!tech_pvt || stream_state_test(tech_pvt, STREAM_STATE_PAUSED)) return SWITCH_TRUE;
         
         /* NETPLAY v2.5: Full-duplex mode - AEC no Python
          * 
@@ -760,166 +3012,219 @@ extern "C" {
          * 3. Python envia audio limpo para OpenAI
          * 
          * Isso permite barge-in real durante a fala do agente.
+         *
+         * Com STREAM_AEC o cancelamento é feito aqui mesmo (dsp_filter), usando como
+         * referência o playback exato injetado em cada tick, e o Python recebe audio limpo.
          */
-        /*
-        auto flush_sbuffer = [&]() {
-            switch_size_t inuse = switch_buffer_inuse(tech_pvt->sbuffer);
-            if (inuse > 0) {
-                std::vector<uint8_t> tmp(inuse);
-                switch_buffer_read(tech_pvt->sbuffer, tmp.data(), inuse);
-                switch_buffer_zero(tech_pvt->sbuffer);
-                pAudioStreamer->writeBinary(tmp.data(), inuse);
-            }
-        };
-        */
-        if (switch_mutex_trylock(tech_pvt->mutex) == SWITCH_STATUS_SUCCESS) {
+        auto *pAudioStreamer = acquire_streamer(tech_pvt);
+        if (!pAudioStreamer || !pAudioStreamer->anyConnected()) {
+            if (pAudioStreamer) release_streamer(tech_pvt);
+            __atomic_fetch_add(&tech_pvt->stats->skipped_ticks, 1, __ATOMIC_RELAXED);
+            stream_metrics_add(SM_SKIPPED_TICKS, 1);
+            return SWITCH_TRUE;
+        }
 
-            if (!tech_pvt->pAudioStreamer) {
-                switch_mutex_unlock(tech_pvt->mutex);
-                return SWITCH_TRUE;
+        tech_pvt->pipeline(tech_pvt, pAudioStreamer, bug);
+
+        if (tech_pvt->mark_interval_ns) {
+            const uint64_t now = stream_metrics_now_ns();
+            if (now >= tech_pvt->next_mark_ns) {
+                send_mark(tech_pvt, pAudioStreamer, now);
             }
+        }
 
-            auto *pAudioStreamer = static_cast<AudioStreamer *>(tech_pvt->pAudioStreamer);
+        release_streamer(tech_pvt);
+        return SWITCH_TRUE;
+    }
 
-            if (!pAudioStreamer->isConnected()) {
-                switch_mutex_unlock(tech_pvt->mutex);
-                return SWITCH_TRUE;
+    /* NETPLAY v2.1: Inject playback audio during READ callback
+     * This is called every 20ms when receiving audio from caller.
+     * We use this opportunity to also send audio TO the caller.
+     */
+    void stream_playback_frame(switch_media_bug_t *bug) {
+        auto *tech_pvt = (private_t *)switch_core_media_bug_get_user_data(bug);
+        switch_core_session_t *session = switch_core_media_bug_get_session(bug);
+        stream_mark_t completed[MAX_PENDING_MARKS];
+        int ncompleted = 0;
+        int16_t l16_data[160];  /* 160 samples of L16 */
+        bool injected = false;
+        stream_drift_t *drift = tech_pvt->scratch->drift;
+        stream_wsola_t *wsola = tech_pvt->scratch->wsola;
+        stream_report_t *report = tech_pvt->scratch->report;
+        stream_chunk_t acked[STREAM_ACKS_PER_TICK];
+        int nacked = 0;
+        stream_queue_t *queue = tech_pvt->scratch->queue;
+        stream_segment_t events[STREAM_SEGMENT_EVENTS_PER_TICK];
+        bool stopped[STREAM_SEGMENT_EVENTS_PER_TICK];
+        int nevents = 0;
+        switch_size_t buffered = 0;
+        int playing = 0;
+
+        if (tech_pvt->playback_buffer && tech_pvt->playback_mutex) {
+            switch_mutex_lock(tech_pvt->playback_mutex);
+
+            const switch_size_t l16_frame_size = 320;  /* L16 @ 8kHz, 20ms = 160 samples * 2 bytes */
+            const switch_size_t warmup_threshold = l16_frame_size * 5; /* 100ms warmup */
+
+            /* cancelled utterances: what playback has reached goes now, the rest is not counted as buffered */
+            const uint64_t clear = queue->cancelled ? segments_skip(tech_pvt) : UINT64_MAX;
+            /* a queued clip keeps the buffer at the depth drift and catch-up aim for, so neither acts on it */
+            if (queue->feeds_count) {
+                const uint32_t target = drift ? drift->target : wsola ? wsola->target : 0;
+                feeds_fill(tech_pvt, std::max<switch_size_t>(warmup_threshold, target * sizeof(int16_t) + l16_frame_size));
+            }
+            switch_size_t available = switch_buffer_inuse(tech_pvt->playback_buffer);
+            if (queue->cancelled) available -= std::min(available, segments_cancelled_bytes(tech_pvt));
+            /* drift and catch-up look ahead of what they play: near a cancelled segment this tick is a plain copy */
+            const bool lookahead = clear >= std::max(STREAM_WSOLA_FRAME_REACH, STREAM_DRIFT_IN_MAX) * sizeof(int16_t);
+            
+            /* Warmup: wait until we have enough buffer */
+            if (!tech_pvt->playback_active && available >= warmup_threshold) {
+                tech_pvt->playback_active = 1;
+                switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO,
+                    "🔊 Streaming started (buffer: %zu bytes)\n", available);
+            }
+            
+            /* the corrected rate takes a sample more or less now and then: a last partial millisecond is not an underrun to wait out */
+            if ((drift || wsola) && tech_pvt->playback_active && available < l16_frame_size && available <= 16) {
+                switch_buffer_toss(tech_pvt->playback_buffer, available);
+                tech_pvt->playback_played += available;
+                available = 0;
             }
 
-            /* Check if we need G.711 encoding */
-            const bool use_g711 = (tech_pvt->audio_format == AUDIO_FORMAT_PCMU || tech_pvt->audio_format == AUDIO_FORMAT_PCMA);
-
-            if (nullptr == tech_pvt->resampler) {
+            if (tech_pvt->playback_active && available >= l16_frame_size) {
+                /* Read L16 audio from buffer */
+                uint8_t pcmu_data[160]; /* 160 bytes of PCMU */
+                int i;
                 
-                uint8_t data_buf[SWITCH_RECOMMENDED_BUFFER_SIZE];
-                uint8_t g711_buf[SWITCH_RECOMMENDED_BUFFER_SIZE / 2]; /* G.711 is half the size of L16 */
-                /* Pre-allocate buffer for reading from sbuffer to avoid allocation in hot path */
-                uint8_t sbuffer_tmp[SWITCH_RECOMMENDED_BUFFER_SIZE];
-                uint8_t sbuffer_g711[SWITCH_RECOMMENDED_BUFFER_SIZE / 2];
+                const uint32_t depth = (uint32_t)(available / sizeof(int16_t));
+                if (wsola) {
+                    const int catching_up = wsola->active;
+                    wsola_track(wsola, depth);
+                    /* the drift estimate would only chase the backlog being played off; it restarts afterwards */
+                    if (drift && wsola->active && !catching_up) drift_reset(drift);
+                }
+                if (wsola && wsola->active && lookahead) {
+                    tech_pvt->playback_played += wsola_read(wsola, tech_pvt->playback_buffer, l16_data, 160);
+                } else if (drift && lookahead) {
+                    drift_track(drift, depth);
+                    tech_pvt->playback_played += drift_read(drift, tech_pvt->playback_buffer, l16_data, 160);
+                } else if (queue->cancelled) {
+                    segments_read(tech_pvt, (uint8_t *) l16_data, l16_frame_size);
+                } else {
+                    switch_buffer_read(tech_pvt->playback_buffer, l16_data, l16_frame_size);
+                    tech_pvt->playback_played += l16_frame_size;
+                }
+
+                /* marks whose audio starts in this frame complete their round trip now */
+                while (tech_pvt->marks_count && tech_pvt->marks[tech_pvt->marks_head].position < tech_pvt->playback_played) {
+                    completed[ncompleted++] = tech_pvt->marks[tech_pvt->marks_head];
+                    tech_pvt->marks_head = (tech_pvt->marks_head + 1) % MAX_PENDING_MARKS;
+                    tech_pvt->marks_count--;
+                }
                 
-                switch_frame_t frame = {0};
-                frame.data = data_buf;
-                frame.buflen = SWITCH_RECOMMENDED_BUFFER_SIZE;
-                size_t available = switch_buffer_freespace(tech_pvt->sbuffer);
-
-                while (switch_core_media_bug_read(bug, &frame, SWITCH_TRUE) == SWITCH_STATUS_SUCCESS) {
-                    if (frame.datalen) {
-                        if (1 == tech_pvt->rtp_packets) {
-                            if (use_g711 && tech_pvt->codec_initialized) {
-                                /* Encode L16 to G.711 before sending */
-                                size_t g711_len = encode_g711(tech_pvt, (uint8_t *)frame.data, frame.datalen, g711_buf, sizeof(g711_buf));
-                                if (g711_len > 0) {
-                                    pAudioStreamer->writeBinary(g711_buf, g711_len);
-                                }
-                            } else {
-                                pAudioStreamer->writeBinary((uint8_t *) frame.data, frame.datalen);
-                            }
-                            continue;
-                        }
-                        if (available >= frame.datalen) {
-                            switch_buffer_write(tech_pvt->sbuffer, static_cast<uint8_t *>(frame.data), frame.datalen);
-                        }
-                        if (0 == switch_buffer_freespace(tech_pvt->sbuffer)) {
-                            switch_size_t inuse = switch_buffer_inuse(tech_pvt->sbuffer);
-                            if (inuse > 0 && inuse <= sizeof(sbuffer_tmp)) {
-                                switch_buffer_read(tech_pvt->sbuffer, sbuffer_tmp, inuse);
-                                switch_buffer_zero(tech_pvt->sbuffer);
-                                
-                                if (use_g711 && tech_pvt->codec_initialized) {
-                                    /* Encode buffered L16 to G.711 before sending */
-                                    size_t g711_len = encode_g711(tech_pvt, sbuffer_tmp, inuse, sbuffer_g711, sizeof(sbuffer_g711));
-                                    if (g711_len > 0) {
-                                        pAudioStreamer->writeBinary(sbuffer_g711, g711_len);
-                                    }
-                                } else {
-                                    pAudioStreamer->writeBinary(sbuffer_tmp, inuse);
-                                }
-                            }
-                        }
-                    }
+                /* Convert L16 to PCMU using FreeSWITCH's built-in function */
+                for (i = 0; i < 160; i++) {
+                    pcmu_data[i] = linear_to_ulaw(l16_data[i]);
                 }
                 
-            } else {
-
-                uint8_t data[SWITCH_RECOMMENDED_BUFFER_SIZE];
-                uint8_t g711_buf[SWITCH_RECOMMENDED_BUFFER_SIZE / 2];
-                /* Pre-allocate buffers to avoid allocation in hot path */
-                uint8_t sbuffer_tmp[SWITCH_RECOMMENDED_BUFFER_SIZE];
-                uint8_t sbuffer_g711[SWITCH_RECOMMENDED_BUFFER_SIZE / 2];
-                /* Pre-allocate resampler output buffer to avoid VLA (stack overflow risk) */
-                spx_int16_t resampler_out[SWITCH_RECOMMENDED_BUFFER_SIZE / sizeof(spx_int16_t)];
-                const size_t max_out_samples = sizeof(resampler_out) / sizeof(spx_int16_t);
+                /* Get write codec (PCMU) */
+                switch_codec_t *write_codec = switch_core_session_get_write_codec(session);
                 
-                switch_frame_t frame = {};
-                frame.data = data;
-                frame.buflen = SWITCH_RECOMMENDED_BUFFER_SIZE;
-                const size_t available = switch_buffer_freespace(tech_pvt->sbuffer);
-
-                while (switch_core_media_bug_read(bug, &frame, SWITCH_TRUE) == SWITCH_STATUS_SUCCESS) {
-                    if(frame.datalen) {
-                        spx_uint32_t in_len = frame.samples;
-                        spx_uint32_t out_len = (spx_uint32_t)(max_out_samples / tech_pvt->channels);
-                        spx_int16_t *out = resampler_out;
-
-                        if(tech_pvt->channels == 1) {
-                            speex_resampler_process_int(tech_pvt->resampler,
-                                            0,
-                                            (const spx_int16_t *)frame.data,
-                                            &in_len,
-                                            &out[0],
-                                            &out_len);
-                        } else {
-                            speex_resampler_process_interleaved_int(tech_pvt->resampler,
-                                            (const spx_int16_t *)frame.data,
-                                            &in_len,
-                                            &out[0],
-                                            &out_len);
-                        }
-
-                        if(out_len > 0) {
-                            const size_t bytes_written = out_len * tech_pvt->channels * sizeof(spx_int16_t);
-                            if (tech_pvt->rtp_packets == 1) { //20ms packet
-                                if (use_g711 && tech_pvt->codec_initialized) {
-                                    /* Encode resampled L16 to G.711 before sending */
-                                    size_t g711_len = encode_g711(tech_pvt, (uint8_t *)out, bytes_written, g711_buf, sizeof(g711_buf));
-                                    if (g711_len > 0) {
-                                        pAudioStreamer->writeBinary(g711_buf, g711_len);
-                                    }
-                                } else {
-                                    pAudioStreamer->writeBinary((uint8_t *) out, bytes_written);
-                                }
-                                continue;
-                            }
-                            if (bytes_written <= available) {
-                                switch_buffer_write(tech_pvt->sbuffer, (const uint8_t *)out, bytes_written);
-                            }
-                        }
-
-                        if(switch_buffer_freespace(tech_pvt->sbuffer) == 0) {
-                            switch_size_t inuse = switch_buffer_inuse(tech_pvt->sbuffer);
-                            if (inuse > 0 && inuse <= sizeof(sbuffer_tmp)) {
-                                switch_buffer_read(tech_pvt->sbuffer, sbuffer_tmp, inuse);
-                                switch_buffer_zero(tech_pvt->sbuffer);
-                                
-                                if (use_g711 && tech_pvt->codec_initialized) {
-                                    /* Encode buffered L16 to G.711 before sending */
-                                    size_t g711_len = encode_g711(tech_pvt, sbuffer_tmp, inuse, sbuffer_g711, sizeof(sbuffer_g711));
-                                    if (g711_len > 0) {
-                                        pAudioStreamer->writeBinary(sbuffer_g711, g711_len);
-                                    }
-                                } else {
-                                    pAudioStreamer->writeBinary(sbuffer_tmp, inuse);
-                                }
-                            }
-                        }
+                if (write_codec) {
+                    switch_frame_t write_frame = { 0 };
+                    write_frame.data = pcmu_data;
+                    write_frame.datalen = 160;  /* PCMU: 160 bytes for 160 samples */
+                    write_frame.samples = 160;
+                    write_frame.rate = 8000;
+                    write_frame.codec = write_codec;
+                    
+                    switch_core_session_write_frame(session, &write_frame, SWITCH_IO_FLAG_NONE, 0);
+                    injected = true;
+                }
+            } else if (tech_pvt->playback_active) {
+                /* Less than a frame buffered - nothing is injected on this tick */
+                stream_metrics_add(SM_PLAYBACK_UNDERRUNS, 1);
+                __atomic_fetch_add(&tech_pvt->stats->playback_underruns, 1, __ATOMIC_RELAXED);
+                if (available == 0) {
+                    /* Buffer empty - pause playback */
+                    tech_pvt->playback_active = 0;
+                    if (drift) drift_reset(drift);
+                    if (wsola) __atomic_store_n(&wsola->active, 0, __ATOMIC_RELAXED);
+                    switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG,
+                        "⏸️ Buffer empty, pausing\n");
+                }
+            }
+
+            /* utterances that started or ended on this tick, cancelled ones once their audio has been tossed */
+            while (queue->count && nevents < STREAM_SEGMENT_EVENTS_PER_TICK) {
+                stream_segment_t *segment = &queue->segments[queue->head];
+                if (!segment->started && !segment->cancelled && segment->start < tech_pvt->playback_played) {
+                    segment->started = 1;
+                    if (segment->id[0]) {
+                        events[nevents] = *segment;
+                        stopped[nevents++] = false;
                     }
+                    continue;
+                }
+                if (segment->end > tech_pvt->playback_played) break;
+                if (segment->id[0]) {
+                    events[nevents] = *segment;
+                    stopped[nevents++] = true;
+                }
+                if (segment->cancelled) queue->cancelled--;
+                queue->head = (queue->head + 1) % STREAM_SEGMENTS_MAX;
+                queue->count--;
+            }
+
+            if (report) {
+                /* chunks whose last sample was played on this tick, or that stopAudio or an overrun ended */
+                while (report->chunks_count && nacked < STREAM_ACKS_PER_TICK &&
+                       report->chunks[report->chunks_head].end <= tech_pvt->playback_played) {
+                    acked[nacked++] = report->chunks[report->chunks_head];
+                    report->chunks_head = (report->chunks_head + 1) % STREAM_CHUNKS_MAX;
+                    report->chunks_count--;
                 }
+                if (injected) report->injected += 320;
+                buffered = switch_buffer_inuse(tech_pvt->playback_buffer) + feeds_bytes(queue);
+                playing = tech_pvt->playback_active;
             }
             
-            switch_mutex_unlock(tech_pvt->mutex);
+            switch_mutex_unlock(tech_pvt->playback_mutex);
         }
 
-        return SWITCH_TRUE;
+        /* one reference frame per tick, silence included, keeps it in step with the capture */
+        if (tech_pvt->scratch->reference) {
+            reference_push(tech_pvt->scratch->reference, injected ? l16_data : nullptr, 160);
+        }
+
+        if (ncompleted) {
+            const uint64_t now = stream_metrics_now_ns();
+            for (int i = 0; i < ncompleted; i++) {
+                report_round_trip(session, tech_pvt, completed[i], now);
+            }
+        }
+
+        for (int i = 0; i < nevents; i++) {
+            fire_segment_event(session, tech_pvt, events[i], stopped[i]);
+        }
+
+        if (report) {
+            const uint64_t now = report->status_interval_ns ? stream_metrics_now_ns() : 0;
+            const bool status_due = report->status_interval_ns && now >= report->next_status_ns;
+            AudioStreamer *pAudioStreamer = (nacked || status_due) ? acquire_streamer(tech_pvt) : nullptr;
+            if (pAudioStreamer) {
+                /* the chain, every origin included, lives as long as the pin */
+                for (int i = 0; i < nacked; i++) {
+                    send_playback_ack(acked[i]);
+                }
+                if (status_due) {
+                    send_playback_status(tech_pvt, pAudioStreamer, buffered, playing);
+                    report->next_status_ns = now + report->status_interval_ns;
+                }
+                release_streamer(tech_pvt);
+            }
+        }
     }
 
     switch_status_t stream_session_cleanup(switch_core_session_t *session, char* text, int channelIsClosing) {
@@ -928,19 +3233,15 @@ extern "C" {
         if(bug)
         {
             auto* tech_pvt = (private_t*) switch_core_media_bug_get_user_data(bug);
-            char sessionId[MAX_SESSION_ID];
-            /* Use strncpy with bounds check to prevent buffer overflow */
-            strncpy(sessionId, tech_pvt->sessionId, MAX_SESSION_ID - 1);
-            sessionId[MAX_SESSION_ID - 1] = '\0';
+            /* pool memory, valid for the whole session */
+            const char *sessionId = tech_pvt->sessionId;
             AudioStreamer* audioStreamer = nullptr;
 
-            switch_mutex_lock(tech_pvt->mutex);
-
-            if (tech_pvt->cleanup_started) {
-                switch_mutex_unlock(tech_pvt->mutex);
+            /* the first caller wins; media_bug_remove below re-enters from the CLOSE callback */
+            if (stream_state_set(tech_pvt, STREAM_STATE_CLEANUP) & STREAM_STATE_CLEANUP) {
                 return SWITCH_STATUS_SUCCESS;
             }
-            tech_pvt->cleanup_started = 1;
+            stream_metrics_add(SM_STREAMS_STOPPED, 1);
 
             switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "(%s) stream_session_cleanup\n", sessionId);
 
@@ -949,11 +3250,11 @@ extern "C" {
                 switch_core_media_bug_remove(session, &bug);
             }
 
-            //auto* audioStreamer = (AudioStreamer *) tech_pvt->pAudioStreamer;
-            audioStreamer = (AudioStreamer*) tech_pvt->pAudioStreamer;
-            tech_pvt->pAudioStreamer = nullptr;
-
-            switch_mutex_unlock(tech_pvt->mutex);
+            audioStreamer = (AudioStreamer*) __atomic_exchange_n(&tech_pvt->pAudioStreamer, nullptr, __ATOMIC_ACQ_REL);
+            /* no new refs once CLEANUP is set; wait out a send_text still holding one */
+            while (__atomic_load_n(&tech_pvt->streamer_refs, __ATOMIC_ACQUIRE)) {
+                std::this_thread::yield();
+            }
 
             if(audioStreamer) {
                 audioStreamer->deleteFiles();
@@ -970,5 +3271,17 @@ extern "C" {
         switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "stream_session_cleanup: no bug - websocket connection already closed\n");
         return SWITCH_STATUS_FALSE;
     }
+
+    /* undoes a stream_session_init whose bug could not be attached; nothing but the caller has seen pUserData */
+    void stream_session_abort(switch_core_session_t *session, void *pUserData) {
+        auto *tech_pvt = (private_t *) pUserData;
+        if (!tech_pvt) return;
+        stream_metrics_add(SM_STREAMS_STOPPED, 1);
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "(%s) stream_session_abort\n", tech_pvt->sessionId);
+
+        stream_state_set(tech_pvt, STREAM_STATE_CLEANUP);
+        finish((AudioStreamer *) __atomic_exchange_n(&tech_pvt->pAudioStreamer, nullptr, __ATOMIC_ACQ_REL));
+        destroy_tech_pvt(tech_pvt);
+    }
 }
 
@@ -8,9 +8,15 @@ int validate_ws_uri(const char* url, char *wsUri);
 switch_status_t is_valid_utf8(const char *str);
 switch_status_t stream_session_send_text(switch_core_session_t *session, char* text);
 switch_status_t stream_session_pauseresume(switch_core_session_t *session, int pause);
+switch_status_t stream_session_stats(switch_core_session_t *session, switch_stream_handle_t *stream);
 switch_status_t stream_session_init(switch_core_session_t *session, responseHandler_t responseHandler,
-    uint32_t samples_per_second, char *wsUri, int sampling, int channels, int audio_format, char* metadata, void **ppUserData);
+    uint32_t samples_per_second, char *wsUri, int sampling, int channels, int reference, int audio_format, char* metadata,
+    void **ppUserData);
+switch_status_t stream_session_add_destination(switch_core_session_t *session, char *wsUri, int sampling, int channels,
+    int reference, int audio_format, char *metadata);
 switch_bool_t stream_frame(switch_media_bug_t *bug);
+void stream_playback_frame(switch_media_bug_t *bug);
 switch_status_t stream_session_cleanup(switch_core_session_t *session, char* text, int channelIsClosing);
+void stream_session_abort(switch_core_session_t *session, void *pUserData);
 
 #endif //AUDIO_STREAMER_GLUE_H
@@ -29,6 +29,9 @@
 
    René Nyffenegger rene.nyffenegger@adp-gmbh.ch
 
+   Altered for mod_audio_stream: added base64_decode() into a caller-provided
+   buffer, so streamed audio chunks can be decoded without allocating.
+
 */
 
 #include "base64.h"
@@ -244,6 +247,75 @@ std::string base64_decode(std::string const& s, bool remove_linebreaks) {
    return decode(s, remove_linebreaks);
 }
 
+//
+// pos_of_char() as a table, -1 for characters that are not base 64
+//
+static const signed char base64_values[256] = {
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,62,-1,62,-1,63,
+    52,53,54,55,56,57,58,59,60,61,-1,-1,-1,-1,-1,-1,
+    -1, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9,10,11,12,13,14,
+    15,16,17,18,19,20,21,22,23,24,25,-1,-1,-1,-1,63,
+    -1,26,27,28,29,30,31,32,33,34,35,36,37,38,39,40,
+    41,42,43,44,45,46,47,48,49,50,51,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+};
+
+size_t base64_decode(char const* s, size_t len, unsigned char* out) {
+ //
+ // Same rules as decode(): padding optional, '=' or '.' ends a chunk.
+ //
+    unsigned char* const start = out;
+    const unsigned char* in = reinterpret_cast<const unsigned char*>(s);
+    size_t pos = 0;
+
+ //
+ // Whole unpadded chunks: four lookups, three bytes. Padding, the last
+ // chunk and invalid input go through the checked loop below.
+ //
+    while (pos + 4 < len) {
+       const int a = base64_values[in[pos+0]];
+       const int b = base64_values[in[pos+1]];
+       const int c = base64_values[in[pos+2]];
+       const int d = base64_values[in[pos+3]];
+       if ((a | b | c | d) < 0) break;
+       const unsigned int v = (a << 18) | (b << 12) | (c << 6) | d;
+       out[0] = static_cast<unsigned char>(v >> 16);
+       out[1] = static_cast<unsigned char>(v >> 8);
+       out[2] = static_cast<unsigned char>(v);
+       out += 3;
+       pos += 4;
+    }
+
+    while (pos < len) {
+       if (pos + 1 >= len) throw std::runtime_error("Input is not valid base64-encoded data.");
+
+       unsigned int pos_of_char_1 = pos_of_char(s[pos+1]);
+       *out++ = static_cast<unsigned char>((pos_of_char(s[pos+0]) << 2) + ((pos_of_char_1 & 0x30) >> 4));
+
+       if (pos + 2 < len && s[pos+2] != '=' && s[pos+2] != '.') {
+          unsigned int pos_of_char_2 = pos_of_char(s[pos+2]);
+          *out++ = static_cast<unsigned char>(((pos_of_char_1 & 0x0f) << 4) + ((pos_of_char_2 & 0x3c) >> 2));
+
+          if (pos + 3 < len && s[pos+3] != '=' && s[pos+3] != '.') {
+             *out++ = static_cast<unsigned char>(((pos_of_char_2 & 0x03) << 6) + pos_of_char(s[pos+3]));
+          }
+       }
+
+       pos += 4;
+    }
+
+    return out - start;
+}
+
 std::string base64_encode(std::string const& s, bool url) {
    return encode(s, url);
 }
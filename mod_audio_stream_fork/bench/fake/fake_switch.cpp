@@ -0,0 +1,485 @@
+#include "fake_switch.h"
+
+#include <pthread.h>
+#include <time.h>
+#include <math.h>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct switch_memory_pool {
+    std::vector<void *> blocks;
+};
+
+struct switch_mutex {
+    pthread_mutex_t m;
+};
+
+struct switch_buffer {
+    uint8_t *data;
+    uint8_t *head;
+    switch_size_t used;
+    switch_size_t actually_used;
+    switch_size_t datalen;
+};
+
+struct switch_channel {
+    std::mutex mutex;
+    std::string name;
+    std::map<std::string, std::string> variables;
+    std::map<std::string, const void *> privates;
+};
+
+struct switch_media_bug {
+    switch_core_session_t *session;
+    void *user_data;
+    switch_media_bug_flag_t flags;
+    int pending;
+    size_t position;
+};
+
+struct switch_core_session {
+    std::string uuid;
+    switch_memory_pool_t pool;
+    switch_channel_t channel;
+    switch_codec_implementation_t read_impl;
+    switch_codec_t read_codec;
+    switch_codec_implementation_t write_impl;
+    switch_codec_t write_codec;
+    switch_media_bug_t *bug;
+    std::vector<int16_t> source;    /* one second of a 440Hz tone at the read rate */
+    std::atomic<uint64_t> frames_written{0};
+    std::atomic<uint64_t> bytes_written{0};
+};
+
+namespace {
+
+    std::mutex registry_mutex;
+    std::map<std::string, switch_core_session_t *> &registry() {
+        static std::map<std::string, switch_core_session_t *> sessions;
+        return sessions;
+    }
+
+    bool log_enabled() {
+        static const bool enabled = getenv("FAKE_SWITCH_LOG") != nullptr;
+        return enabled;
+    }
+
+    /* ITU-T G.711, as in the reference g711.c */
+    uint8_t encode_ulaw(int16_t pcm) {
+        static const int16_t seg_end[8] = {0xFF, 0x1FF, 0x3FF, 0x7FF, 0xFFF, 0x1FFF, 0x3FFF, 0x7FFF};
+        int val = pcm >> 2;
+        int mask;
+        if (val < 0) {
+            val = -val;
+            mask = 0x7F;
+        } else {
+            mask = 0xFF;
+        }
+        if (val > 8159) val = 8159;
+        val += 0x84 >> 2;
+        int seg = 0;
+        while (seg < 8 && val > seg_end[seg]) seg++;
+        if (seg >= 8) return (uint8_t)(0x7F ^ mask);
+        return (uint8_t)(((seg << 4) | ((val >> (seg + 1)) & 0xF)) ^ mask);
+    }
+
+    uint8_t encode_alaw(int16_t pcm) {
+        static const int16_t seg_end[8] = {0x1F, 0x3F, 0x7F, 0xFF, 0x1FF, 0x3FF, 0x7FF, 0xFFF};
+        int val = pcm >> 3;
+        int mask;
+        if (val >= 0) {
+            mask = 0xD5;
+        } else {
+            mask = 0x55;
+            val = -val - 1;
+        }
+        int seg = 0;
+        while (seg < 8 && val > seg_end[seg]) seg++;
+        if (seg >= 8) return (uint8_t)(0x7F ^ mask);
+        uint8_t aval = (uint8_t)(seg << 4);
+        aval |= (seg < 2) ? (val >> 1) & 0xF : (val >> seg) & 0xF;
+        return aval ^ mask;
+    }
+
+    const switch_codec_implementation_t pcmu_impl = {8000, 160, 1, "PCMU"};
+    const switch_codec_implementation_t pcma_impl = {8000, 160, 1, "PCMA"};
+}
+
+extern "C" {
+
+void switch_log_printf(const char *file, const char *func, int line, const void *userdata,
+                       switch_log_level_t level, const char *fmt, ...) {
+    (void)userdata;
+    if (!log_enabled()) return;
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(stderr, "%s:%d %s [%d] ", file, line, func, (int)level);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+switch_time_t switch_micro_time_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (switch_time_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+switch_status_t switch_buffer_create(switch_memory_pool_t *pool, switch_buffer_t **buffer, switch_size_t max_len) {
+    auto *b = (switch_buffer_t *) switch_core_alloc(pool, sizeof(switch_buffer_t));
+    b->data = (uint8_t *) switch_core_alloc(pool, max_len);
+    b->head = b->data;
+    b->datalen = max_len;
+    *buffer = b;
+    return SWITCH_STATUS_SUCCESS;
+}
+
+switch_size_t switch_buffer_inuse(switch_buffer_t *buffer) {
+    return buffer->used;
+}
+
+switch_size_t switch_buffer_freespace(switch_buffer_t *buffer) {
+    return buffer->datalen - buffer->used;
+}
+
+/* same linear layout as switch_buffer.c: read advances head, write compacts when it runs off the end */
+switch_size_t switch_buffer_read(switch_buffer_t *buffer, void *data, switch_size_t datalen) {
+    switch_size_t reading = buffer->used < datalen ? buffer->used : datalen;
+    if (!reading) return 0;
+    memcpy(data, buffer->head, reading);
+    buffer->used -= reading;
+    buffer->head += reading;
+    return reading;
+}
+
+switch_size_t switch_buffer_peek(switch_buffer_t *buffer, void *data, switch_size_t datalen) {
+    switch_size_t reading = buffer->used < datalen ? buffer->used : datalen;
+    if (reading) memcpy(data, buffer->head, reading);
+    return reading;
+}
+
+/* like switch_buffer.c, returns what is left rather than what was dropped */
+switch_size_t switch_buffer_toss(switch_buffer_t *buffer, switch_size_t datalen) {
+    switch_size_t reading = buffer->used < datalen ? buffer->used : datalen;
+    buffer->used -= reading;
+    buffer->head += reading;
+    return buffer->used;
+}
+
+switch_size_t switch_buffer_write(switch_buffer_t *buffer, const void *data, switch_size_t datalen) {
+    if (!datalen) return buffer->used;
+    if (buffer->actually_used + datalen > buffer->datalen) {
+        memmove(buffer->data, buffer->head, buffer->used);
+        buffer->head = buffer->data;
+        buffer->actually_used = buffer->used;
+    }
+    if (buffer->datalen - buffer->used < datalen) return 0;
+    memcpy(buffer->head + buffer->used, data, datalen);
+    buffer->used += datalen;
+    buffer->actually_used += datalen;
+    return buffer->used;
+}
+
+void switch_buffer_zero(switch_buffer_t *buffer) {
+    buffer->used = 0;
+    buffer->actually_used = 0;
+    buffer->head = buffer->data;
+}
+
+switch_status_t switch_mutex_init(switch_mutex_t **lock, unsigned int flags, switch_memory_pool_t *pool) {
+    auto *mutex = (switch_mutex_t *) switch_core_alloc(pool, sizeof(switch_mutex_t));
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    if (flags & SWITCH_MUTEX_NESTED) pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&mutex->m, &attr);
+    pthread_mutexattr_destroy(&attr);
+    *lock = mutex;
+    return SWITCH_STATUS_SUCCESS;
+}
+
+switch_status_t switch_mutex_destroy(switch_mutex_t *lock) {
+    return pthread_mutex_destroy(&lock->m) == 0 ? SWITCH_STATUS_SUCCESS : SWITCH_STATUS_FALSE;
+}
+
+switch_status_t switch_mutex_lock(switch_mutex_t *lock) {
+    return pthread_mutex_lock(&lock->m) == 0 ? SWITCH_STATUS_SUCCESS : SWITCH_STATUS_FALSE;
+}
+
+switch_status_t switch_mutex_unlock(switch_mutex_t *lock) {
+    return pthread_mutex_unlock(&lock->m) == 0 ? SWITCH_STATUS_SUCCESS : SWITCH_STATUS_FALSE;
+}
+
+switch_status_t switch_mutex_trylock(switch_mutex_t *lock) {
+    return pthread_mutex_trylock(&lock->m) == 0 ? SWITCH_STATUS_SUCCESS : SWITCH_STATUS_FALSE;
+}
+
+/* pool memory is zeroed and released with the session, like APR pools */
+void *switch_core_alloc(switch_memory_pool_t *pool, switch_size_t memory) {
+    void *p = calloc(1, memory ? memory : 1);
+    pool->blocks.push_back(p);
+    return p;
+}
+
+void *switch_core_session_alloc(switch_core_session_t *session, switch_size_t memory) {
+    return switch_core_alloc(&session->pool, memory);
+}
+
+char *switch_core_strndup(switch_memory_pool_t *pool, const char *todup, size_t len) {
+    if (!todup) return nullptr;
+    len = strnlen(todup, len);
+    auto *p = (char *) switch_core_alloc(pool, len + 1);
+    memcpy(p, todup, len);
+    return p;
+}
+
+char *switch_core_strdup(switch_memory_pool_t *pool, const char *todup) {
+    return todup ? switch_core_strndup(pool, todup, strlen(todup)) : nullptr;
+}
+
+char *switch_core_session_strdup(switch_core_session_t *session, const char *todup) {
+    return switch_core_strdup(&session->pool, todup);
+}
+
+switch_memory_pool_t *switch_core_session_get_pool(switch_core_session_t *session) {
+    return &session->pool;
+}
+
+const char *switch_core_session_get_uuid(switch_core_session_t *session) {
+    return session->uuid.c_str();
+}
+
+switch_core_session_t *switch_core_session_locate(const char *uuid) {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    auto it = registry().find(uuid);
+    return it == registry().end() ? nullptr : it->second;
+}
+
+void switch_core_session_rwunlock(switch_core_session_t *session) {
+    (void)session;
+}
+
+switch_channel_t *switch_core_session_get_channel(switch_core_session_t *session) {
+    return &session->channel;
+}
+
+switch_codec_t *switch_core_session_get_read_codec(switch_core_session_t *session) {
+    return &session->read_codec;
+}
+
+switch_codec_t *switch_core_session_get_write_codec(switch_core_session_t *session) {
+    return &session->write_codec;
+}
+
+switch_status_t switch_core_session_write_frame(switch_core_session_t *session, switch_frame_t *frame, int flags, int stream_id) {
+    (void)flags;
+    (void)stream_id;
+    session->frames_written.fetch_add(1, std::memory_order_relaxed);
+    session->bytes_written.fetch_add(frame->datalen, std::memory_order_relaxed);
+    return SWITCH_STATUS_SUCCESS;
+}
+
+void *switch_channel_get_private(switch_channel_t *channel, const char *key) {
+    std::lock_guard<std::mutex> lock(channel->mutex);
+    auto it = channel->privates.find(key);
+    return it == channel->privates.end() ? nullptr : (void *) it->second;
+}
+
+switch_status_t switch_channel_set_private(switch_channel_t *channel, const char *key, const void *private_info) {
+    std::lock_guard<std::mutex> lock(channel->mutex);
+    channel->privates[key] = private_info;
+    return SWITCH_STATUS_SUCCESS;
+}
+
+const char *switch_channel_get_variable(switch_channel_t *channel, const char *varname) {
+    std::lock_guard<std::mutex> lock(channel->mutex);
+    auto it = channel->variables.find(varname);
+    return it == channel->variables.end() ? nullptr : it->second.c_str();
+}
+
+int switch_channel_var_true(switch_channel_t *channel, const char *variable) {
+    const char *value = switch_channel_get_variable(channel, variable);
+    return value && (!strcasecmp(value, "true") || !strcasecmp(value, "yes") || !strcasecmp(value, "on") || atoi(value) > 0);
+}
+
+const char *switch_channel_get_name(switch_channel_t *channel) {
+    return channel->name.c_str();
+}
+
+/* one 20ms frame per queued tick; stereo interleaves the same tone on both legs */
+switch_status_t switch_core_media_bug_read(switch_media_bug_t *bug, switch_frame_t *frame, switch_bool_t fill) {
+    (void)fill;
+    if (bug->pending <= 0) return SWITCH_STATUS_FALSE;
+    bug->pending--;
+
+    switch_core_session_t *session = bug->session;
+    const uint32_t samples = session->read_impl.samples_per_packet;
+    const uint32_t channels = (bug->flags & SMBF_STEREO) ? 2 : 1;
+    if (samples * channels * sizeof(int16_t) > frame->buflen) return SWITCH_STATUS_FALSE;
+
+    auto *out = (int16_t *) frame->data;
+    for (uint32_t i = 0; i < samples; i++) {
+        const int16_t s = session->source[bug->position];
+        bug->position = (bug->position + 1) % session->source.size();
+        for (uint32_t c = 0; c < channels; c++) *out++ = s;
+    }
+    frame->samples = samples;
+    frame->channels = channels;
+    frame->rate = session->read_impl.actual_samples_per_second;
+    frame->datalen = samples * channels * sizeof(int16_t);
+    return SWITCH_STATUS_SUCCESS;
+}
+
+void *switch_core_media_bug_get_user_data(switch_media_bug_t *bug) {
+    return bug->user_data;
+}
+
+switch_core_session_t *switch_core_media_bug_get_session(switch_media_bug_t *bug) {
+    return bug->session;
+}
+
+switch_status_t switch_core_media_bug_flush(switch_media_bug_t *bug) {
+    bug->pending = 0;
+    return SWITCH_STATUS_SUCCESS;
+}
+
+switch_status_t switch_core_media_bug_close(switch_media_bug_t **bug, switch_bool_t destroy) {
+    (void)bug;
+    (void)destroy;
+    return SWITCH_STATUS_SUCCESS;
+}
+
+switch_status_t switch_core_media_bug_remove(switch_core_session_t *session, switch_media_bug_t **bug) {
+    (void)session;
+    *bug = nullptr;
+    return SWITCH_STATUS_SUCCESS;
+}
+
+switch_status_t switch_core_codec_init(switch_codec_t *codec, const char *codec_name, const char *modname,
+                                       const char *fmtp, uint32_t rate, int ms, int channels, uint32_t flags,
+                                       const void *codec_settings, switch_memory_pool_t *pool) {
+    (void)modname; (void)fmtp; (void)ms; (void)channels; (void)flags; (void)codec_settings; (void)pool;
+    if (rate != 8000) return SWITCH_STATUS_FALSE;
+    if (!strcasecmp(codec_name, "PCMU")) {
+        codec->implementation = &pcmu_impl;
+    } else if (!strcasecmp(codec_name, "PCMA")) {
+        codec->implementation = &pcma_impl;
+    } else {
+        return SWITCH_STATUS_FALSE;
+    }
+    return SWITCH_STATUS_SUCCESS;
+}
+
+switch_status_t switch_core_codec_encode(switch_codec_t *codec, switch_codec_t *other_codec, void *decoded_data,
+                                         uint32_t decoded_data_len, uint32_t decoded_rate, void *encoded_data,
+                                         uint32_t *encoded_data_len, uint32_t *encoded_rate, unsigned int *flag) {
+    (void)other_codec; (void)decoded_rate; (void)flag;
+    if (!codec->implementation) return SWITCH_STATUS_FALSE;
+    const uint32_t samples = decoded_data_len / sizeof(int16_t);
+    if (*encoded_data_len < samples) return SWITCH_STATUS_FALSE;
+    const auto *in = (const int16_t *) decoded_data;
+    auto *out = (uint8_t *) encoded_data;
+    const bool ulaw = codec->implementation == &pcmu_impl;
+    for (uint32_t i = 0; i < samples; i++) {
+        out[i] = ulaw ? encode_ulaw(in[i]) : encode_alaw(in[i]);
+    }
+    *encoded_data_len = samples;
+    *encoded_rate = 8000;
+    return SWITCH_STATUS_SUCCESS;
+}
+
+switch_status_t switch_core_codec_destroy(switch_codec_t *codec) {
+    codec->implementation = nullptr;
+    return SWITCH_STATUS_SUCCESS;
+}
+
+switch_status_t switch_console_stream_write(switch_stream_handle_t *handle, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    char *text = nullptr;
+    const int len = vasprintf(&text, fmt, ap);
+    va_end(ap);
+    if (len < 0) return SWITCH_STATUS_MEMERR;
+
+    if (handle->data_len + len + 1 > handle->data_size) {
+        const switch_size_t new_size = (handle->data_len + len + 1) * 2;
+        void *data = realloc(handle->data, new_size);
+        if (!data) {
+            free(text);
+            return SWITCH_STATUS_MEMERR;
+        }
+        handle->data = data;
+        handle->data_size = new_size;
+    }
+    memcpy((char *) handle->data + handle->data_len, text, len + 1);
+    handle->data_len += len;
+    free(text);
+    return SWITCH_STATUS_SUCCESS;
+}
+
+const char *cJSON_GetObjectCstr(const cJSON *object, const char *string) {
+    cJSON *item = cJSON_GetObjectItem(object, string);
+    return (item && item->type == cJSON_String) ? item->valuestring : nullptr;
+}
+
+}
+
+switch_core_session_t *fake_session_create(const char *uuid, uint32_t read_rate) {
+    auto *session = new switch_core_session_t();
+    session->uuid = uuid;
+    session->channel.name = std::string("bench/") + uuid;
+    session->read_impl = {read_rate, read_rate / 50, 1, "L16"};
+    session->read_codec.implementation = &session->read_impl;
+    session->write_impl = pcmu_impl;
+    session->write_codec.implementation = &session->write_impl;
+    session->source.resize(read_rate);
+    fake_session_set_amplitude(session, 8000.0);
+
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    registry()[session->uuid] = session;
+    return session;
+}
+
+void fake_session_set_amplitude(switch_core_session_t *session, double amplitude) {
+    const size_t read_rate = session->source.size();
+    for (size_t i = 0; i < read_rate; i++) {
+        session->source[i] = (int16_t)(amplitude * sin(2.0 * M_PI * 440.0 * i / read_rate));
+    }
+}
+
+void fake_session_destroy(switch_core_session_t *session) {
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        registry().erase(session->uuid);
+    }
+    delete session->bug;
+    for (void *block : session->pool.blocks) free(block);
+    delete session;
+}
+
+void fake_channel_set_variable(switch_core_session_t *session, const char *name, const char *value) {
+    std::lock_guard<std::mutex> lock(session->channel.mutex);
+    session->channel.variables[name] = value;
+}
+
+switch_media_bug_t *fake_media_bug_attach(switch_core_session_t *session, void *user_data, switch_media_bug_flag_t flags) {
+    delete session->bug;
+    session->bug = new switch_media_bug_t();
+    session->bug->session = session;
+    session->bug->user_data = user_data;
+    session->bug->flags = flags;
+    return session->bug;
+}
+
+void fake_media_bug_queue(switch_media_bug_t *bug, int frames) {
+    bug->pending = frames;
+}
+
+uint64_t fake_session_frames_written(switch_core_session_t *session) {
+    return session->frames_written.load(std::memory_order_relaxed);
+}
+
+uint64_t fake_session_bytes_written(switch_core_session_t *session) {
+    return session->bytes_written.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,26 @@
+#ifndef FAKE_SWITCH_CONTROL_H_
+#define FAKE_SWITCH_CONTROL_H_
+
+#include "switch.h"
+
+/*
+ * Bench-side controls for the fake core: sessions with a read codec rate,
+ * channel variables, and a media bug that hands out a fixed number of
+ * 20ms frames per READ tick.
+ */
+
+switch_core_session_t *fake_session_create(const char *uuid, uint32_t read_rate);
+/* peak of the 440Hz source tone (8000 by default), 0 for digital silence */
+void fake_session_set_amplitude(switch_core_session_t *session, double amplitude);
+void fake_session_destroy(switch_core_session_t *session);
+void fake_channel_set_variable(switch_core_session_t *session, const char *name, const char *value);
+
+switch_media_bug_t *fake_media_bug_attach(switch_core_session_t *session, void *user_data, switch_media_bug_flag_t flags);
+/* frames the next switch_core_media_bug_read loop will return before running dry */
+void fake_media_bug_queue(switch_media_bug_t *bug, int frames);
+
+/* frames and bytes passed to switch_core_session_write_frame */
+uint64_t fake_session_frames_written(switch_core_session_t *session);
+uint64_t fake_session_bytes_written(switch_core_session_t *session);
+
+#endif
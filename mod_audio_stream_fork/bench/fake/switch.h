@@ -0,0 +1,189 @@
+/*
+ * Minimal stand-in for the FreeSWITCH core API, just enough to build
+ * audio_streamer_glue.cpp, base64.cpp and stream_metrics.cpp outside of
+ * FreeSWITCH. Types only carry the fields the module touches; behaviour
+ * lives in fake_switch.cpp and is driven from the bench through
+ * fake_switch.h.
+ */
+#ifndef FAKE_SWITCH_H_
+#define FAKE_SWITCH_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <assert.h>
+#include <limits.h>
+#include <unistd.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef size_t switch_size_t;
+typedef int64_t switch_time_t;
+
+typedef enum {
+    SWITCH_STATUS_SUCCESS = 0,
+    SWITCH_STATUS_FALSE = 1,
+    SWITCH_STATUS_MEMERR = 2,
+    SWITCH_STATUS_TERM = 10,
+    SWITCH_STATUS_NOTFOUND = 17
+} switch_status_t;
+
+typedef enum {
+    SWITCH_FALSE = 0,
+    SWITCH_TRUE = 1
+} switch_bool_t;
+
+typedef enum {
+    SWITCH_LOG_CRIT = 2,
+    SWITCH_LOG_ERROR = 3,
+    SWITCH_LOG_WARNING = 4,
+    SWITCH_LOG_NOTICE = 5,
+    SWITCH_LOG_INFO = 6,
+    SWITCH_LOG_DEBUG = 7
+} switch_log_level_t;
+
+typedef enum {
+    SWITCH_ABC_TYPE_INIT,
+    SWITCH_ABC_TYPE_READ,
+    SWITCH_ABC_TYPE_WRITE,
+    SWITCH_ABC_TYPE_WRITE_REPLACE,
+    SWITCH_ABC_TYPE_READ_REPLACE,
+    SWITCH_ABC_TYPE_READ_PING,
+    SWITCH_ABC_TYPE_CLOSE
+} switch_abc_type_t;
+
+typedef uint32_t switch_media_bug_flag_t;
+enum {
+    SMBF_READ_STREAM = (1 << 0),
+    SMBF_WRITE_STREAM = (1 << 1),
+    SMBF_WRITE_REPLACE = (1 << 2),
+    SMBF_READ_REPLACE = (1 << 3),
+    SMBF_READ_PING = (1 << 4),
+    SMBF_STEREO = (1 << 5)
+};
+
+enum { SWITCH_IO_FLAG_NONE = 0 };
+enum { SWITCH_CODEC_FLAG_ENCODE = (1 << 0), SWITCH_CODEC_FLAG_DECODE = (1 << 1) };
+
+#define SWITCH_RECOMMENDED_BUFFER_SIZE 8192
+#define SWITCH_RESAMPLE_QUALITY 2
+#define SWITCH_MUTEX_DEFAULT 0
+#define SWITCH_MUTEX_NESTED 1
+
+typedef struct switch_memory_pool switch_memory_pool_t;
+typedef struct switch_mutex switch_mutex_t;
+typedef struct switch_buffer switch_buffer_t;
+typedef struct switch_core_session switch_core_session_t;
+typedef struct switch_channel switch_channel_t;
+typedef struct switch_media_bug switch_media_bug_t;
+
+typedef struct switch_codec_implementation {
+    uint32_t actual_samples_per_second;
+    uint32_t samples_per_packet;
+    int number_of_channels;
+    const char *iananame;
+} switch_codec_implementation_t;
+
+typedef struct switch_codec {
+    const switch_codec_implementation_t *implementation;
+    void *private_info;
+} switch_codec_t;
+
+typedef struct switch_frame {
+    switch_codec_t *codec;
+    void *data;
+    uint32_t datalen;
+    uint32_t buflen;
+    uint32_t samples;
+    uint32_t rate;
+    uint32_t channels;
+} switch_frame_t;
+
+typedef struct switch_stream_handle switch_stream_handle_t;
+typedef switch_status_t (*switch_stream_handle_write_function_t)(switch_stream_handle_t *handle, const char *fmt, ...);
+struct switch_stream_handle {
+    void *data;
+    switch_stream_handle_write_function_t write_function;
+    switch_size_t data_len;
+    switch_size_t data_size;
+};
+
+typedef switch_bool_t (*switch_media_bug_callback_t)(switch_media_bug_t *, void *, switch_abc_type_t);
+
+/* logging: discarded unless FAKE_SWITCH_LOG is set in the environment */
+#define SWITCH_CHANNEL_LOG __FILE__, __func__, __LINE__, NULL
+#define SWITCH_CHANNEL_SESSION_LOG(x) __FILE__, __func__, __LINE__, (const void *)(x)
+void switch_log_printf(const char *file, const char *func, int line, const void *userdata,
+                       switch_log_level_t level, const char *fmt, ...);
+
+#define zstr(x) (!(x) || *(x) == '\0')
+#define switch_safe_free(it) if (it) {free(it);it=NULL;}
+
+switch_time_t switch_micro_time_now(void);
+
+switch_status_t switch_buffer_create(switch_memory_pool_t *pool, switch_buffer_t **buffer, switch_size_t max_len);
+switch_size_t switch_buffer_inuse(switch_buffer_t *buffer);
+switch_size_t switch_buffer_freespace(switch_buffer_t *buffer);
+switch_size_t switch_buffer_read(switch_buffer_t *buffer, void *data, switch_size_t datalen);
+switch_size_t switch_buffer_peek(switch_buffer_t *buffer, void *data, switch_size_t datalen);
+switch_size_t switch_buffer_toss(switch_buffer_t *buffer, switch_size_t datalen);
+switch_size_t switch_buffer_write(switch_buffer_t *buffer, const void *data, switch_size_t datalen);
+void switch_buffer_zero(switch_buffer_t *buffer);
+
+switch_status_t switch_mutex_init(switch_mutex_t **lock, unsigned int flags, switch_memory_pool_t *pool);
+switch_status_t switch_mutex_destroy(switch_mutex_t *lock);
+switch_status_t switch_mutex_lock(switch_mutex_t *lock);
+switch_status_t switch_mutex_unlock(switch_mutex_t *lock);
+switch_status_t switch_mutex_trylock(switch_mutex_t *lock);
+
+void *switch_core_alloc(switch_memory_pool_t *pool, switch_size_t memory);
+void *switch_core_session_alloc(switch_core_session_t *session, switch_size_t memory);
+char *switch_core_strdup(switch_memory_pool_t *pool, const char *todup);
+char *switch_core_strndup(switch_memory_pool_t *pool, const char *todup, size_t len);
+char *switch_core_session_strdup(switch_core_session_t *session, const char *todup);
+switch_memory_pool_t *switch_core_session_get_pool(switch_core_session_t *session);
+const char *switch_core_session_get_uuid(switch_core_session_t *session);
+switch_core_session_t *switch_core_session_locate(const char *uuid);
+void switch_core_session_rwunlock(switch_core_session_t *session);
+switch_channel_t *switch_core_session_get_channel(switch_core_session_t *session);
+switch_codec_t *switch_core_session_get_read_codec(switch_core_session_t *session);
+switch_codec_t *switch_core_session_get_write_codec(switch_core_session_t *session);
+switch_status_t switch_core_session_write_frame(switch_core_session_t *session, switch_frame_t *frame, int flags, int stream_id);
+
+void *switch_channel_get_private(switch_channel_t *channel, const char *key);
+switch_status_t switch_channel_set_private(switch_channel_t *channel, const char *key, const void *private_info);
+const char *switch_channel_get_variable(switch_channel_t *channel, const char *varname);
+int switch_channel_var_true(switch_channel_t *channel, const char *variable);
+const char *switch_channel_get_name(switch_channel_t *channel);
+
+switch_status_t switch_core_media_bug_read(switch_media_bug_t *bug, switch_frame_t *frame, switch_bool_t fill);
+void *switch_core_media_bug_get_user_data(switch_media_bug_t *bug);
+switch_core_session_t *switch_core_media_bug_get_session(switch_media_bug_t *bug);
+switch_status_t switch_core_media_bug_flush(switch_media_bug_t *bug);
+switch_status_t switch_core_media_bug_close(switch_media_bug_t **bug, switch_bool_t destroy);
+switch_status_t switch_core_media_bug_remove(switch_core_session_t *session, switch_media_bug_t **bug);
+
+/* PCMU and PCMA at 8kHz, which is all the module asks for */
+switch_status_t switch_core_codec_init(switch_codec_t *codec, const char *codec_name, const char *modname,
+                                       const char *fmtp, uint32_t rate, int ms, int channels, uint32_t flags,
+                                       const void *codec_settings, switch_memory_pool_t *pool);
+switch_status_t switch_core_codec_encode(switch_codec_t *codec, switch_codec_t *other_codec, void *decoded_data,
+                                         uint32_t decoded_data_len, uint32_t decoded_rate, void *encoded_data,
+                                         uint32_t *encoded_data_len, uint32_t *encoded_rate, unsigned int *flag);
+switch_status_t switch_core_codec_destroy(switch_codec_t *codec);
+
+switch_status_t switch_console_stream_write(switch_stream_handle_t *handle, const char *fmt, ...);
+#define SWITCH_STANDARD_STREAM(s) memset(&s, 0, sizeof(s)); s.data = calloc(1, 1024); s.data_size = 1024; \
+    s.write_function = switch_console_stream_write
+
+#ifdef __cplusplus
+}
+#endif
+
+#include "switch_json.h"
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef FAKE_SWITCH_BUFFER_H_
+#define FAKE_SWITCH_BUFFER_H_
+
+#include "switch.h"
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef FAKE_SWITCH_JSON_H_
+#define FAKE_SWITCH_JSON_H_
+
+/* FreeSWITCH bundles cJSON; the bench links the system libcjson instead */
+#include <cjson/cJSON.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+const char *cJSON_GetObjectCstr(const cJSON *object, const char *string);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
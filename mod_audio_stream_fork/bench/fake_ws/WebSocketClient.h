@@ -0,0 +1,122 @@
+#ifndef FAKE_WEBSOCKET_CLIENT_H_
+#define FAKE_WEBSOCKET_CLIENT_H_
+
+/*
+ * In-process stand-in for libwsc's WebSocketClient. Nothing goes on the wire:
+ * sends are only counted, and the bench injects server messages with
+ * WebSocketClient::find(url)->deliver(...), which runs the module's message
+ * callback synchronously on the calling thread.
+ */
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+
+class WebSocketHeaders {
+public:
+    void set(const std::string& key, const std::string& value) { m_headers[key] = value; }
+    bool empty() const { return m_headers.empty(); }
+
+private:
+    std::map<std::string, std::string> m_headers;
+};
+
+struct WebSocketTLSOptions {
+    std::string caFile;
+    std::string keyFile;
+    std::string certFile;
+    bool disableHostnameValidation = false;
+};
+
+class WebSocketClient {
+public:
+    using MessageCallback = std::function<void(const std::string&)>;
+    using OpenCallback = std::function<void()>;
+    using ErrorCallback = std::function<void(int, const std::string&)>;
+    using CloseCallback = std::function<void(int, const std::string&)>;
+
+    WebSocketClient() = default;
+    WebSocketClient(const WebSocketClient&) = delete;
+    WebSocketClient& operator=(const WebSocketClient&) = delete;
+
+    ~WebSocketClient() {
+        std::lock_guard<std::mutex> lock(registry_mutex());
+        auto it = registry().find(m_url);
+        if (it != registry().end() && it->second == this) registry().erase(it);
+    }
+
+    void setUrl(const std::string& url) { m_url = url; }
+    void setTLSOptions(const WebSocketTLSOptions&) {}
+    void setPingInterval(int) {}
+    void enableCompression(bool) {}
+    void setHeaders(const WebSocketHeaders&) {}
+
+    void setMessageCallback(MessageCallback cb) { m_onMessage = std::move(cb); }
+    void setOpenCallback(OpenCallback cb) { m_onOpen = std::move(cb); }
+    void setErrorCallback(ErrorCallback cb) { m_onError = std::move(cb); }
+    void setCloseCallback(CloseCallback cb) { m_onClose = std::move(cb); }
+
+    void connect() {
+        {
+            std::lock_guard<std::mutex> lock(registry_mutex());
+            registry()[m_url] = this;
+        }
+        m_connected = true;
+        if (m_onOpen) m_onOpen();
+    }
+
+    void disconnect() { m_connected = false; }
+    bool isConnected() const { return m_connected; }
+
+    bool sendMessage(const char*, size_t len) {
+        m_textSent++;
+        m_bytesSent += len;
+        return true;
+    }
+
+    bool sendBinary(const void*, size_t len) {
+        m_binarySent++;
+        m_bytesSent += len;
+        return true;
+    }
+
+    /* bench side */
+    static WebSocketClient* find(const std::string& url) {
+        std::lock_guard<std::mutex> lock(registry_mutex());
+        auto it = registry().find(url);
+        return it == registry().end() ? nullptr : it->second;
+    }
+
+    void deliver(const std::string& message) {
+        if (m_onMessage) m_onMessage(message);
+    }
+
+    uint64_t textSent() const { return m_textSent; }
+    uint64_t binarySent() const { return m_binarySent; }
+    uint64_t bytesSent() const { return m_bytesSent; }
+
+private:
+    static std::mutex& registry_mutex() {
+        static std::mutex m;
+        return m;
+    }
+
+    static std::map<std::string, WebSocketClient*>& registry() {
+        static std::map<std::string, WebSocketClient*> clients;
+        return clients;
+    }
+
+    std::string m_url;
+    bool m_connected = false;
+    MessageCallback m_onMessage;
+    OpenCallback m_onOpen;
+    ErrorCallback m_onError;
+    CloseCallback m_onClose;
+    uint64_t m_textSent = 0;
+    uint64_t m_binarySent = 0;
+    uint64_t m_bytesSent = 0;
+};
+
+#endif
@@ -0,0 +1,281 @@
+#!/usr/bin/env python3
+"""
+Local WebSocket stand-in for the AI backend, used by stream_load.
+
+Speaks just enough RFC 6455 (no extensions) to accept mod_audio_stream
+connections. Caller audio is dropped (or kept for --mode echo); every
+connection then plays "turns" the way a TTS backend would: it echoes the
+last mark it received, waits --think-ms, and streams --turn-ms of 8kHz L16 as
+streamAudio chunks, front-loading --prebuffer-ms and pacing the rest in
+real time (plus optional --jitter-ms).
+
+    stand_in_server.py [--port 8765] [--workers 2] [--mode tts|echo]
+
+--mode echo sends the caller's own audio back instead of a tone (only
+meaningful for 8kHz mono L16 streams). --workers forks processes sharing
+the port with SO_REUSEPORT so the server is not the bottleneck at high
+session counts.
+
+Standard library only, so it runs on the box being sized without a venv.
+"""
+
+import argparse
+import asyncio
+import base64
+import hashlib
+import json
+import math
+import os
+import random
+import signal
+import struct
+import sys
+import time
+
+GUID = b"258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+OP_CONT, OP_TEXT, OP_BINARY, OP_CLOSE, OP_PING, OP_PONG = 0x0, 0x1, 0x2, 0x8, 0x9, 0xA
+
+BYTES_PER_MS = 16  # 8kHz L16 mono, the playback format
+
+
+class Connection:
+    def __init__(self, reader, writer, args):
+        self.reader = reader
+        self.writer = writer
+        self.args = args
+        self.closed = False
+        self.last_mark = None
+        self.last_mark_ts = 0.0
+        self.echo = bytearray()
+
+    # -- framing -----------------------------------------------------------
+
+    async def handshake(self):
+        request = await self.reader.readuntil(b"\r\n\r\n")
+        key = None
+        for line in request.decode("latin-1").split("\r\n")[1:]:
+            name, _, value = line.partition(":")
+            if name.strip().lower() == "sec-websocket-key":
+                key = value.strip()
+        if not key:
+            self.writer.write(b"HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n")
+            await self.writer.drain()
+            return False
+        accept = base64.b64encode(hashlib.sha1(key.encode() + GUID).digest()).decode()
+        self.writer.write(
+            "HTTP/1.1 101 Switching Protocols\r\n"
+            "Upgrade: websocket\r\n"
+            "Connection: Upgrade\r\n"
+            f"Sec-WebSocket-Accept: {accept}\r\n\r\n".encode()
+        )
+        await self.writer.drain()
+        return True
+
+    async def read_frame(self):
+        head = await self.reader.readexactly(2)
+        fin = head[0] & 0x80
+        opcode = head[0] & 0x0F
+        masked = head[1] & 0x80
+        length = head[1] & 0x7F
+        if length == 126:
+            length = struct.unpack("!H", await self.reader.readexactly(2))[0]
+        elif length == 127:
+            length = struct.unpack("!Q", await self.reader.readexactly(8))[0]
+        mask = await self.reader.readexactly(4) if masked else None
+        payload = await self.reader.readexactly(length)
+        if mask:
+            # XOR through a big int: much faster than a per-byte loop for audio frames
+            key = (mask * (length // 4 + 1))[:length]
+            payload = (int.from_bytes(payload, "big") ^ int.from_bytes(key, "big")).to_bytes(length, "big")
+        return fin, opcode, payload
+
+    async def read_message(self):
+        fin, opcode, payload = await self.read_frame()
+        while not fin:
+            fin, _, more = await self.read_frame()
+            payload += more
+        return opcode, payload
+
+    def send_frame(self, opcode, payload):
+        if self.closed:
+            return
+        length = len(payload)
+        if length < 126:
+            header = struct.pack("!BB", 0x80 | opcode, length)
+        elif length < 65536:
+            header = struct.pack("!BBH", 0x80 | opcode, 126, length)
+        else:
+            header = struct.pack("!BBQ", 0x80 | opcode, 127, length)
+        self.writer.write(header + payload)
+
+    def send_json(self, obj):
+        self.send_frame(OP_TEXT, json.dumps(obj, separators=(",", ":")).encode())
+
+    # -- behaviour ---------------------------------------------------------
+
+    async def receive_loop(self):
+        while True:
+            opcode, payload = await self.read_message()
+            if opcode == OP_BINARY:
+                if self.args.mode == "echo":
+                    self.echo += payload
+                    # keep at most one turn worth of caller audio
+                    limit = self.args.turn_ms * BYTES_PER_MS
+                    if len(self.echo) > limit:
+                        del self.echo[: len(self.echo) - limit]
+            elif opcode == OP_TEXT:
+                try:
+                    message = json.loads(payload)
+                except ValueError:
+                    continue
+                if isinstance(message, dict) and message.get("type") == "mark":
+                    self.last_mark = message
+                    self.last_mark_ts = time.time() * 1000.0
+            elif opcode == OP_PING:
+                self.send_frame(OP_PONG, payload)
+            elif opcode == OP_CLOSE:
+                self.send_frame(OP_CLOSE, payload[:2])
+                return
+
+    def turn_audio(self, tone):
+        size = self.args.turn_ms * BYTES_PER_MS
+        if self.args.mode == "echo" and self.echo:
+            audio = bytes(self.echo)
+            self.echo.clear()
+            return audio
+        return tone[:size]
+
+    async def speak_loop(self, tone):
+        args = self.args
+        chunk_bytes = args.chunk_ms * BYTES_PER_MS
+        # spread the first turn so sessions do not all talk in lockstep
+        await asyncio.sleep(random.uniform(0, args.gap_ms) / 1000.0)
+        while not self.closed:
+            mark, self.last_mark = self.last_mark, None
+            recv_ts = self.last_mark_ts
+            await asyncio.sleep(args.think_ms / 1000.0)
+
+            audio = self.turn_audio(tone)
+            if mark is not None:
+                data = {k: mark[k] for k in ("seq", "ts") if k in mark}
+                data["recvTs"] = recv_ts
+                data["sendTs"] = time.time() * 1000.0
+                self.send_json({"type": "mark", "data": data})
+
+            start = time.monotonic()
+            sent_ms = 0
+            for offset in range(0, len(audio), chunk_bytes):
+                chunk = audio[offset : offset + chunk_bytes]
+                # front-load the prebuffer, then stay ahead of playout by that much
+                due = start + max(0, sent_ms - args.prebuffer_ms) / 1000.0
+                if args.jitter_ms:
+                    due += random.uniform(0, args.jitter_ms) / 1000.0
+                delay = due - time.monotonic()
+                if delay > 0:
+                    await asyncio.sleep(delay)
+                self.send_json({
+                    "type": "streamAudio",
+                    "data": {
+                        "audioDataType": "raw",
+                        "sampleRate": 8000,
+                        "audioData": base64.b64encode(chunk).decode(),
+                    },
+                })
+                await self.writer.drain()
+                sent_ms += len(chunk) // BYTES_PER_MS
+                if self.closed:
+                    return
+
+            await asyncio.sleep(args.gap_ms / 1000.0)
+
+
+async def handle(reader, writer, args, tone, stats):
+    conn = Connection(reader, writer, args)
+    speaker = None
+    try:
+        if not await conn.handshake():
+            return
+        stats["open"] += 1
+        stats["total"] += 1
+        speaker = asyncio.ensure_future(conn.speak_loop(tone))
+        await conn.receive_loop()
+    except (asyncio.IncompleteReadError, ConnectionError, asyncio.LimitOverrunError):
+        pass
+    finally:
+        conn.closed = True
+        if speaker:
+            speaker.cancel()
+            stats["open"] -= 1
+        writer.close()
+
+
+def make_tone(turn_ms):
+    samples = turn_ms * 8
+    return b"".join(
+        struct.pack("<h", int(6000 * math.sin(2 * math.pi * 300 * i / 8000)))
+        for i in range(samples)
+    )
+
+
+async def serve(args, worker):
+    tone = make_tone(args.turn_ms)
+    stats = {"open": 0, "total": 0}
+    server = await asyncio.start_server(
+        lambda r, w: handle(r, w, args, tone, stats),
+        args.host,
+        args.port,
+        reuse_port=args.workers > 1,
+        backlog=4096,
+    )
+    print(f"worker {worker}: listening on ws://{args.host}:{args.port}/ ({args.mode})", flush=True)
+    async with server:
+        while True:
+            await asyncio.sleep(args.report_s)
+            if stats["total"]:
+                print(f"worker {worker}: open={stats['open']} total={stats['total']}", flush=True)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="mod_audio_stream WebSocket stand-in for load tests")
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=8765)
+    parser.add_argument("--workers", type=int, default=1, help="processes sharing the port")
+    parser.add_argument("--mode", choices=("tts", "echo"), default="tts")
+    parser.add_argument("--turn-ms", type=int, default=3000, help="audio per turn")
+    parser.add_argument("--gap-ms", type=int, default=3000, help="silence between turns")
+    parser.add_argument("--think-ms", type=int, default=300, help="simulated processing before each turn")
+    parser.add_argument("--chunk-ms", type=int, default=100, help="audio per streamAudio message")
+    parser.add_argument("--prebuffer-ms", type=int, default=200, help="audio sent ahead of real time")
+    parser.add_argument("--jitter-ms", type=int, default=0, help="random extra delay per chunk")
+    parser.add_argument("--report-s", type=int, default=10)
+    args = parser.parse_args()
+
+    if args.chunk_ms <= 0 or args.turn_ms <= 0:
+        parser.error("--chunk-ms and --turn-ms must be positive")
+
+    children = []
+    for worker in range(1, args.workers):
+        pid = os.fork()
+        if pid == 0:
+            children = []
+            break
+        children.append(pid)
+    else:
+        worker = 0
+
+    def stop(*_):
+        for pid in children:
+            try:
+                os.kill(pid, signal.SIGTERM)
+            except ProcessLookupError:
+                pass
+        sys.exit(0)
+
+    signal.signal(signal.SIGTERM, stop)
+    signal.signal(signal.SIGINT, stop)
+    asyncio.run(serve(args, worker))
+
+
+if __name__ == "__main__":
+    main()
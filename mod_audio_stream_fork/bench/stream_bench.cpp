@@ -0,0 +1,556 @@
+/*
+ * Microbenchmarks for the per-call hot paths of mod_audio_stream, run against
+ * the fake core in fake/ so no FreeSWITCH instance is needed.
+ *
+ *   stream_bench [--iterations N] [--check] [filter...]
+ *
+ * Every case runs a few rounds of N operations and reports the best and the
+ * median round. For the READ-tick cases one operation is one 20ms tick, so
+ * "tick%" is the share of a single core one call costs.
+ *
+ * A few behavior checks run before the timings (only them with --check); the
+ * bench exits nonzero when one fails.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <time.h>
+
+/* the glue exports C linkage but its header has no extern "C" guard */
+extern "C" {
+#include "audio_streamer_glue.h"
+}
+#include "base64.h"
+#include "json_arena.h"
+#include "json_scan.h"
+#include "fake_switch.h"
+#include "WebSocketClient.h"
+#ifdef HAVE_OPUS
+#include <opus/opus.h>
+#endif
+
+namespace {
+
+    const int ROUNDS = 7;
+    const double TICK_NS = 20e6;
+
+    uint64_t now_ns() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+
+    void bench_response_handler(switch_core_session_t *session, const char *eventName, const char *json) {
+        (void)session;
+        (void)eventName;
+        (void)json;
+    }
+
+    /* how a bench call is set up; the defaults are an 8k mono L16 call with 20ms frames */
+    struct call_options {
+        uint32_t read_rate = 8000;
+        int sampling = 8000;            /* the rate the server gets */
+        bool stereo = false;
+        int audio_format = AUDIO_FORMAT_L16;
+        int buffer_ms = 20;
+        int extra_destinations = 0;     /* fanned out to, as repeated starts do it */
+        double amplitude = 8000.0;      /* of the caller's tone */
+        bool vad = false;
+        bool aec = false;
+        bool reference = false;         /* the played audio as a second channel */
+        bool preprocess = false;        /* denoise and AGC */
+        bool drift = false;
+        bool catchup = false;
+    };
+
+    call_options rates(uint32_t read_rate, int sampling) {
+        call_options options;
+        options.read_rate = read_rate;
+        options.sampling = sampling;
+        return options;
+    }
+
+    /* one call wired up the way start_capture does it */
+    struct bench_call {
+        switch_core_session_t *session = nullptr;
+        switch_media_bug_t *bug = nullptr;
+        private_t *tech_pvt = nullptr;
+        WebSocketClient *client = nullptr;
+        std::string uri;
+
+        bool start(const char *name, const call_options &options) {
+            uri = std::string("ws://bench/") + name;
+            session = fake_session_create(name, options.read_rate);
+            fake_session_set_amplitude(session, options.amplitude);
+            fake_channel_set_variable(session, "STREAM_SUPPRESS_LOG", "true");
+            if (options.vad) {
+                fake_channel_set_variable(session, "STREAM_VAD", "true");
+            }
+            if (options.aec) {
+                fake_channel_set_variable(session, "STREAM_AEC", "true");
+            }
+            if (options.preprocess) {
+                fake_channel_set_variable(session, "STREAM_DENOISE", "true");
+                fake_channel_set_variable(session, "STREAM_AGC", "true");
+            }
+            if (options.drift) {
+                fake_channel_set_variable(session, "STREAM_PLAYBACK_DRIFT", "true");
+            }
+            if (options.catchup) {
+                fake_channel_set_variable(session, "STREAM_PLAYBACK_CATCHUP", "true");
+            }
+            if (options.buffer_ms > 20) {
+                fake_channel_set_variable(session, "STREAM_BUFFER_SIZE", std::to_string(options.buffer_ms).c_str());
+            }
+
+            const switch_media_bug_flag_t flags = SMBF_READ_STREAM | (options.stereo ? SMBF_STEREO : 0);
+            void *pUserData = nullptr;
+            std::vector<char> wsUri(uri.begin(), uri.end());
+            wsUri.push_back('\0');
+            if (stream_session_init(session, bench_response_handler, options.read_rate, wsUri.data(), options.sampling,
+                                    options.stereo || options.reference ? 2 : 1, options.reference ? 1 : 0,
+                                    options.audio_format, nullptr, &pUserData) != SWITCH_STATUS_SUCCESS) {
+                fprintf(stderr, "%s: stream_session_init failed\n", name);
+                return false;
+            }
+            tech_pvt = (private_t *) pUserData;
+            bug = fake_media_bug_attach(session, tech_pvt, flags);
+            switch_channel_set_private(switch_core_session_get_channel(session), MY_BUG_NAME, bug);
+            client = WebSocketClient::find(uri);
+            if (!client) return false;
+
+            for (int i = 1; i <= options.extra_destinations; i++) {
+                std::string extra = uri + "/" + std::to_string(i);
+                std::vector<char> extraUri(extra.begin(), extra.end());
+                extraUri.push_back('\0');
+                if (stream_session_add_destination(session, extraUri.data(), options.sampling, 1, 0, options.audio_format,
+                                                   nullptr) != SWITCH_STATUS_SUCCESS) {
+                    fprintf(stderr, "%s: stream_session_add_destination failed\n", name);
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        void stop() {
+            if (tech_pvt) stream_session_cleanup(session, nullptr, 1);
+            if (session) fake_session_destroy(session);
+            session = nullptr;
+            tech_pvt = nullptr;
+        }
+
+        void drain_playback() {
+            switch_mutex_lock(tech_pvt->playback_mutex);
+            switch_buffer_zero(tech_pvt->playback_buffer);
+            switch_mutex_unlock(tech_pvt->playback_mutex);
+        }
+    };
+
+    struct bench_case {
+        std::string name;
+        bool per_tick;
+        std::function<bool(bench_call&)> setup;
+        std::function<void(bench_call&)> op;
+    };
+
+    std::string stream_audio_message(int chunk_ms) {
+        std::string pcm((size_t)chunk_ms * 16, '\0');  /* L16 @ 8kHz: 16 bytes per ms */
+        for (size_t i = 0; i + 1 < pcm.size(); i += 2) {
+            const int16_t s = (int16_t)((i * 37) & 0x3fff);
+            memcpy(&pcm[i], &s, sizeof(s));
+        }
+        return "{\"type\":\"streamAudio\",\"data\":{\"audioDataType\":\"raw\",\"sampleRate\":8000,\"audioData\":\"" +
+               base64_encode(pcm) + "\"}}";
+    }
+
+    /* a ~127Hz voice with a few harmonics, sample phase onwards: periodic, so catch-up finds whole periods to skip */
+    std::vector<int16_t> voiced_pcm(size_t samples, uint32_t phase) {
+        std::vector<int16_t> pcm(samples);
+        for (size_t i = 0; i < samples; i++) {
+            const double t = 2.0 * 3.14159265358979323846 * (double)((phase + i) % 63) / 63.0;
+            pcm[i] = (int16_t)(6000.0 * sin(t) + 3000.0 * sin(2 * t + 0.5) + 1500.0 * sin(3 * t + 1.0));
+        }
+        return pcm;
+    }
+
+#ifdef HAVE_OPUS
+    /* the same kind of chunk as one 24kHz Opus packet, as a TTS service would send it */
+    std::string stream_opus_message(int chunk_ms) {
+        const int samples = 24 * chunk_ms;
+        std::vector<opus_int16> pcm((size_t)samples);
+        for (int i = 0; i < samples; i++) pcm[i] = (opus_int16)((i * 37) & 0x3fff);
+        int err;
+        OpusEncoder *encoder = opus_encoder_create(24000, 1, OPUS_APPLICATION_VOIP, &err);
+        std::string packet(4000, '\0');
+        const opus_int32 len = opus_encode(encoder, pcm.data(), samples, (unsigned char *) &packet[0], (opus_int32) packet.size());
+        opus_encoder_destroy(encoder);
+        packet.resize(len > 0 ? (size_t) len : 0);
+        return "{\"type\":\"streamAudio\",\"data\":{\"audioDataType\":\"opus\",\"audioData\":\"" +
+               base64_encode(packet) + "\"}}";
+    }
+#endif
+
+    std::function<bool(bench_call&)> capture(const std::string &name, const call_options &options) {
+        return [=](bench_call &call) {
+            return call.start(name.c_str(), options);
+        };
+    }
+
+    void tick(bench_call &call) {
+        fake_media_bug_queue(call.bug, 1);
+        stream_frame(call.bug);
+    }
+
+    std::vector<bench_case> make_cases() {
+        std::vector<bench_case> cases;
+
+        cases.push_back({"stream_frame/l16-mono-8k", true, capture("l16-mono-8k", call_options()), tick});
+        {
+            call_options options;
+            options.stereo = true;
+            cases.push_back({"stream_frame/l16-stereo-8k", true, capture("l16-stereo-8k", options), tick});
+            options.sampling = 16000;
+            cases.push_back({"stream_frame/l16-stereo-8k-to-16k", true, capture("l16-stereo-8k-to-16k", options), tick});
+        }
+        cases.push_back({"stream_frame/l16-mono-8k-to-16k", true, capture("l16-8k-to-16k", rates(8000, 16000)), tick});
+        cases.push_back({"stream_frame/l16-mono-16k-to-8k", true, capture("l16-16k-to-8k", rates(16000, 8000)), tick});
+        {
+            call_options options;
+            options.audio_format = AUDIO_FORMAT_PCMU;
+            cases.push_back({"stream_frame/pcmu-mono-8k", true, capture("pcmu-mono-8k", options), tick});
+            options.audio_format = AUDIO_FORMAT_PCMA;
+            cases.push_back({"stream_frame/pcma-mono-8k", true, capture("pcma-mono-8k", options), tick});
+        }
+        {
+            call_options options;
+            options.buffer_ms = 100;
+            cases.push_back({"stream_frame/l16-mono-8k-100ms", true, capture("l16-mono-8k-100ms", options), tick});
+            options.audio_format = AUDIO_FORMAT_PCMU;
+            cases.push_back({"stream_frame/pcmu-mono-8k-100ms", true, capture("pcmu-mono-8k-100ms", options), tick});
+            options = rates(16000, 8000);
+            options.buffer_ms = 100;
+            cases.push_back({"stream_frame/l16-mono-16k-to-8k-100ms", true, capture("l16-16k-to-8k-100ms", options), tick});
+        }
+#ifdef HAVE_OPUS
+        {
+            call_options options;
+            options.audio_format = AUDIO_FORMAT_OPUS;
+            cases.push_back({"stream_frame/opus-mono-8k", true, capture("opus-mono-8k", options), tick});
+            options = rates(16000, 16000);
+            options.audio_format = AUDIO_FORMAT_OPUS;
+            cases.push_back({"stream_frame/opus-mono-16k", true, capture("opus-mono-16k", options), tick});
+            options = rates(8000, 16000);
+            options.audio_format = AUDIO_FORMAT_OPUS;
+            options.buffer_ms = 100;
+            cases.push_back({"stream_frame/opus-mono-8k-to-16k-100ms", true, capture("opus-8k-to-16k-100ms", options), tick});
+        }
+#endif
+        {
+            call_options options;
+            options.extra_destinations = 2;
+            cases.push_back({"stream_frame/l16-mono-8k-3-destinations", true, capture("l16-mono-8k-3-destinations", options), tick});
+            options.audio_format = AUDIO_FORMAT_PCMU;
+            cases.push_back({"stream_frame/pcmu-mono-8k-3-destinations", true, capture("pcmu-mono-8k-3-destinations", options), tick});
+        }
+        {
+            /* STREAM_VAD on a caller who talks (tone) or is silent the whole time */
+            call_options options;
+            options.vad = true;
+            cases.push_back({"stream_frame/l16-mono-8k-vad-speech", true, capture("l16-mono-8k-vad-speech", options), tick});
+            options.amplitude = 20.0;
+            cases.push_back({"stream_frame/l16-mono-8k-vad-silence", true, capture("l16-mono-8k-vad-silence", options), tick});
+        }
+        {
+            call_options options;
+            options.aec = true;
+            cases.push_back({"stream_frame/l16-mono-8k-aec", true, capture("l16-mono-8k-aec", options), tick});
+        }
+        {
+            call_options options;
+            options.preprocess = true;
+            cases.push_back({"stream_frame/l16-mono-8k-denoise-agc", true, capture("l16-mono-8k-denoise-agc", options), tick});
+            options = rates(16000, 16000);
+            options.preprocess = true;
+            cases.push_back({"stream_frame/l16-mono-16k-denoise-agc", true, capture("l16-mono-16k-denoise-agc", options), tick});
+        }
+        {
+            auto play_and_tick = [](bench_call &call) {
+                stream_playback_frame(call.bug);
+                tick(call);
+            };
+            call_options options;
+            options.reference = true;
+            cases.push_back({"stream_frame/l16-reference-8k", true, capture("l16-reference-8k", options), play_and_tick});
+            options = rates(16000, 16000);
+            options.reference = true;
+            cases.push_back({"stream_frame/l16-reference-16k", true, capture("l16-reference-16k", options), play_and_tick});
+        }
+
+        const int chunk_sizes[] = {20, 100, 500};
+        for (int chunk_ms : chunk_sizes) {
+            auto message = std::make_shared<std::string>(stream_audio_message(chunk_ms));
+            const std::string name = "processMessage/streamAudio-" + std::to_string(chunk_ms) + "ms";
+            cases.push_back({name, false, capture(name.substr(strlen("processMessage/")), call_options()),
+                [message](bench_call &call) {
+                    call.client->deliver(*message);
+                    call.drain_playback();
+                }});
+        }
+#ifdef HAVE_OPUS
+        for (int chunk_ms : {20, 100}) {
+            auto message = std::make_shared<std::string>(stream_opus_message(chunk_ms));
+            const std::string name = "processMessage/streamAudio-opus-" + std::to_string(chunk_ms) + "ms";
+            cases.push_back({name, false, capture(name.substr(strlen("processMessage/")), call_options()),
+                [message](bench_call &call) {
+                    call.client->deliver(*message);
+                    call.drain_playback();
+                }});
+        }
+#endif
+        /* message parsing alone: in-place scan vs the cJSON tree (arena and malloc) it replaces, both decoding audioData */
+        for (int chunk_ms : chunk_sizes) {
+            auto message = std::make_shared<std::string>(stream_audio_message(chunk_ms));
+            auto pcm = std::make_shared<std::vector<unsigned char>>(message->size());
+            const std::string suffix = "streamAudio-" + std::to_string(chunk_ms) + "ms";
+            auto no_call = [](bench_call &) { return true; };
+            cases.push_back({"parse/scan-" + suffix, false, no_call,
+                [message, pcm](bench_call &) {
+                    json_msg_t msg;
+                    if (json_scan_message(message->data(), message->size(), &msg)) {
+                        base64_decode(msg.audio_data, msg.audio_len, pcm->data());
+                    }
+                }});
+            auto cjson_parse = [message, pcm]() {
+                cJSON *json = cJSON_Parse(message->c_str());
+                cJSON *data = cJSON_GetObjectItem(json, "data");
+                const char *type = cJSON_GetObjectCstr(data, "audioDataType");
+                cJSON *audio = cJSON_GetObjectItem(data, "audioData");
+                if (type && audio && audio->valuestring) {
+                    base64_decode(audio->valuestring, strlen(audio->valuestring), pcm->data());
+                }
+                cJSON_Delete(json);
+            };
+            cases.push_back({"parse/cjson-arena-" + suffix, false, no_call,
+                [cjson_parse](bench_call &) {
+                    json_arena_scope arena;
+                    cjson_parse();
+                }});
+            cases.push_back({"parse/cjson-malloc-" + suffix, false, no_call,
+                [cjson_parse](bench_call &) {
+                    cjson_parse();
+                }});
+        }
+        {
+            auto message = std::make_shared<std::string>("{\"type\":\"stopAudio\"}");
+            cases.push_back({"processMessage/stopAudio", false, capture("stopAudio", call_options()),
+                [message](bench_call &call) {
+                    call.client->deliver(*message);
+                }});
+        }
+
+        /* READ injection: keep the playback buffer topped up so every tick plays a frame */
+        cases.push_back({"stream_playback_frame/inject", true,
+            [](bench_call &call) {
+                if (!call.start("inject", call_options())) return false;
+                const std::string silence(320 * 5, '\0');
+                switch_buffer_write(call.tech_pvt->playback_buffer, silence.data(), silence.size());
+                return true;
+            },
+            [](bench_call &call) {
+                static const uint8_t frame[320] = {0};
+                switch_mutex_lock(call.tech_pvt->playback_mutex);
+                switch_buffer_write(call.tech_pvt->playback_buffer, frame, sizeof(frame));
+                switch_mutex_unlock(call.tech_pvt->playback_mutex);
+                stream_playback_frame(call.bug);
+            }});
+        /* the same with STREAM_PLAYBACK_DRIFT: every frame goes through the rate-correcting resampler */
+        cases.push_back({"stream_playback_frame/inject-drift", true,
+            [](bench_call &call) {
+                call_options options;
+                options.drift = true;
+                if (!call.start("inject-drift", options)) return false;
+                const std::string silence(320 * 5, '\0');
+                switch_buffer_write(call.tech_pvt->playback_buffer, silence.data(), silence.size());
+                return true;
+            },
+            [](bench_call &call) {
+                static const uint8_t frame[320] = {0};
+                switch_mutex_lock(call.tech_pvt->playback_mutex);
+                switch_buffer_write(call.tech_pvt->playback_buffer, frame, sizeof(frame));
+                switch_mutex_unlock(call.tech_pvt->playback_mutex);
+                stream_playback_frame(call.bug);
+            }});
+        /* STREAM_PLAYBACK_CATCHUP with a backlog above threshold: every frame is time-compressed at full speed */
+        cases.push_back({"stream_playback_frame/inject-catchup", true,
+            [](bench_call &call) {
+                call_options options;
+                options.catchup = true;
+                if (!call.start("inject-catchup", options)) return false;
+                std::string speech(16000, '\0');   /* 1s of a ~150Hz triangle, so the search has periods to match */
+                for (size_t i = 0; i + 1 < speech.size(); i += 2) {
+                    const int k = (int)((i / 2) % 54);
+                    const int16_t s = (int16_t)((k < 27 ? k : 54 - k) * 1200 - 16000);
+                    memcpy(&speech[i], &s, sizeof(s));
+                }
+                switch_buffer_write(call.tech_pvt->playback_buffer, speech.data(), speech.size());
+                return true;
+            },
+            [](bench_call &call) {
+                static const uint8_t frame[368] = {0};     /* 1.15 frames: the backlog stays where it is */
+                switch_mutex_lock(call.tech_pvt->playback_mutex);
+                switch_buffer_write(call.tech_pvt->playback_buffer, frame, sizeof(frame));
+                switch_mutex_unlock(call.tech_pvt->playback_mutex);
+                stream_playback_frame(call.bug);
+            }});
+        cases.push_back({"stream_playback_frame/idle", true,
+            [](bench_call &call) {
+                return call.start("idle", call_options());
+            },
+            [](bench_call &call) {
+                stream_playback_frame(call.bug);
+            }});
+
+        return cases;
+    }
+
+    struct bench_check {
+        std::string name;
+        std::function<bool()> run;
+    };
+
+    std::vector<bench_check> make_checks() {
+        std::vector<bench_check> checks;
+
+        /*
+         * Catch-up on voiced-like audio, where the best match often lies past the nominal position: fed 1.15
+         * frames a tick, no tick may take more than was buffered or than its steps could peek, and together they
+         * must take more than they play.
+         */
+        checks.push_back({"catchup-voiced", []() {
+            const int ticks = 2000;
+            const uint32_t fed = 184;
+            bench_call call;
+            call_options options;
+            options.catchup = true;
+            bool ok = call.start("catchup-voiced", options);
+            if (ok) {
+                const std::vector<int16_t> backlog = voiced_pcm(8000, 0);
+                switch_buffer_write(call.tech_pvt->playback_buffer, backlog.data(), backlog.size() * sizeof(int16_t));
+            }
+            uint32_t phase = 8000;
+            uint64_t total = 0;
+            for (int i = 0; ok && i < ticks; i++) {
+                const std::vector<int16_t> voiced = voiced_pcm(fed, phase);
+                phase += fed;
+                switch_mutex_lock(call.tech_pvt->playback_mutex);
+                switch_buffer_write(call.tech_pvt->playback_buffer, voiced.data(), voiced.size() * sizeof(int16_t));
+                const uint64_t played = call.tech_pvt->playback_played;
+                const switch_size_t buffered = switch_buffer_inuse(call.tech_pvt->playback_buffer);
+                switch_mutex_unlock(call.tech_pvt->playback_mutex);
+                stream_playback_frame(call.bug);
+                const uint64_t taken = call.tech_pvt->playback_played - played;
+                if (taken > buffered || taken > 2 * STREAM_WSOLA_IN_MAX * sizeof(int16_t)) {
+                    fprintf(stderr, "catchup-voiced: tick %d took %llu bytes of %zu buffered\n", i,
+                            (unsigned long long) taken, buffered);
+                    ok = false;
+                }
+                total += taken;
+            }
+            if (ok && total <= (uint64_t) ticks * 320) {
+                fprintf(stderr, "catchup-voiced: %d ticks took %llu bytes, no faster than real time\n", ticks,
+                        (unsigned long long) total);
+                ok = false;
+            }
+            call.stop();
+            return ok;
+        }});
+
+        return checks;
+    }
+
+    bool selected(const std::string &name, const std::vector<std::string> &filters) {
+        if (filters.empty()) return true;
+        for (const auto &f : filters) {
+            if (name.find(f) != std::string::npos) return true;
+        }
+        return false;
+    }
+
+    void run_case(const bench_case &c, int iterations) {
+        bench_call call;
+        if (!c.setup(call)) {
+            printf("%-42s  setup failed\n", c.name.c_str());
+            call.stop();
+            return;
+        }
+
+        for (int i = 0; i < iterations / 10 + 1; i++) c.op(call);
+
+        std::vector<double> rounds;
+        for (int r = 0; r < ROUNDS; r++) {
+            const uint64_t start = now_ns();
+            for (int i = 0; i < iterations; i++) c.op(call);
+            rounds.push_back((double)(now_ns() - start) / iterations);
+        }
+        std::sort(rounds.begin(), rounds.end());
+        const double best = rounds.front();
+        const double median = rounds[ROUNDS / 2];
+
+        if (c.per_tick) {
+            printf("%-42s %10.0f %10.0f %9.4f\n", c.name.c_str(), best, median, 100.0 * median / TICK_NS);
+        } else {
+            printf("%-42s %10.0f %10.0f %9s\n", c.name.c_str(), best, median, "-");
+        }
+        call.stop();
+    }
+}
+
+int main(int argc, char **argv) {
+    int iterations = 20000;
+    bool check_only = false;
+    std::vector<std::string> filters;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--iterations") && i + 1 < argc) {
+            iterations = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--check")) {
+            check_only = true;
+        } else if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h")) {
+            printf("usage: %s [--iterations N] [--check] [filter...]\n", argv[0]);
+            return 0;
+        } else {
+            filters.push_back(argv[i]);
+        }
+    }
+
+    if (stream_metrics_init() != SWITCH_STATUS_SUCCESS) {
+        fprintf(stderr, "stream_metrics_init failed\n");
+        return 1;
+    }
+    json_arena_init();
+
+    int failed = 0;
+    for (const auto &c : make_checks()) {
+        if (!selected(c.name, filters)) continue;
+        const bool ok = c.run();
+        printf("check %-36s %s\n", c.name.c_str(), ok ? "ok" : "FAILED");
+        if (!ok) failed++;
+    }
+
+    if (!check_only && !failed) {
+        printf("%-42s %10s %10s %9s\n", "case", "best ns", "median ns", "tick%");
+        for (const auto &c : make_cases()) {
+            if (selected(c.name, filters)) run_case(c, iterations);
+        }
+    }
+
+    stream_metrics_shutdown();
+    json_arena_shutdown();
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,381 @@
+/*
+ * Load generator: N simulated calls through the real AudioStreamer (libwsc),
+ * stream_frame, processMessage and playback injection, each driven by its own
+ * 20ms media thread like a FreeSWITCH session thread, against a WebSocket
+ * server such as stand_in_server.py.
+ *
+ *   stream_load [--url ws://127.0.0.1:8765/] [--sessions 10,50,100] [--duration 30] ...
+ *
+ * For every session count it reports process CPU per call, thread count, RSS
+ * per call, READ tick latency, late ticks (media thread woke more than a tick
+ * behind), playback underrun rate and, when marks are enabled, the round trip
+ * measured by the module.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+#include <time.h>
+
+extern "C" {
+#include "audio_streamer_glue.h"
+}
+#include "json_arena.h"
+#include "fake_switch.h"
+
+namespace {
+
+    const uint64_t TICK_NS = 20000000ULL;
+
+    struct load_options {
+        std::string url = "ws://127.0.0.1:8765/";
+        std::vector<int> steps = {10};
+        int duration_s = 30;
+        int warmup_s = 3;
+        int connect_timeout_s = 15;
+        uint32_t read_rate = 8000;
+        int sampling = 8000;
+        bool stereo = false;
+        int audio_format = AUDIO_FORMAT_L16;
+        int buffer_ms = 20;
+        int mark_interval_ms = 1000;
+    };
+
+    std::atomic<int> g_connected{0};
+    std::atomic<int> g_errors{0};
+    std::atomic<int> g_disconnects{0};
+    std::atomic<bool> g_running{false};
+    std::atomic<bool> g_measuring{false};
+
+    void load_response_handler(switch_core_session_t *session, const char *eventName, const char *json) {
+        (void)session;
+        (void)json;
+        if (!strcmp(eventName, EVENT_CONNECT)) {
+            g_connected++;
+        } else if (!strcmp(eventName, EVENT_ERROR)) {
+            g_errors++;
+        } else if (!strcmp(eventName, EVENT_DISCONNECT)) {
+            g_disconnects++;
+        }
+    }
+
+    struct load_session {
+        switch_core_session_t *session = nullptr;
+        switch_media_bug_t *bug = nullptr;
+        private_t *tech_pvt = nullptr;
+        lat_hist_t tick;
+        uint64_t ticks = 0;
+        uint64_t late_ticks = 0;
+        std::thread thread;
+    };
+
+    /* the media bug READ callback: playback injection, then the capture path */
+    void media_thread(load_session *ls, uint64_t first_tick_ns) {
+        uint64_t next = first_tick_ns;
+        while (g_running.load(std::memory_order_relaxed)) {
+            struct timespec ts;
+            ts.tv_sec = (time_t)(next / 1000000000ULL);
+            ts.tv_nsec = (long)(next % 1000000000ULL);
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr);
+
+            const uint64_t woke = stream_metrics_now_ns();
+            stream_playback_frame(ls->bug);
+            fake_media_bug_queue(ls->bug, 1);
+            stream_frame(ls->bug);
+            const uint64_t done = stream_metrics_now_ns();
+
+            if (g_measuring.load(std::memory_order_relaxed)) {
+                stream_latency_record(SM_HIST_CAPTURE_CALLBACK, &ls->tick, done - woke, ls->tech_pvt->stats->slow_ns);
+                ls->ticks++;
+                if (woke > next + TICK_NS) ls->late_ticks++;
+            }
+
+            next += TICK_NS;
+            /* far behind (stopped in a debugger, box overloaded): resync instead of bursting */
+            if (done > next + 5 * TICK_NS) next = done;
+        }
+    }
+
+    long proc_status_value(const char *key) {
+        FILE *fp = fopen("/proc/self/status", "r");
+        if (!fp) return -1;
+        char line[256];
+        long value = -1;
+        const size_t len = strlen(key);
+        while (fgets(line, sizeof(line), fp)) {
+            if (!strncmp(line, key, len) && line[len] == ':') {
+                value = atol(line + len + 1);
+                break;
+            }
+        }
+        fclose(fp);
+        return value;
+    }
+
+    double cpu_seconds() {
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        return (double)ru.ru_utime.tv_sec + (double)ru.ru_utime.tv_usec / 1e6 +
+               (double)ru.ru_stime.tv_sec + (double)ru.ru_stime.tv_usec / 1e6;
+    }
+
+    struct snapshot {
+        double wall_s;
+        double cpu_s;
+        uint64_t underruns;
+        uint64_t overruns;
+        uint64_t injected;
+    };
+
+    snapshot take_snapshot(const std::vector<load_session *> &sessions) {
+        snapshot s;
+        s.wall_s = (double)stream_metrics_now_ns() / 1e9;
+        s.cpu_s = cpu_seconds();
+        s.underruns = stream_metrics_counter(SM_PLAYBACK_UNDERRUNS);
+        s.overruns = stream_metrics_counter(SM_PLAYBACK_OVERRUNS);
+        s.injected = 0;
+        for (auto *ls : sessions) s.injected += fake_session_frames_written(ls->session);
+        return s;
+    }
+
+    void merge_hist(lat_hist_t &into, const lat_hist_t &from) {
+        for (int i = 0; i < LAT_HIST_BUCKETS; i++) into.counts[i] += __atomic_load_n(&from.counts[i], __ATOMIC_RELAXED);
+        into.count += __atomic_load_n(&from.count, __ATOMIC_RELAXED);
+        into.sum_ns += __atomic_load_n(&from.sum_ns, __ATOMIC_RELAXED);
+        into.slow += __atomic_load_n(&from.slow, __ATOMIC_RELAXED);
+        into.max_ns = std::max(into.max_ns, (uint64_t)__atomic_load_n(&from.max_ns, __ATOMIC_RELAXED));
+    }
+
+    double summary_value(const lat_hist_t &hist, const char *key) {
+        cJSON *json = lat_hist_summary(&hist);
+        cJSON *item = cJSON_GetObjectItem(json, key);
+        const double value = item ? item->valuedouble : 0.0;
+        cJSON_Delete(json);
+        return value;
+    }
+
+    load_session *start_session(const load_options &opt, int index) {
+        char uuid[64];
+        snprintf(uuid, sizeof(uuid), "load-%06d", index);
+
+        auto *ls = new load_session();
+        memset(&ls->tick, 0, sizeof(ls->tick));
+        ls->session = fake_session_create(uuid, opt.read_rate);
+        fake_channel_set_variable(ls->session, "STREAM_SUPPRESS_LOG", "true");
+        if (opt.buffer_ms > 20) {
+            fake_channel_set_variable(ls->session, "STREAM_BUFFER_SIZE", std::to_string(opt.buffer_ms).c_str());
+        }
+        if (opt.mark_interval_ms > 0) {
+            fake_channel_set_variable(ls->session, "STREAM_MARK_INTERVAL_MS", std::to_string(opt.mark_interval_ms).c_str());
+        }
+
+        std::vector<char> wsUri(opt.url.begin(), opt.url.end());
+        wsUri.push_back('\0');
+        void *pUserData = nullptr;
+        if (stream_session_init(ls->session, load_response_handler, opt.read_rate, wsUri.data(), opt.sampling,
+                                opt.stereo ? 2 : 1, 0, opt.audio_format, nullptr, &pUserData) != SWITCH_STATUS_SUCCESS) {
+            fake_session_destroy(ls->session);
+            delete ls;
+            return nullptr;
+        }
+        ls->tech_pvt = (private_t *) pUserData;
+        ls->bug = fake_media_bug_attach(ls->session, ls->tech_pvt, SMBF_READ_STREAM | (opt.stereo ? SMBF_STEREO : 0));
+        switch_channel_set_private(switch_core_session_get_channel(ls->session), MY_BUG_NAME, ls->bug);
+        return ls;
+    }
+
+    void stop_session(load_session *ls) {
+        stream_session_cleanup(ls->session, nullptr, 0);
+        fake_session_destroy(ls->session);
+        delete ls;
+    }
+
+    void sleep_s(double seconds) {
+        std::this_thread::sleep_for(std::chrono::microseconds((int64_t)(seconds * 1e6)));
+    }
+
+    void print_header() {
+        printf("%8s %7s %9s %8s %9s %10s %9s %9s %7s %9s %9s %9s %9s %6s\n",
+               "sessions", "cpu%", "cpu%/call", "threads", "rss MiB", "KiB/call",
+               "tick p50", "tick p99", "late%", "underrun%", "overruns", "rtt p50", "rtt p99", "errors");
+        printf("%8s %7s %9s %8s %9s %10s %9s %9s %7s %9s %9s %9s %9s %6s\n",
+               "", "", "", "", "", "", "us", "us", "", "", "", "ms", "ms", "");
+    }
+
+    void run_step(const load_options &opt, int n) {
+        g_connected = 0;
+        g_errors = 0;
+        g_disconnects = 0;
+
+        const long rss_base_kb = proc_status_value("VmRSS");
+        std::vector<load_session *> sessions;
+        sessions.reserve(n);
+        for (int i = 0; i < n; i++) {
+            load_session *ls = start_session(opt, i);
+            if (!ls) {
+                fprintf(stderr, "session %d: stream_session_init failed\n", i);
+                break;
+            }
+            sessions.push_back(ls);
+        }
+
+        const uint64_t deadline = stream_metrics_now_ns() + (uint64_t)opt.connect_timeout_s * 1000000000ULL;
+        while (g_connected.load() + g_errors.load() < (int)sessions.size() && stream_metrics_now_ns() < deadline) {
+            sleep_s(0.05);
+        }
+        if (g_connected.load() < (int)sessions.size()) {
+            fprintf(stderr, "%d sessions: only %d connected (%d errors)\n", n, g_connected.load(), g_errors.load());
+        }
+
+        /* spread the ticks over the 20ms period, sessions in a real box are not aligned */
+        std::mt19937_64 rng(n);
+        std::uniform_int_distribution<uint64_t> offset(0, TICK_NS - 1);
+        const uint64_t base = stream_metrics_now_ns() + TICK_NS;
+        g_running = true;
+        for (auto *ls : sessions) ls->thread = std::thread(media_thread, ls, base + offset(rng));
+
+        sleep_s(opt.warmup_s);
+        const snapshot before = take_snapshot(sessions);
+        g_measuring = true;
+        sleep_s(opt.duration_s);
+        g_measuring = false;
+        const snapshot after = take_snapshot(sessions);
+        const long threads = proc_status_value("Threads");
+        const long rss_kb = proc_status_value("VmRSS");
+
+        g_running = false;
+        for (auto *ls : sessions) ls->thread.join();
+
+        lat_hist_t tick, round_trip;
+        memset(&tick, 0, sizeof(tick));
+        memset(&round_trip, 0, sizeof(round_trip));
+        uint64_t ticks = 0, late = 0;
+        for (auto *ls : sessions) {
+            merge_hist(tick, ls->tick);
+            merge_hist(round_trip, ls->tech_pvt->stats->round_trip);
+            ticks += ls->ticks;
+            late += ls->late_ticks;
+        }
+
+        const int errors = g_errors.load() + g_disconnects.load();
+        for (auto *ls : sessions) stop_session(ls);
+
+        const double wall = after.wall_s - before.wall_s;
+        const double cpu_pct = 100.0 * (after.cpu_s - before.cpu_s) / wall;
+        const int active = std::max(1, (int)sessions.size());
+        const uint64_t underruns = after.underruns - before.underruns;
+        const uint64_t injected = after.injected - before.injected;
+
+        printf("%8d %7.1f %9.3f %8ld %9.1f %10.1f %9.1f %9.1f %7.3f %9.3f %9llu %9.1f %9.1f %6d\n",
+               (int)sessions.size(), cpu_pct, cpu_pct / active, threads, (double)rss_kb / 1024.0,
+               (double)(rss_kb - rss_base_kb) / active,
+               summary_value(tick, "p50_us"), summary_value(tick, "p99_us"),
+               ticks ? 100.0 * (double)late / (double)ticks : 0.0,
+               underruns + injected ? 100.0 * (double)underruns / (double)(underruns + injected) : 0.0,
+               (unsigned long long)(after.overruns - before.overruns),
+               summary_value(round_trip, "p50_us") / 1000.0, summary_value(round_trip, "p99_us") / 1000.0,
+               errors);
+        fflush(stdout);
+    }
+
+    std::vector<int> parse_steps(const char *arg) {
+        std::vector<int> steps;
+        std::string s(arg);
+        size_t pos = 0;
+        while (pos <= s.size()) {
+            const size_t comma = s.find(',', pos);
+            const int n = atoi(s.substr(pos, comma == std::string::npos ? std::string::npos : comma - pos).c_str());
+            if (n > 0) steps.push_back(n);
+            if (comma == std::string::npos) break;
+            pos = comma + 1;
+        }
+        return steps;
+    }
+
+    void usage(const char *prog) {
+        printf("usage: %s [options]\n"
+               "  --url URL                 websocket server (default ws://127.0.0.1:8765/)\n"
+               "  --sessions N[,N...]       session counts to run, one step each (default 10)\n"
+               "  --duration S              measured seconds per step (default 30)\n"
+               "  --warmup S                seconds before measuring (default 3)\n"
+               "  --read-rate HZ            call codec rate (default 8000)\n"
+               "  --rate HZ                 streamed sample rate (default 8000)\n"
+               "  --stereo                  stream both legs\n"
+               "  --format l16|pcmu|pcma    streamed audio format (default l16)\n"
+               "  --buffer-ms MS            STREAM_BUFFER_SIZE (default 20)\n"
+               "  --mark-interval-ms MS     STREAM_MARK_INTERVAL_MS, 0 disables (default 1000)\n",
+               prog);
+    }
+}
+
+int main(int argc, char **argv) {
+    load_options opt;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+        if (!strcmp(arg, "--help") || !strcmp(arg, "-h")) {
+            usage(argv[0]);
+            return 0;
+        } else if (!strcmp(arg, "--stereo")) {
+            opt.stereo = true;
+            continue;
+        } else if (!value) {
+            usage(argv[0]);
+            return 1;
+        } else if (!strcmp(arg, "--url")) {
+            opt.url = value;
+        } else if (!strcmp(arg, "--sessions")) {
+            opt.steps = parse_steps(value);
+        } else if (!strcmp(arg, "--duration")) {
+            opt.duration_s = std::max(1, atoi(value));
+        } else if (!strcmp(arg, "--warmup")) {
+            opt.warmup_s = std::max(0, atoi(value));
+        } else if (!strcmp(arg, "--read-rate")) {
+            opt.read_rate = (uint32_t)atoi(value);
+        } else if (!strcmp(arg, "--rate")) {
+            opt.sampling = atoi(value);
+        } else if (!strcmp(arg, "--format")) {
+            if (!strcmp(value, "pcmu")) opt.audio_format = AUDIO_FORMAT_PCMU;
+            else if (!strcmp(value, "pcma")) opt.audio_format = AUDIO_FORMAT_PCMA;
+            else opt.audio_format = AUDIO_FORMAT_L16;
+        } else if (!strcmp(arg, "--buffer-ms")) {
+            opt.buffer_ms = atoi(value);
+        } else if (!strcmp(arg, "--mark-interval-ms")) {
+            opt.mark_interval_ms = std::max(0, atoi(value));
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+        i++;
+    }
+
+    if (opt.steps.empty()) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (stream_metrics_init() != SWITCH_STATUS_SUCCESS) {
+        fprintf(stderr, "stream_metrics_init failed\n");
+        return 1;
+    }
+    json_arena_init();
+
+    printf("%s, %u Hz call -> %d Hz %s %s, %ds per step\n", opt.url.c_str(), opt.read_rate, opt.sampling,
+           opt.stereo ? "stereo" : "mono",
+           opt.audio_format == AUDIO_FORMAT_PCMU ? "pcmu" : opt.audio_format == AUDIO_FORMAT_PCMA ? "pcma" : "l16",
+           opt.duration_s);
+    print_header();
+    for (int n : opt.steps) run_step(opt, n);
+
+    stream_metrics_shutdown();
+    json_arena_shutdown();
+    return 0;
+}
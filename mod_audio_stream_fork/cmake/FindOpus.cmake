@@ -0,0 +1,37 @@
+# Find the system's Opus includes and library
+#
+#  OPUS_INCLUDE_DIRS - where to find opus/opus.h
+#  OPUS_LIBRARIES    - List of libraries when using Opus
+#  OPUS_FOUND        - True if Opus found
+
+if(NOT USE_REPOSITORY)
+  find_package(PkgConfig)
+  pkg_search_module(PC_OPUS opus)
+endif()
+
+find_path(OPUS_INCLUDE_DIR
+  NAMES
+    opus/opus.h
+  HINTS
+    ${PC_OPUS_INCLUDEDIR}
+)
+
+find_library(OPUS_LIBRARY
+  NAMES
+    opus
+  HINTS
+    ${PC_OPUS_LIBRARY_DIRS}
+)
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(Opus DEFAULT_MSG OPUS_LIBRARY OPUS_INCLUDE_DIR)
+
+if(OPUS_FOUND)
+  set(OPUS_LIBRARIES ${OPUS_LIBRARY})
+  set(OPUS_INCLUDE_DIRS ${OPUS_INCLUDE_DIR})
+else()
+  set(OPUS_LIBRARIES)
+  set(OPUS_INCLUDE_DIRS)
+endif()
+
+mark_as_advanced(OPUS_LIBRARIES OPUS_INCLUDE_DIRS)
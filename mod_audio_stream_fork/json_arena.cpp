@@ -0,0 +1,87 @@
+#include "json_arena.h"
+
+#include <cstdlib>
+
+namespace {
+
+    const size_t ARENA_ALIGN = 16;
+    const size_t ARENA_GRANULE = 4096;
+    /* larger messages (whole files, not streamed chunks) go to malloc instead of pinning memory per thread */
+    const size_t ARENA_MAX = 256 * 1024;
+
+    struct json_arena {
+        char *base = nullptr;
+        size_t cap = 0;
+        size_t used = 0;
+        size_t demand = 0;      /* bytes the current scope asked for, including what did not fit */
+        bool active = false;
+
+        ~json_arena() {
+            free(base);
+            base = nullptr;
+            cap = 0;
+        }
+    };
+
+    thread_local json_arena t_arena;
+
+    void *arena_malloc(size_t size) {
+        json_arena &arena = t_arena;
+        if (arena.active) {
+            const size_t aligned = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+            arena.demand += aligned;
+            if (arena.cap - arena.used >= aligned) {
+                void *p = arena.base + arena.used;
+                arena.used += aligned;
+                return p;
+            }
+        }
+        return malloc(size);
+    }
+
+    void arena_free(void *p) {
+        const json_arena &arena = t_arena;
+        if (arena.base && (char *) p >= arena.base && (char *) p < arena.base + arena.cap) return;
+        free(p);
+    }
+}
+
+extern "C" {
+
+    void json_arena_init(void) {
+        cJSON_Hooks hooks;
+        hooks.malloc_fn = arena_malloc;
+        hooks.free_fn = arena_free;
+        cJSON_InitHooks(&hooks);
+    }
+
+    void json_arena_shutdown(void) {
+        cJSON_InitHooks(nullptr);
+    }
+}
+
+json_arena_scope::json_arena_scope() : m_owner(!t_arena.active) {
+    if (m_owner) {
+        t_arena.active = true;
+        t_arena.used = 0;
+        t_arena.demand = 0;
+    }
+}
+
+json_arena_scope::~json_arena_scope() {
+    if (!m_owner) return;
+    json_arena &arena = t_arena;
+    arena.active = false;
+    arena.used = 0;
+    /* nothing is live any more: resize so the next message of this size fits */
+    if (arena.demand > arena.cap && arena.cap < ARENA_MAX) {
+        size_t cap = (arena.demand + ARENA_GRANULE - 1) & ~(ARENA_GRANULE - 1);
+        if (cap > ARENA_MAX) cap = ARENA_MAX;
+        char *base = (char *) malloc(cap);
+        if (base) {
+            free(arena.base);
+            arena.base = base;
+            arena.cap = cap;
+        }
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef JSON_ARENA_H
+#define JSON_ARENA_H
+
+#include <switch.h>
+
+/*
+ * Bump arena for parsing inbound websocket messages.
+ *
+ * cJSON only has process-wide malloc/free hooks, so json_arena_init installs hooks
+ * that serve allocations from a per-thread arena while a json_arena_scope is alive on
+ * that thread and fall through to malloc/free everywhere else (other modules included).
+ * Frees of arena memory are no-ops; the whole arena is reset when the scope ends.
+ * An arena starts empty and grows to the largest message seen on its thread, so in
+ * steady state parsing a message does no malloc/free at all.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void json_arena_init(void);
+void json_arena_shutdown(void);
+
+#ifdef __cplusplus
+}
+
+/* Nothing allocated by cJSON inside the scope may outlive it. Nested scopes share the outer one. */
+class json_arena_scope {
+public:
+    json_arena_scope();
+    ~json_arena_scope();
+    json_arena_scope(const json_arena_scope&) = delete;
+    json_arena_scope& operator=(const json_arena_scope&) = delete;
+private:
+    bool m_owner;
+};
+#endif
+
+#endif //JSON_ARENA_H
@@ -0,0 +1,176 @@
+#include "json_scan.h"
+
+#include <cstring>
+
+namespace {
+
+    struct span {
+        const char *p = nullptr;
+        size_t len = 0;
+        bool escaped = false;
+
+        bool equals(const char *literal) const {
+            const size_t n = strlen(literal);
+            return p && !escaped && len == n && memcmp(p, literal, n) == 0;
+        }
+    };
+
+    class scanner {
+    public:
+        scanner(const char *json, size_t len) : m_p(json), m_end(json + len) {}
+
+        void ws() {
+            while (m_p < m_end && (*m_p == ' ' || *m_p == '\t' || *m_p == '\n' || *m_p == '\r')) m_p++;
+        }
+
+        bool consume(char c) {
+            ws();
+            if (m_p < m_end && *m_p == c) {
+                m_p++;
+                return true;
+            }
+            return false;
+        }
+
+        bool peek(char c) {
+            ws();
+            return m_p < m_end && *m_p == c;
+        }
+
+        /* string contents without the quotes; escapes are skipped over, not decoded */
+        bool string(span &out) {
+            if (!consume('"')) return false;
+            out.p = m_p;
+            out.escaped = false;
+            while (m_p < m_end) {
+                const char c = *m_p;
+                if (c == '"') {
+                    out.len = m_p - out.p;
+                    m_p++;
+                    return true;
+                }
+                if (c == '\\') {
+                    out.escaped = true;
+                    m_p++;
+                }
+                m_p++;
+            }
+            return false;
+        }
+
+        bool skip_value() {
+            ws();
+            if (m_p >= m_end) return false;
+            if (*m_p == '"') {
+                span ignored;
+                return string(ignored);
+            }
+            if (*m_p == '{' || *m_p == '[') {
+                int depth = 0;
+                while (m_p < m_end) {
+                    const char c = *m_p;
+                    if (c == '"') {
+                        span ignored;
+                        if (!string(ignored)) return false;
+                        continue;
+                    }
+                    m_p++;
+                    if (c == '{' || c == '[') {
+                        depth++;
+                    } else if (c == '}' || c == ']') {
+                        if (--depth == 0) return true;
+                    }
+                }
+                return false;
+            }
+            /* number, true, false, null */
+            const char *start = m_p;
+            while (m_p < m_end && ((*m_p >= '0' && *m_p <= '9') || (*m_p >= 'a' && *m_p <= 'z') ||
+                                   *m_p == '-' || *m_p == '+' || *m_p == '.' || *m_p == 'E')) m_p++;
+            return m_p > start;
+        }
+
+        /* calls member(key) for each member of the object at the cursor; member consumes the value */
+        template <typename Member>
+        bool object(Member member) {
+            if (!consume('{')) return false;
+            if (consume('}')) return true;
+            do {
+                span key;
+                if (!string(key) || !consume(':')) return false;
+                if (!member(key)) return false;
+            } while (consume(','));
+            return consume('}');
+        }
+
+    private:
+        const char *m_p;
+        const char *m_end;
+    };
+}
+
+bool json_scan_message(const char *json, size_t len, json_msg_t *msg) {
+    scanner s(json, len);
+    span type, audio_type, audio, id, utterance;
+    bool has_data = false;
+    bool has_mark = false;
+    bool other_id = false;
+
+    const bool ok = s.object([&](const span &key) {
+        if (key.equals("type") && !type.p) {
+            return s.string(type);
+        }
+        if (key.equals("data") && !has_data && s.peek('{')) {
+            has_data = true;
+            return s.object([&](const span &dataKey) {
+                if (dataKey.equals("audioDataType") && !audio_type.p) {
+                    return s.string(audio_type);
+                }
+                if (dataKey.equals("audioData") && !audio.p) {
+                    return s.string(audio);
+                }
+                if (dataKey.equals("id") && !id.p && !other_id) {
+                    if (s.peek('"')) return s.string(id);
+                    other_id = true;
+                }
+                if (dataKey.equals("utterance") && !utterance.p && !other_id) {
+                    if (s.peek('"')) return s.string(utterance);
+                    other_id = true;
+                }
+                if (dataKey.equals("mark")) {
+                    has_mark = true;
+                }
+                return s.skip_value();
+            });
+        }
+        return s.skip_value();
+    });
+    if (!ok) return false;
+
+    if (type.equals("stopAudio")) {
+        msg->type = JSON_MSG_STOP_AUDIO;
+        msg->audio_data = nullptr;
+        msg->audio_len = 0;
+        msg->opus = false;
+        msg->id = nullptr;
+        msg->id_len = 0;
+        msg->utterance = nullptr;
+        msg->utterance_len = 0;
+        return true;
+    }
+    const bool opus = audio_type.equals("opus");
+    if (type.equals("streamAudio") && has_data && !has_mark && !other_id && !utterance.escaped &&
+        (opus || audio_type.equals("raw")) && audio.p && !audio.escaped) {
+        msg->type = JSON_MSG_STREAM_AUDIO;
+        msg->audio_data = audio.p;
+        msg->audio_len = audio.len;
+        msg->opus = opus;
+        /* the id is only echoed back, so it keeps its quotes and escapes */
+        msg->id = id.p ? id.p - 1 : nullptr;
+        msg->id_len = id.p ? id.len + 2 : 0;
+        msg->utterance = utterance.p;
+        msg->utterance_len = utterance.len;
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,36 @@
+#ifndef JSON_SCAN_H
+#define JSON_SCAN_H
+
+#include <stddef.h>
+
+/*
+ * Single-pass recogniser for the control messages sent on every audio chunk.
+ *
+ * It walks the message once without building a tree or copying anything and
+ * only accepts the shapes processMessage can handle from spans alone:
+ *   {"type":"stopAudio", ...}
+ *   {"type":"streamAudio","data":{"audioDataType":"raw"|"opus","audioData":"<base64>"[,"id":"<chunk id>"][,"utterance":"<id>"], ...}, ...}
+ * Key order and extra members do not matter. Anything else - other types, a "mark"
+ * or a non-string "id" or "utterance" inside data, escapes in the strings we need, malformed JSON - is rejected so the
+ * caller falls back to cJSON, which keeps the full behaviour for everything uncommon.
+ */
+
+typedef enum {
+    JSON_MSG_STOP_AUDIO,
+    JSON_MSG_STREAM_AUDIO
+} json_msg_type_t;
+
+typedef struct json_msg {
+    json_msg_type_t type;
+    const char *audio_data;     /* streamAudio: base64 payload, points into the message */
+    size_t audio_len;
+    bool opus;                  /* streamAudio: audioDataType "opus", one Opus packet */
+    const char *id;             /* streamAudio: chunk "id" string as JSON text, quotes included; NULL when absent */
+    size_t id_len;
+    const char *utterance;      /* streamAudio: "utterance" contents, points into the message; NULL when absent */
+    size_t utterance_len;
+} json_msg_t;
+
+bool json_scan_message(const char *json, size_t len, json_msg_t *msg);
+
+#endif //JSON_SCAN_H
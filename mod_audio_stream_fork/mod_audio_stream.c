@@ -3,12 +3,28 @@
  */
 #include "mod_audio_stream.h"
 #include "audio_streamer_glue.h"
+#include "stream_metrics.h"
+#include "json_arena.h"
+#include "audio_cache.h"
+#include "prompt_library.h"
 
 SWITCH_MODULE_SHUTDOWN_FUNCTION(mod_audio_stream_shutdown);
 SWITCH_MODULE_RUNTIME_FUNCTION(mod_audio_stream_runtime);
 SWITCH_MODULE_LOAD_FUNCTION(mod_audio_stream_load);
 
-SWITCH_MODULE_DEFINITION(mod_audio_stream, mod_audio_stream_load, mod_audio_stream_shutdown, NULL /*mod_audio_stream_runtime*/);
+SWITCH_MODULE_DEFINITION(mod_audio_stream, mod_audio_stream_load, mod_audio_stream_shutdown, mod_audio_stream_runtime);
+
+#define METRICS_DEFAULT_INTERVAL 15  /* seconds between Prometheus textfile writes */
+#define CACHE_DEFAULT_MB 64          /* cacheAudio clips kept for playCached */
+
+static struct {
+    switch_mutex_t *mutex;
+    switch_mutex_t *textfile_mutex;  /* held across a textfile write, so shutdown can wait it out */
+    int running;
+    char *metrics_file;         /* Prometheus textfile path, NULL when disabled */
+    int metrics_interval;
+    char *prompt_dir;           /* playLocal prompt library, NULL when none was loaded */
+} globals;
 
 static void responseHandler(switch_core_session_t* session, const char* eventName, const char* json) {
     switch_event_t *event;
@@ -19,55 +35,13 @@ static void responseHandler(switch_core_session_t* session, const char* eventNam
     switch_event_fire(&event);
 }
 
-/*
- * Linear 16-bit PCM to μ-law conversion
- * Standard ITU-T G.711 algorithm
- */
-static inline uint8_t linear_to_ulaw(int16_t pcm_val)
-{
-    static const int16_t BIAS = 0x84;   /* Bias for linear code */
-    static const int16_t CLIP = 32635;
-    static const uint8_t exp_lut[256] = {
-        0,0,1,1,2,2,2,2,3,3,3,3,3,3,3,3,
-        4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,
-        5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,
-        5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,
-        6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,
-        6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,
-        6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,
-        6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,
-        7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
-        7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
-        7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
-        7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
-        7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
-        7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
-        7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
-        7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7
-    };
-    
-    int sign, exponent, mantissa;
-    uint8_t ulawbyte;
-    
-    /* Get the sign and the magnitude */
-    sign = (pcm_val >> 8) & 0x80;
-    if (sign != 0) pcm_val = -pcm_val;
-    if (pcm_val > CLIP) pcm_val = CLIP;
-    
-    /* Convert from 16 bit linear to ulaw */
-    pcm_val = pcm_val + BIAS;
-    exponent = exp_lut[(pcm_val >> 7) & 0xFF];
-    mantissa = (pcm_val >> (exponent + 3)) & 0x0F;
-    ulawbyte = ~(sign | (exponent << 4) | mantissa);
-    
-    return ulawbyte;
-}
-
 static switch_bool_t capture_callback(switch_media_bug_t *bug, void *user_data, switch_abc_type_t type)
 {
     switch_core_session_t *session = switch_core_media_bug_get_session(bug);
     private_t *tech_pvt = (private_t *)user_data;
     int channel_closing;
+    uint64_t tick_start;
+    switch_bool_t ret;
 
     switch (type) {
         case SWITCH_ABC_TYPE_INIT:
@@ -77,72 +51,23 @@ static switch_bool_t capture_callback(switch_media_bug_t *bug, void *user_data,
             {
                 switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, "Got SWITCH_ABC_TYPE_CLOSE.\n");
                 // Check if this is a normal channel closure or a requested closure
-                channel_closing = tech_pvt->close_requested ? 0 : 1;
+                channel_closing = stream_state_test(tech_pvt, STREAM_STATE_CLOSE_REQUESTED) ? 0 : 1;
                 stream_session_cleanup(session, NULL, channel_closing);
             }
             break;
 
         case SWITCH_ABC_TYPE_READ:
-            if (tech_pvt->close_requested) {
+            if (stream_state_test(tech_pvt, STREAM_STATE_CLOSE_REQUESTED)) {
                 return SWITCH_FALSE;
             }
+            tick_start = stream_metrics_now_ns();
             
-            /* NETPLAY v2.1: Inject playback audio during READ callback
-             * This is called every 20ms when receiving audio from caller.
-             * We use this opportunity to also send audio TO the caller.
-             */
-            if (tech_pvt->playback_buffer && tech_pvt->playback_mutex) {
-                switch_mutex_lock(tech_pvt->playback_mutex);
-                
-                switch_size_t available = switch_buffer_inuse(tech_pvt->playback_buffer);
-                const switch_size_t l16_frame_size = 320;  /* L16 @ 8kHz, 20ms = 160 samples * 2 bytes */
-                const switch_size_t warmup_threshold = l16_frame_size * 5; /* 100ms warmup */
-                
-                /* Warmup: wait until we have enough buffer */
-                if (!tech_pvt->playback_active && available >= warmup_threshold) {
-                    tech_pvt->playback_active = 1;
-                    switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO,
-                        "🔊 Streaming started (buffer: %zu bytes)\n", available);
-                }
-                
-                if (tech_pvt->playback_active && available >= l16_frame_size) {
-                    /* Read L16 audio from buffer */
-                    int16_t l16_data[160];  /* 160 samples of L16 */
-                    uint8_t pcmu_data[160]; /* 160 bytes of PCMU */
-                    int i;
-                    
-                    switch_buffer_read(tech_pvt->playback_buffer, l16_data, l16_frame_size);
-                    
-                    /* Convert L16 to PCMU using FreeSWITCH's built-in function */
-                    for (i = 0; i < 160; i++) {
-                        pcmu_data[i] = linear_to_ulaw(l16_data[i]);
-                    }
-                    
-                    /* Get write codec (PCMU) */
-                    switch_codec_t *write_codec = switch_core_session_get_write_codec(session);
-                    
-                    if (write_codec) {
-                        switch_frame_t write_frame = { 0 };
-                        write_frame.data = pcmu_data;
-                        write_frame.datalen = 160;  /* PCMU: 160 bytes for 160 samples */
-                        write_frame.samples = 160;
-                        write_frame.rate = 8000;
-                        write_frame.codec = write_codec;
-                        
-                        switch_core_session_write_frame(session, &write_frame, SWITCH_IO_FLAG_NONE, 0);
-                    }
-                } else if (tech_pvt->playback_active && available == 0) {
-                    /* Buffer empty - pause playback */
-                    tech_pvt->playback_active = 0;
-                    switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG,
-                        "⏸️ Buffer empty, pausing\n");
-                }
-                
-                switch_mutex_unlock(tech_pvt->playback_mutex);
-            }
-            
-            return stream_frame(bug);
-            break;
+            /* NETPLAY v2.1: Inject playback audio during READ callback */
+            stream_playback_frame(bug);
+            ret = stream_frame(bug);
+            stream_latency_record(SM_HIST_CAPTURE_CALLBACK, &tech_pvt->stats->tick,
+                                  stream_metrics_now_ns() - tick_start, tech_pvt->stats->slow_ns);
+            return ret;
 
         case SWITCH_ABC_TYPE_WRITE:
             /* NETPLAY: Audio injection now happens in READ callback via switch_core_session_write_frame */
@@ -159,6 +84,7 @@ static switch_status_t start_capture(switch_core_session_t *session,
                                      char* wsUri,
                                      int sampling,
                                      int audio_format,
+                                     int reference,
                                      char* metadata)
 {
     switch_channel_t *channel = switch_core_session_get_channel(session);
@@ -167,11 +93,18 @@ static switch_status_t start_capture(switch_core_session_t *session,
     switch_codec_t* read_codec;
 
     void *pUserData = NULL;
-    int channels = (flags & SMBF_STEREO) ? 2 : 1;
-
-    if (switch_channel_get_private(channel, MY_BUG_NAME)) {
-        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "mod_audio_stream: bug already attached!\n");
-        return SWITCH_STATUS_FALSE;
+    /* reference reads the caller mono and adds the injected playback as the second channel */
+    int channels = (flags & SMBF_STEREO) || reference ? 2 : 1;
+
+    if ((bug = switch_channel_get_private(channel, MY_BUG_NAME))) {
+        /* already capturing: fan the same frames out to one more websocket instead of adding a second bug */
+        if (!switch_core_media_bug_test_flag(bug, SMBF_WRITE_STREAM) != !(flags & SMBF_WRITE_STREAM)) {
+            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
+                              "mod_audio_stream: bug already attached with a different mix type!\n");
+            return SWITCH_STATUS_FALSE;
+        }
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "calling stream_session_add_destination.\n");
+        return stream_session_add_destination(session, wsUri, sampling, channels, reference, audio_format, metadata);
     }
 
     if (switch_channel_pre_answer(channel) != SWITCH_STATUS_SUCCESS) {
@@ -185,6 +118,7 @@ static switch_status_t start_capture(switch_core_session_t *session,
     const char* format_name = "L16";
     if (audio_format == 1) format_name = "PCMU (G.711 μ-law)";
     else if (audio_format == 2) format_name = "PCMA (G.711 A-law)";
+    else if (audio_format == AUDIO_FORMAT_OPUS) format_name = "Opus";
     
     switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_NOTICE, 
         "[NETPLAY] Stream starting: format=%s, sampling=%dHz, channels=%d\n",
@@ -192,12 +126,14 @@ static switch_status_t start_capture(switch_core_session_t *session,
 
     switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "calling stream_session_init.\n");
     if (SWITCH_STATUS_FALSE == stream_session_init(session, responseHandler, read_codec->implementation->actual_samples_per_second,
-                                                 wsUri, sampling, channels, audio_format, metadata, &pUserData)) {
+                                                 wsUri, sampling, channels, reference, audio_format, metadata, &pUserData)) {
         switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "Error initializing mod_audio_stream session.\n");
         return SWITCH_STATUS_FALSE;
     }
     switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "adding bug.\n");
     if ((status = switch_core_media_bug_add(session, MY_BUG_NAME, NULL, capture_callback, pUserData, 0, flags, &bug)) != SWITCH_STATUS_SUCCESS) {
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "Error adding mod_audio_stream media bug.\n");
+        stream_session_abort(session, pUserData);
         return status;
     }
     switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "setting bug private data.\n");
@@ -247,7 +183,7 @@ static switch_status_t send_text(switch_core_session_t *session, char* text) {
     return status;
 }
 
-#define STREAM_API_SYNTAX "<uuid> [start | stop | send_text | pause | resume | graceful-shutdown ] [wss-url | path] [mono | mixed | stereo] [8000 | 16000] [l16 | pcmu | pcma] [metadata]"
+#define STREAM_API_SYNTAX "<uuid> [start | stop | send_text | pause | resume | stats | graceful-shutdown ] [wss-url | path] [mono | mixed | stereo | reference] [8000 | 16000] [l16 | pcmu | pcma | opus] [metadata]"
 SWITCH_STANDARD_API(stream_function)
 {
     char *mycmd = NULL, *argv[7] = { 0 };
@@ -280,6 +216,12 @@ SWITCH_STANDARD_API(stream_function)
                 status = do_pauseresume(lsession, 1);
             } else if (!strcasecmp(argv[1], "resume")) {
                 status = do_pauseresume(lsession, 0);
+            } else if (!strcasecmp(argv[1], "stats")) {
+                status = stream_session_stats(lsession, stream);
+                if (status == SWITCH_STATUS_SUCCESS) {
+                    switch_core_session_rwunlock(lsession);
+                    goto done;
+                }
             } else if (!strcasecmp(argv[1], "send_text")) {
                 if (argc < 3) {
                     switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
@@ -308,6 +250,7 @@ SWITCH_STANDARD_API(stream_function)
                  */
                 switch_media_bug_flag_t flags = SMBF_READ_STREAM | SMBF_WRITE_REPLACE;
                 char *metadata = NULL;
+                int reference = 0;
                 
                 /* Parse format parameter (argv[5]) and metadata (argv[6]) */
                 if (argc > 5) {
@@ -317,6 +260,9 @@ SWITCH_STANDARD_API(stream_function)
                     } else if (0 == strcasecmp(argv[5], "pcma") || 0 == strcasecmp(argv[5], "alaw")) {
                         audio_format = AUDIO_FORMAT_PCMA;
                         metadata = argc > 6 ? argv[6] : NULL;
+                    } else if (0 == strcasecmp(argv[5], "opus")) {
+                        audio_format = AUDIO_FORMAT_OPUS;
+                        metadata = argc > 6 ? argv[6] : NULL;
                     } else if (0 == strcasecmp(argv[5], "l16") || 0 == strcasecmp(argv[5], "linear") || 0 == strcasecmp(argv[5], "pcm")) {
                         audio_format = AUDIO_FORMAT_L16;
                         metadata = argc > 6 ? argv[6] : NULL;
@@ -337,9 +283,11 @@ SWITCH_STANDARD_API(stream_function)
                 } else if (0 == strcmp(argv[3], "stereo")) {
                     flags |= SMBF_WRITE_STREAM;
                     flags |= SMBF_STEREO;
+                } else if (0 == strcmp(argv[3], "reference")) {
+                    reference = 1;
                 } else if (0 != strcmp(argv[3], "mono")) {
                     switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
-                                      "invalid mix type: %s, must be mono, mixed, or stereo\n", argv[3]);
+                                      "invalid mix type: %s, must be mono, mixed, stereo, or reference\n", argv[3]);
                     switch_core_session_rwunlock(lsession);
                     goto done;
                 }
@@ -358,11 +306,15 @@ SWITCH_STANDARD_API(stream_function)
                 } else if (sampling % 8000 != 0) {
                     switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
                                       "invalid sample rate: %s\n", argv[4]);
-                } else if (audio_format != AUDIO_FORMAT_L16 && sampling != 8000) {
+                } else if ((audio_format == AUDIO_FORMAT_PCMU || audio_format == AUDIO_FORMAT_PCMA) && sampling != 8000) {
                     switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
                                       "G.711 (pcmu/pcma) only supports 8000 Hz sample rate\n");
+                } else if (audio_format == AUDIO_FORMAT_OPUS && sampling != 8000 && sampling != 16000 &&
+                           sampling != 24000 && sampling != 48000) {
+                    switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
+                                      "Opus only supports 8000, 16000, 24000 and 48000 Hz sample rates\n");
                 } else {
-                    status = start_capture(lsession, flags, wsUri, sampling, audio_format, metadata);
+                    status = start_capture(lsession, flags, wsUri, sampling, audio_format, reference, metadata);
                 }
             } else {
                 switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
@@ -386,6 +338,91 @@ done:
     return SWITCH_STATUS_SUCCESS;
 }
 
+#define METRICS_API_SYNTAX "[stats | cache | textfile <path> [interval-seconds] | textfile off]"
+SWITCH_STANDARD_API(metrics_function)
+{
+    char *mycmd = NULL, *argv[3] = { 0 };
+    int argc = 0;
+
+    if (!zstr(cmd) && (mycmd = strdup(cmd))) {
+        argc = switch_separate_string(mycmd, ' ', argv, (sizeof(argv) / sizeof(argv[0])));
+    }
+
+    if (argc == 0) {
+        stream_metrics_render(stream);
+    } else if (!strcasecmp(argv[0], "stats")) {
+        cJSON *json = stream_metrics_summary();
+        char *json_str = cJSON_PrintUnformatted(json);
+        stream->write_function(stream, "%s\n", json_str);
+        cJSON_Delete(json);
+        switch_safe_free(json_str);
+    } else if (!strcasecmp(argv[0], "cache")) {
+        cJSON *json = audio_cache_stats();
+        char *json_str = cJSON_PrintUnformatted(json);
+        stream->write_function(stream, "%s\n", json_str);
+        cJSON_Delete(json);
+        switch_safe_free(json_str);
+    } else if (!strcasecmp(argv[0], "textfile") && argc > 1) {
+        switch_mutex_lock(globals.mutex);
+        switch_safe_free(globals.metrics_file);
+        if (strcasecmp(argv[1], "off")) {
+            globals.metrics_file = strdup(argv[1]);
+            globals.metrics_interval = argc > 2 && atoi(argv[2]) > 0 ? atoi(argv[2]) : METRICS_DEFAULT_INTERVAL;
+            stream->write_function(stream, "+OK writing %s every %ds\n", globals.metrics_file, globals.metrics_interval);
+        } else {
+            stream->write_function(stream, "+OK textfile disabled\n");
+        }
+        switch_mutex_unlock(globals.mutex);
+    } else {
+        stream->write_function(stream, "-USAGE: %s\n", METRICS_API_SYNTAX);
+    }
+
+    switch_safe_free(mycmd);
+    return SWITCH_STATUS_SUCCESS;
+}
+
+#define PROMPTS_API_SYNTAX "[reload [<dir>]]"
+SWITCH_STANDARD_API(prompts_function)
+{
+    char *mycmd = NULL, *argv[2] = { 0 };
+    int argc = 0;
+
+    if (!zstr(cmd) && (mycmd = strdup(cmd))) {
+        argc = switch_separate_string(mycmd, ' ', argv, (sizeof(argv) / sizeof(argv[0])));
+    }
+
+    if (argc == 0) {
+        cJSON *json = prompt_library_stats();
+        char *json_str = cJSON_PrintUnformatted(json);
+        stream->write_function(stream, "%s\n", json_str);
+        cJSON_Delete(json);
+        switch_safe_free(json_str);
+    } else if (!strcasecmp(argv[0], "reload")) {
+        /* calls keep playing what they started from the old files; new playLocal use the new index */
+        switch_mutex_lock(globals.mutex);
+        if (argc > 1) {
+            switch_safe_free(globals.prompt_dir);
+            globals.prompt_dir = strdup(argv[1]);
+        }
+        if (!globals.prompt_dir) {
+            stream->write_function(stream, "-ERR no prompt dir, set audio_stream_prompt_dir or give one\n");
+        } else {
+            int found = prompt_library_load(globals.prompt_dir);
+            if (found < 0) {
+                stream->write_function(stream, "-ERR cannot read %s\n", globals.prompt_dir);
+            } else {
+                stream->write_function(stream, "+OK %d prompts in %s\n", found, globals.prompt_dir);
+            }
+        }
+        switch_mutex_unlock(globals.mutex);
+    } else {
+        stream->write_function(stream, "-USAGE: %s\n", PROMPTS_API_SYNTAX);
+    }
+
+    switch_safe_free(mycmd);
+    return SWITCH_STATUS_SUCCESS;
+}
+
 /* ========================================
  * NETPLAY FORK - G.711 Native + Streaming Playback
  * Version: 2.1.0-netplay
@@ -420,21 +457,62 @@ SWITCH_MODULE_LOAD_FUNCTION(mod_audio_stream_load)
     /* connect my internal structure to the blank pointer passed to me */
     *module_interface = switch_loadable_module_create_module_interface(pool, modname);
 
+    memset(&globals, 0, sizeof(globals));
+    switch_mutex_init(&globals.mutex, SWITCH_MUTEX_NESTED, pool);
+    switch_mutex_init(&globals.textfile_mutex, SWITCH_MUTEX_NESTED, pool);
+    if (stream_metrics_init() != SWITCH_STATUS_SUCCESS) {
+        return SWITCH_STATUS_TERM;
+    }
+    json_arena_init();
+    {
+        /* optional: <X-PRE-PROCESS cmd="set" data="audio_stream_metrics_file=/var/lib/node_exporter/mod_audio_stream.prom"/> */
+        const char *metrics_file = switch_core_get_variable("audio_stream_metrics_file");
+        const char *metrics_interval = switch_core_get_variable("audio_stream_metrics_interval");
+        if (!zstr(metrics_file)) {
+            globals.metrics_file = strdup(metrics_file);
+        }
+        globals.metrics_interval = metrics_interval && atoi(metrics_interval) > 0 ? atoi(metrics_interval) : METRICS_DEFAULT_INTERVAL;
+    }
+    {
+        /* optional: <X-PRE-PROCESS cmd="set" data="audio_stream_cache_mb=256"/>, 0 disables cacheAudio */
+        const char *cache_mb = switch_core_get_variable("audio_stream_cache_mb");
+        audio_cache_init((size_t)(cache_mb && atoi(cache_mb) >= 0 ? atoi(cache_mb) : CACHE_DEFAULT_MB) << 20);
+    }
+    {
+        /* optional: <X-PRE-PROCESS cmd="set" data="audio_stream_prompt_dir=$${sounds_dir}/netplay"/>, files mapped on first play */
+        const char *prompt_dir = switch_core_get_variable("audio_stream_prompt_dir");
+        if (!zstr(prompt_dir)) {
+            globals.prompt_dir = strdup(prompt_dir);
+            prompt_library_load(globals.prompt_dir);
+        }
+    }
+    globals.running = 1;
+
     /* create/register custom event message types */
     if (switch_event_reserve_subclass(EVENT_JSON) != SWITCH_STATUS_SUCCESS ||
         switch_event_reserve_subclass(EVENT_CONNECT) != SWITCH_STATUS_SUCCESS ||
         switch_event_reserve_subclass(EVENT_ERROR) != SWITCH_STATUS_SUCCESS ||
-        switch_event_reserve_subclass(EVENT_DISCONNECT) != SWITCH_STATUS_SUCCESS) {
+        switch_event_reserve_subclass(EVENT_DISCONNECT) != SWITCH_STATUS_SUCCESS ||
+        switch_event_reserve_subclass(EVENT_LATENCY) != SWITCH_STATUS_SUCCESS ||
+        switch_event_reserve_subclass(EVENT_SEGMENT_START) != SWITCH_STATUS_SUCCESS ||
+        switch_event_reserve_subclass(EVENT_SEGMENT_STOP) != SWITCH_STATUS_SUCCESS) {
         switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Couldn't register an event subclass for mod_audio_stream API.\n");
         return SWITCH_STATUS_TERM;
     }
     SWITCH_ADD_API(api_interface, "uuid_audio_stream", "audio_stream API", stream_function, STREAM_API_SYNTAX);
+    SWITCH_ADD_API(api_interface, "audio_stream_metrics", "audio_stream module metrics (Prometheus text format)", metrics_function, METRICS_API_SYNTAX);
+    SWITCH_ADD_API(api_interface, "audio_stream_prompts", "audio_stream playLocal prompt library", prompts_function, PROMPTS_API_SYNTAX);
     switch_console_set_complete("add uuid_audio_stream ::console::list_uuid start wss-url metadata");
     switch_console_set_complete("add uuid_audio_stream ::console::list_uuid start wss-url");
     switch_console_set_complete("add uuid_audio_stream ::console::list_uuid stop");
     switch_console_set_complete("add uuid_audio_stream ::console::list_uuid pause");
     switch_console_set_complete("add uuid_audio_stream ::console::list_uuid resume");
     switch_console_set_complete("add uuid_audio_stream ::console::list_uuid send_text");
+    switch_console_set_complete("add uuid_audio_stream ::console::list_uuid stats");
+    switch_console_set_complete("add audio_stream_metrics stats");
+    switch_console_set_complete("add audio_stream_metrics cache");
+    switch_console_set_complete("add audio_stream_metrics textfile");
+    switch_console_set_complete("add audio_stream_prompts reload");
 
     switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "mod_audio_stream API successfully loaded\n");
 
@@ -447,10 +525,60 @@ SWITCH_MODULE_LOAD_FUNCTION(mod_audio_stream_load)
   Macro expands to: switch_status_t mod_audio_stream_shutdown() */
 SWITCH_MODULE_SHUTDOWN_FUNCTION(mod_audio_stream_shutdown)
 {
+    /* stop the textfile writer before the shards go away */
+    switch_mutex_lock(globals.mutex);
+    globals.running = 0;
+    switch_safe_free(globals.metrics_file);
+    switch_safe_free(globals.prompt_dir);
+    switch_mutex_unlock(globals.mutex);
+    switch_mutex_lock(globals.textfile_mutex);
+    switch_mutex_unlock(globals.textfile_mutex);
+    stream_metrics_shutdown();
+    json_arena_shutdown();
+    audio_cache_shutdown();
+    prompt_library_shutdown();
+
     switch_event_free_subclass(EVENT_JSON);
     switch_event_free_subclass(EVENT_CONNECT);
     switch_event_free_subclass(EVENT_DISCONNECT);
     switch_event_free_subclass(EVENT_ERROR);
+    switch_event_free_subclass(EVENT_LATENCY);
+    switch_event_free_subclass(EVENT_SEGMENT_START);
+    switch_event_free_subclass(EVENT_SEGMENT_STOP);
 
     return SWITCH_STATUS_SUCCESS;
 }
+
+/*
+  Periodic Prometheus textfile writer, a no-op unless audio_stream_metrics_file is set
+  Macro expands to: switch_status_t mod_audio_stream_runtime() */
+SWITCH_MODULE_RUNTIME_FUNCTION(mod_audio_stream_runtime)
+{
+    switch_time_t next_write = 0;
+
+    for (;;) {
+        char *metrics_file = NULL;
+
+        /* the path is copied out: a slow filesystem must not hold up the API commands sharing the mutex */
+        switch_mutex_lock(globals.textfile_mutex);
+        switch_mutex_lock(globals.mutex);
+        if (!globals.running) {
+            switch_mutex_unlock(globals.mutex);
+            switch_mutex_unlock(globals.textfile_mutex);
+            break;
+        }
+        if (globals.metrics_file && switch_micro_time_now() >= next_write) {
+            metrics_file = strdup(globals.metrics_file);
+            next_write = switch_micro_time_now() + (switch_time_t)globals.metrics_interval * 1000000;
+        }
+        switch_mutex_unlock(globals.mutex);
+        if (metrics_file) {
+            stream_metrics_write_textfile(metrics_file);
+            free(metrics_file);
+        }
+        switch_mutex_unlock(globals.textfile_mutex);
+        switch_yield(500000);
+    }
+
+    return SWITCH_STATUS_TERM;
+}
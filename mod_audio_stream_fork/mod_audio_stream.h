@@ -3,9 +3,11 @@
 
 #include <switch.h>
 #include <speex/speex_resampler.h>
+#include <speex/speex_echo.h>
+#include <speex/speex_preprocess.h>
+#include "stream_metrics.h"
 
 #define MY_BUG_NAME "audio_stream"
-#define MAX_SESSION_ID (256)
 #define MAX_WS_URI (4096)
 #define MAX_METADATA_LEN (8192)
 
@@ -14,40 +16,324 @@
 #define EVENT_ERROR             "mod_audio_stream::error"
 #define EVENT_JSON              "mod_audio_stream::json"
 #define EVENT_PLAY              "mod_audio_stream::play"
+#define EVENT_LATENCY           "mod_audio_stream::latency"
+#define EVENT_SEGMENT_START     "mod_audio_stream::segment_start"
+#define EVENT_SEGMENT_STOP      "mod_audio_stream::segment_stop"
+
+#define MAX_PENDING_MARKS 8
+#define MAX_DESTINATIONS 8      /* websocket destinations fed by one capture, see stream_session_add_destination */
 
 /* Audio format types */
 #define AUDIO_FORMAT_L16    0   /* Linear PCM 16-bit (default) */
 #define AUDIO_FORMAT_PCMU   1   /* G.711 µ-law */
 #define AUDIO_FORMAT_PCMA   2   /* G.711 A-law */
+#define AUDIO_FORMAT_OPUS   3   /* Opus, only in builds with libopus (HAVE_OPUS) */
+
+/* Per-session counters, read by "uuid_audio_stream <uuid> stats" */
+typedef struct stream_stats {
+    lat_hist_t tick;            /* READ callback: playback injection + stream_frame (media thread) */
+    lat_hist_t message;         /* processMessage (websocket thread) */
+    lat_hist_t round_trip;      /* mark sent -> response audio injected */
+    lat_hist_t aec;             /* STREAM_AEC: echo cancellation of one captured frame */
+    lat_hist_t preprocess;      /* STREAM_DENOISE/STREAM_AGC: preprocessing of one captured frame */
+    uint64_t slow_ns;           /* STREAM_SLOW_TICK_US */
+    uint64_t last_network_ns;   /* last completed turn, see stream_mark_t */
+    int64_t last_server_ns;
+    uint64_t last_playout_ns;
+    uint64_t skipped_ticks;     /* READ ticks whose caller audio was not streamed (not connected, closing) */
+    uint64_t vad_frames;        /* STREAM_VAD: frames classified */
+    uint64_t vad_suppressed;    /* STREAM_VAD: frames not streamed as silence */
+    uint64_t playback_underruns;    /* playing ticks with less than a frame buffered */
+    uint64_t playback_overruns;     /* streamAudio chunks that pushed the oldest playback out */
+} stream_stats_t;
+
+/* A mark echoed by the server, waiting for the audio that follows it to be played */
+typedef struct stream_mark {
+    uint32_t seq;
+    uint64_t sent_ns;           /* module clock when the mark left stream_frame (echoed back as "ts") */
+    uint64_t echo_ns;           /* module clock when the echo arrived */
+    int64_t server_ns;          /* server processing time (sendTs - recvTs), -1 when not reported */
+    uint64_t position;          /* playback byte position of the first sample after the mark */
+} stream_mark_t;
+
+/*
+ * stream_frame working buffers, carved from one cache-aligned pool block at init and
+ * sized for this call's rates, channels and STREAM_BUFFER_SIZE. Unused parts are NULL/0.
+ */
+typedef struct stream_scratch {
+    uint8_t *frame;             /* media bug read target, SWITCH_RECOMMENDED_BUFFER_SIZE as the core expects */
+    int16_t *resampled;         /* resampler output, resampled_frames per channel */
+    uint8_t *packet;            /* STREAM_BUFFER_SIZE > 20ms: the message being filled, packet_len bytes of L16 */
+    uint8_t *g711;              /* G.711 output, g711_len bytes */
+    int16_t *far;               /* mix-type reference: playback at the read rate, far_frames samples */
+    struct stream_reference *reference;  /* STREAM_AEC or mix-type reference */
+    struct stream_opus *opus;   /* audio format opus */
+    struct stream_drift *drift; /* STREAM_PLAYBACK_DRIFT */
+    struct stream_wsola *wsola; /* STREAM_PLAYBACK_CATCHUP */
+    struct stream_report *report;   /* STREAM_PLAYBACK_STATUS_MS or STREAM_PLAYBACK_ACKS */
+    struct stream_queue *queue; /* streamAudio utterances in the playback buffer */
+    uint32_t resampled_frames;
+    uint32_t packet_len;
+    uint32_t packet_fill;       /* encoded bytes in packet */
+    uint32_t g711_len;
+    uint32_t far_frames;
+} stream_scratch_t;
+
+/* STREAM_VAD state, touched only by the media thread (see vad_gate) */
+typedef struct stream_vad {
+    uint64_t threshold;         /* mean square amplitude of a speech frame, from STREAM_VAD_THRESHOLD */
+    uint32_t rate;              /* capture rate and channels of the classified frames */
+    uint32_t channels;
+    uint32_t hangover_samples;  /* keep streaming this long after the last speech frame */
+    uint32_t hang_left;
+    uint32_t pending_samples;   /* suppressed and not yet reported in a silence message, pre-roll included */
+    int active;                 /* streaming: speech or hangover */
+    uint8_t *preroll;           /* ring of the latest suppressed audio, replayed at speech onset */
+    uint32_t preroll_len;
+    uint32_t preroll_head;
+    uint32_t preroll_fill;
+} stream_vad_t;
+
+#define STREAM_REF_FRAME      80    /* 10ms at 8kHz, divides every ptime the media bug hands out */
+#define STREAM_REF_SLOTS      16
+
+/*
+ * Playback injected on each READ tick, waiting for the captured audio it is paired with: the
+ * far-end reference of STREAM_AEC and channel 1 of mix-type reference. Media thread only.
+ */
+typedef struct stream_reference {
+    SpeexResamplerState *resampler;     /* 8kHz playback to the read rate, NULL at 8kHz */
+    uint32_t rate;              /* read rate */
+    uint32_t head;              /* oldest slot */
+    uint32_t count;
+    int16_t slots[STREAM_REF_SLOTS][STREAM_REF_FRAME];
+    int16_t silence[STREAM_REF_FRAME];
+} stream_reference_t;
+
+/* Capture clean-up state (see dsp_filter), runs on 10ms blocks of the mono capture */
+typedef struct stream_dsp {
+    SpeexEchoState *echo;               /* STREAM_AEC, 8kHz only */
+    SpeexPreprocessState *preprocess;   /* STREAM_DENOISE and/or STREAM_AGC */
+    uint32_t block;             /* samples per 10ms at the read rate */
+    int16_t out[STREAM_REF_FRAME];
+} stream_dsp_t;
+
+#define STREAM_OPUS_FRAMES_MAX  6       /* 20ms frames in one Opus packet, 120ms is the longest Opus allows */
+#define STREAM_OPUS_PACKET_MAX  4000    /* libopus' recommended output size for any packet */
+
+/*
+ * audio format opus: captured audio is collected until it spans STREAM_BUFFER_SIZE (20ms frames, at most
+ * STREAM_OPUS_FRAMES_MAX of them) and then encoded as one Opus packet per websocket message. Media thread only.
+ */
+typedef struct stream_opus {
+    struct OpusEncoder *encoder;    /* carved from the session pool, nothing to destroy */
+    int16_t *pcm;               /* the packet being collected, frame_samples per channel */
+    uint32_t frame_samples;
+    uint32_t channels;
+    uint32_t pcm_fill;          /* bytes in pcm */
+    uint8_t packet[STREAM_OPUS_PACKET_MAX];
+} stream_opus_t;
+
+#define STREAM_DRIFT_MAX_PPM    5000    /* largest playback rate correction, 0.5%: no audible pitch change */
+#define STREAM_DRIFT_IN_MAX     168     /* playback samples offered to the resampler per 20ms frame, enough at +0.5% */
+
+/*
+ * STREAM_PLAYBACK_DRIFT: the server produces audio on its own clock and the READ tick consumes it on ours.
+ * The smoothed playback buffer depth is steered back to target by playing a few ppm faster or slower
+ * through a Speex resampler, instead of letting the buffer creep up to its cap or run dry. Media thread only;
+ * depth_q8 and ppm are also read, relaxed, by stats.
+ */
+typedef struct stream_drift {
+    SpeexResamplerState *resampler;     /* 8kHz to 8kHz at (1000000 + ppm) / 1000000 */
+    uint32_t target;            /* samples, STREAM_PLAYBACK_TARGET_MS */
+    int primed;                 /* depth_q8 holds a value: set on the first tick of each playback */
+    int64_t depth_q8;           /* smoothed depth in samples, 8 fractional bits */
+    int32_t ppm;                /* current correction, positive plays faster */
+    int16_t in[STREAM_DRIFT_IN_MAX];
+} stream_drift_t;
+
+#define STREAM_WSOLA_HOP        80      /* 10ms at 8kHz: output per step, half of the crossfade window */
+#define STREAM_WSOLA_SEEK       40      /* samples searched either side of the nominal position, 10ms in all */
+#define STREAM_WSOLA_SKIP_MAX   12      /* input skipped per step at full speed: 92 for 80 samples, 1.15x */
+#define STREAM_WSOLA_IN_MAX     (2 * STREAM_WSOLA_HOP + 2 * STREAM_WSOLA_SEEK + STREAM_WSOLA_SKIP_MAX)
+/* input a 20ms frame can reach: each step peeks IN_MAX ahead of what the previous ones took, and takes no more */
+#define STREAM_WSOLA_FRAME_REACH (160 / STREAM_WSOLA_HOP * STREAM_WSOLA_IN_MAX)
+
+/*
+ * STREAM_PLAYBACK_CATCHUP: once the playback backlog passes threshold it is played faster, without changing the
+ * pitch, until it is back at target. WSOLA: each 10ms step crossfades into the input segment near the nominal
+ * (sped up) position that best continues the waveform, so whole pitch periods are skipped. Media thread only;
+ * active, episodes and saved are also read, relaxed, by stats.
+ */
+typedef struct stream_wsola {
+    uint32_t target;            /* samples, STREAM_PLAYBACK_TARGET_MS */
+    uint32_t threshold;         /* samples, STREAM_PLAYBACK_CATCHUP_MS */
+    int active;
+    uint32_t skip;              /* extra input per step at the current speed, 1..STREAM_WSOLA_SKIP_MAX */
+    int32_t lead;               /* nominal position ahead of the natural continuation, samples */
+    uint64_t episodes;          /* times the backlog crossed threshold */
+    uint64_t saved;             /* samples of backlog played off by compression */
+    float fade[STREAM_WSOLA_HOP];   /* rising half of a Hann window; the falling half is 1 - fade */
+    int16_t in[STREAM_WSOLA_IN_MAX];
+} stream_wsola_t;
+
+#define STREAM_CHUNK_ID_MAX     48      /* streamAudio "id" as JSON text with its NUL: a quoted UUID fits */
+#define STREAM_CHUNKS_MAX       128     /* chunks waiting for their ack, 2.5s of 20ms chunks */
+#define STREAM_ACKS_PER_TICK    8
+
+/* A streamAudio chunk that carried an id, acknowledged once its last sample has been played */
+typedef struct stream_chunk {
+    uint64_t start;             /* playback byte positions of its first sample and of the one after its last */
+    uint64_t end;
+    uint64_t skipped;           /* bytes of it discarded on overrun */
+    uint64_t heard;             /* stopAudio: bytes played before it was cut, see interrupted */
+    void *origin;               /* AudioStreamer it came from: the ack goes back on that connection */
+    int interrupted;
+    char id[STREAM_CHUNK_ID_MAX];   /* echoed back verbatim: a quoted string or a number */
+} stream_chunk_t;
+
+/*
+ * Playback reporting back to the server: a playbackStatus message every STREAM_PLAYBACK_STATUS_MS and,
+ * with STREAM_PLAYBACK_ACKS, a playbackAck per chunk id. The chunk queue is under playback_mutex; acks and
+ * status are only ever sent from the media thread.
+ */
+typedef struct stream_report {
+    uint64_t status_interval_ns;    /* 0 disables playbackStatus */
+    uint64_t next_status_ns;
+    uint64_t injected;          /* bytes of playback actually written to the call */
+    int acks;                   /* STREAM_PLAYBACK_ACKS */
+    uint32_t chunks_head;
+    uint32_t chunks_count;
+    stream_chunk_t chunks[STREAM_CHUNKS_MAX];
+} stream_report_t;
+
+#define STREAM_UTTERANCE_MAX    48      /* streamAudio "utterance" with its NUL */
+#define STREAM_SEGMENTS_MAX     32
+#define STREAM_SEGMENT_EVENTS_PER_TICK  8
+
+/*
+ * A run of consecutive streamAudio chunks with the same "utterance" in the playback buffer. Audio is stored as 8kHz
+ * L16 whatever it arrived as, so a segment is only a range of playback positions: cancelling one marks it, and the
+ * media thread tosses its audio when playback reaches it.
+ */
+typedef struct stream_segment {
+    uint64_t start;             /* playback byte positions of its first sample and of the one after its last */
+    uint64_t end;
+    uint64_t skipped;           /* bytes of it discarded on overrun */
+    uint64_t heard;             /* cancelled: bytes played before the cut */
+    int cancelled;
+    int started;                /* segment_start fired */
+    int opus;                   /* audioDataType it arrived as */
+    char id[STREAM_UTTERANCE_MAX];  /* "" for audio without an utterance: queued and cancellable, no events */
+} stream_segment_t;
+
+#define STREAM_FEEDS_MAX        16
+#define STREAM_FEED_HELD_MAX    (30 * 16000)    /* streamAudio held behind a playing clip: 30s */
+
+/*
+ * Playback queued after the playback buffer, written into it a little at a time by the media thread: a clip is
+ * played from where it is stored (playCached) rather than copied whole into a 2 second buffer, and audio that
+ * arrives while one is still being fed waits its turn here. Positions carry on from the buffer's.
+ */
+typedef enum {
+    STREAM_FEED_L16,
+    STREAM_FEED_PCMU,           /* 8kHz G.711, decoded as it is written into the playback buffer */
+    STREAM_FEED_PCMA
+} stream_feed_format_t;
+
+typedef struct stream_feed {
+    const uint8_t *data;        /* 8kHz, in format */
+    size_t len;                 /* as L16 bytes, like every playback position */
+    size_t offset;              /* L16 bytes already in the playback buffer or skipped */
+    void *ref;                  /* keeps data alive until release(ref) */
+    void (*release)(void *ref);
+    stream_feed_format_t format;
+    size_t more;                /* L16 bytes chained after data (held streamAudio), reached through next */
+    int (*next)(struct stream_feed *feed);  /* moves data to the next chained block; 0 when there is none */
+} stream_feed_t;
+
+/* under playback_mutex */
+typedef struct stream_queue {
+    uint32_t head;
+    uint32_t count;
+    uint32_t cancelled;         /* cancelled segments still queued; while 0 playback reads straight through */
+    stream_segment_t segments[STREAM_SEGMENTS_MAX];
+    uint32_t feeds_head;
+    uint32_t feeds_count;
+    stream_feed_t feeds[STREAM_FEEDS_MAX];
+} stream_queue_t;
+
+struct private_data;
+
+/* stream_frame body for this call's resampling/packetizing/encoding, chosen once at init.
+ * streamer is the AudioStreamer the caller pinned for the duration of the call. */
+typedef void (*stream_frame_pipeline_t)(struct private_data *tech_pvt, void *streamer, switch_media_bug_t *bug);
 
 typedef void (*responseHandler_t)(switch_core_session_t* session, const char* eventName, const char* json);
 
+/*
+ * Per-session state, allocated zeroed from the session pool.
+ * The first part is what every READ tick touches (playback injection + stream_frame) and fits in
+ * two cache lines; configuration and strings sized to their content follow out of the way.
+ */
 struct private_data {
-    switch_mutex_t *mutex;
-    char sessionId[MAX_SESSION_ID];
+    void *pAudioStreamer;               /* pinned with streamer_refs, see acquire_streamer */
     SpeexResamplerState *resampler;
-    responseHandler_t responseHandler;
-    void *pAudioStreamer;
-    char ws_uri[MAX_WS_URI];
-    int sampling;
-    int channels;
+    switch_buffer_t *playback_buffer;  /* NETPLAY: Buffer for streaming playback */
+    switch_mutex_t *playback_mutex;    /* NETPLAY: Mutex for playback buffer */
+    stream_stats_t *stats;
+    stream_scratch_t *scratch;
+    stream_frame_pipeline_t pipeline;
+    stream_vad_t *vad;          /* NULL unless STREAM_VAD */
+    stream_dsp_t *dsp;          /* NULL unless STREAM_AEC, STREAM_DENOISE or STREAM_AGC */
+    uint32_t state;             /* STREAM_STATE_*, atomic */
+    uint32_t streamer_refs;     /* threads using pAudioStreamer, atomic */
     /* Bitfields grouped together for proper alignment */
-    int audio_paused:1;
-    int close_requested:1;
-    int cleanup_started:1;
     int codec_initialized:1;    /* Flag indicating if G.711 codec is initialized */
     int playback_active:1;      /* NETPLAY: Flag indicating playback is active */
-    char initialMetadata[8192];
-    switch_buffer_t *sbuffer;
-    switch_buffer_t *playback_buffer;  /* NETPLAY: Buffer for streaming playback */
-    switch_mutex_t *playback_mutex;    /* NETPLAY: Mutex for playback buffer */
+    uint64_t playback_played;   /* bytes ever consumed from playback_buffer, under playback_mutex */
+    uint64_t samples_sent;
+    uint64_t mark_interval_ns;  /* STREAM_MARK_INTERVAL_MS, 0 disables outbound marks */
+    uint64_t next_mark_ns;
+    int marks_head;
+    int marks_count;
+
+    /* cold: websocket thread, setup, logging, events */
+    uint64_t playback_written;  /* bytes ever queued into playback_buffer, under playback_mutex */
+    uint32_t mark_seq;
+    int sampling;
+    int channels;               /* channels, rtp_packets, audio_format and reference only pick the pipeline at init */
     int rtp_packets;
-    int audio_format;           /* AUDIO_FORMAT_L16, AUDIO_FORMAT_PCMU, AUDIO_FORMAT_PCMA */
-    switch_codec_t write_codec; /* Codec for encoding L16 to PCMU/PCMA */
+    int audio_format;           /* AUDIO_FORMAT_L16, AUDIO_FORMAT_PCMU, AUDIO_FORMAT_PCMA, AUDIO_FORMAT_OPUS */
+    int reference;              /* mix-type reference: mono capture streamed with the playback on channel 1 */
+    responseHandler_t responseHandler;
+    char *sessionId;
+    char *ws_uri;
+    char *initialMetadata;      /* NULL when no metadata was given */
+    stream_mark_t marks[MAX_PENDING_MARKS];
+    switch_codec_t write_codec; /* Codec for encoding L16 to PCMU/PCMA (per tick, but only for G.711 streams) */
 };
 
 typedef struct private_data private_t;
 
+/* Session state, changed by control operations and read without locks on the media thread */
+#define STREAM_STATE_PAUSED          (1u << 0)
+#define STREAM_STATE_CLOSE_REQUESTED (1u << 1)  /* the module closed the bug itself (connect error) */
+#define STREAM_STATE_CLEANUP         (1u << 2)  /* stream_session_cleanup started, the streamer is going away */
+
+static inline int stream_state_test(private_t *tech_pvt, uint32_t flags) {
+    return (__atomic_load_n(&tech_pvt->state, __ATOMIC_SEQ_CST) & flags) != 0;
+}
+
+/* returns the previous state */
+static inline uint32_t stream_state_set(private_t *tech_pvt, uint32_t flags) {
+    return __atomic_fetch_or(&tech_pvt->state, flags, __ATOMIC_SEQ_CST);
+}
+
+static inline void stream_state_clear(private_t *tech_pvt, uint32_t flags) {
+    __atomic_fetch_and(&tech_pvt->state, ~flags, __ATOMIC_SEQ_CST);
+}
+
 enum notifyEvent_t {
     CONNECT_SUCCESS,
     CONNECT_ERROR,
@@ -0,0 +1,178 @@
+#include "prompt_library.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <dirent.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+    struct library_prompt : prompt_t {
+        std::atomic<int> refs{1};       /* the index's own, plus one per call playing it */
+        std::string path;
+        void *map = nullptr;            /* until first played */
+        size_t map_len = 0;
+
+        ~library_prompt() {
+            if (map) munmap(map, map_len);
+        }
+    };
+
+    struct library {
+        std::mutex mutex;
+        std::string dir;
+        std::unordered_map<std::string, library_prompt *> index;
+    };
+
+    library lib;
+
+    void unref(const library_prompt *prompt) {
+        auto *p = const_cast<library_prompt *>(prompt);
+        if (p->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) delete p;
+    }
+
+    /* false for anything but the 8kHz formats playback takes as is or through a G.711 table */
+    bool format_of(const char *ext, prompt_format_t &format) {
+        if (!strcasecmp(ext, "sln") || !strcasecmp(ext, "l16") || !strcasecmp(ext, "raw")) {
+            format = PROMPT_L16;
+        } else if (!strcasecmp(ext, "ulaw") || !strcasecmp(ext, "pcmu")) {
+            format = PROMPT_PCMU;
+        } else if (!strcasecmp(ext, "alaw") || !strcasecmp(ext, "pcma")) {
+            format = PROMPT_PCMA;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    /*
+     * caller holds the mutex; maps on first use, the file is read in as playback reaches it. Shared, so a file
+     * truncated in place under a playing call faults the media thread: files are replaced by rename.
+     */
+    bool map(library_prompt *prompt) {
+        if (prompt->map) return true;
+        const int fd = open(prompt->path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "prompt %s: %s\n", prompt->path.c_str(), strerror(errno));
+            return false;
+        }
+        struct stat st;
+        void *map = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            map = mmap(nullptr, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (map == MAP_FAILED) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "prompt %s: cannot be mapped\n", prompt->path.c_str());
+            return false;
+        }
+        /* start reading it in now rather than faulting it in a page at a time on the media thread */
+        madvise(map, (size_t) st.st_size, MADV_WILLNEED);
+        prompt->map = map;
+        prompt->map_len = (size_t) st.st_size;
+        prompt->data = (const uint8_t *) map;
+        prompt->len = prompt->format == PROMPT_L16 ? prompt->map_len & ~(size_t) 1 : prompt->map_len;
+        return true;
+    }
+
+    void clear(std::unordered_map<std::string, library_prompt *> &index) {
+        for (auto &entry : index) unref(entry.second);
+        index.clear();
+    }
+}
+
+extern "C" {
+
+    int prompt_library_load(const char *dir) {
+        DIR *d = dir ? opendir(dir) : nullptr;
+        if (!d) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "prompt dir %s: %s\n", dir ? dir : "(none)", strerror(errno));
+            return -1;
+        }
+
+        /* scanned outside the lock: playLocal keeps using the old index meanwhile */
+        std::unordered_map<std::string, library_prompt *> index;
+        while (struct dirent *entry = readdir(d)) {
+            const char *dot = strrchr(entry->d_name, '.');
+            prompt_format_t format;
+            if (!dot || dot == entry->d_name || !format_of(dot + 1, format)) continue;
+
+            const std::string name(entry->d_name, dot - entry->d_name);
+            const std::string path = std::string(dir) + "/" + entry->d_name;
+            struct stat st;
+            if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "prompt %s: %s ignored, not a regular non-empty file\n",
+                                  name.c_str(), entry->d_name);
+                continue;
+            }
+            if (index.count(name)) {
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "prompt %s: %s ignored, name already taken\n",
+                                  name.c_str(), entry->d_name);
+                continue;
+            }
+            auto *prompt = new library_prompt();
+            prompt->path = path;
+            prompt->format = format;
+            prompt->data = nullptr;
+            prompt->len = 0;
+            index[name] = prompt;
+        }
+        closedir(d);
+
+        const int found = (int) index.size();
+        {
+            std::lock_guard<std::mutex> lock(lib.mutex);
+            lib.dir = dir;
+            lib.index.swap(index);
+        }
+        clear(index);
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "prompt dir %s: %d prompts\n", dir, found);
+        return found;
+    }
+
+    void prompt_library_shutdown(void) {
+        std::unordered_map<std::string, library_prompt *> index;
+        {
+            std::lock_guard<std::mutex> lock(lib.mutex);
+            lib.index.swap(index);
+            lib.dir.clear();
+        }
+        clear(index);
+    }
+
+    const prompt_t *prompt_library_get(const char *name) {
+        std::lock_guard<std::mutex> lock(lib.mutex);
+        auto found = lib.index.find(name);
+        if (found == lib.index.end() || !map(found->second)) return nullptr;
+        found->second->refs.fetch_add(1, std::memory_order_relaxed);
+        return found->second;
+    }
+
+    void prompt_library_release(const prompt_t *prompt) {
+        if (prompt) unref(static_cast<const library_prompt *>(prompt));
+    }
+
+    cJSON *prompt_library_stats(void) {
+        cJSON *json = cJSON_CreateObject();
+        std::lock_guard<std::mutex> lock(lib.mutex);
+        size_t mapped = 0, mapped_bytes = 0;
+        for (const auto &entry : lib.index) {
+            if (!entry.second->map) continue;
+            mapped++;
+            mapped_bytes += entry.second->map_len;
+        }
+        cJSON_AddStringToObject(json, "dir", lib.dir.c_str());
+        cJSON_AddNumberToObject(json, "prompts", (double) lib.index.size());
+        cJSON_AddNumberToObject(json, "mapped", (double) mapped);
+        cJSON_AddNumberToObject(json, "mapped_bytes", (double) mapped_bytes);
+        return json;
+    }
+}
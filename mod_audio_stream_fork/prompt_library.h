@@ -0,0 +1,58 @@
+#ifndef PROMPT_LIBRARY_H
+#define PROMPT_LIBRARY_H
+
+#include <switch.h>
+
+/*
+ * Read-only library of prompt files the server plays by name with playLocal.
+ *
+ * The directory (audio_stream_prompt_dir) is scanned into an index of names at
+ * load; a file is only mmap'd the first time it is played and then stays mapped,
+ * so its pages sit once in the page cache and are shared by every call playing
+ * it. Calls play straight from the mapping and hold a reference until the last
+ * sample is in their playback buffer: a reload swaps the index and the old
+ * mappings go away once no call is still playing them.
+ *
+ * The mapping reads the file itself, so a prompt must never be rewritten or
+ * truncated in place while calls may play it (a call touching a page past the new
+ * end takes SIGBUS): write the new file next to it, rename it over the old one and
+ * run `audio_stream_prompts reload`. Only regular, non-empty files are indexed.
+ *
+ * File name is <name>.<ext>, all 8kHz mono:
+ *   .sln .l16 .raw     L16, host byte order
+ *   .ulaw .pcmu        G.711 mu-law
+ *   .alaw .pcma        G.711 A-law
+ */
+
+typedef enum {
+    PROMPT_L16,
+    PROMPT_PCMU,
+    PROMPT_PCMA
+} prompt_format_t;
+
+typedef struct prompt {
+    const uint8_t *data;        /* the mapped file */
+    size_t len;                 /* bytes */
+    prompt_format_t format;
+} prompt_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* replaces the index with the prompts in dir; the number found, -1 when dir cannot be read (the index is kept) */
+int prompt_library_load(const char *dir);
+void prompt_library_shutdown(void);
+
+/* a reference to the mapped prompt, to be released; NULL when there is no such prompt or it cannot be mapped */
+const prompt_t *prompt_library_get(const char *name);
+void prompt_library_release(const prompt_t *prompt);
+
+/* {"dir","prompts","mapped","mapped_bytes"} */
+cJSON *prompt_library_stats(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //PROMPT_LIBRARY_H
@@ -0,0 +1,361 @@
+#include <atomic>
+#include <cstdio>
+#include <ctime>
+#include <new>
+#include <pthread.h>
+#include "stream_metrics.h"
+
+namespace {
+
+    struct alignas(64) metrics_shard {
+        std::atomic<uint64_t> counters[SM_COUNTER_MAX];
+        std::atomic<uint64_t> buckets[SM_HIST_MAX][LAT_HIST_BUCKETS];
+        std::atomic<uint64_t> sum_ns[SM_HIST_MAX];
+        std::atomic<uint64_t> max_ns[SM_HIST_MAX];
+        std::atomic<bool> owned;
+        metrics_shard *next;
+    };
+
+    struct metric_desc {
+        const char *name;
+        const char *type;
+        const char *help;
+    };
+
+    const metric_desc counter_desc[SM_COUNTER_MAX] = {
+        {"mod_audio_stream_streams_started_total", "counter", "Streams attached to a channel."},
+        {"mod_audio_stream_streams_stopped_total", "counter", "Streams cleaned up."},
+        {"mod_audio_stream_connects_total", "counter", "Successful websocket connections."},
+        {"mod_audio_stream_connect_errors_total", "counter", "Websocket connection errors."},
+        {"mod_audio_stream_connection_drops_total", "counter", "Websocket connections closed by the peer or the network."},
+        {"mod_audio_stream_messages_received_total", "counter", "Websocket messages received."},
+        {"mod_audio_stream_messages_sent_total", "counter", "Websocket messages sent (audio frames and text)."},
+        {"mod_audio_stream_bytes_received_total", "counter", "Websocket payload bytes received."},
+        {"mod_audio_stream_bytes_sent_total", "counter", "Websocket payload bytes sent."},
+        {"mod_audio_stream_playback_overruns_total", "counter", "streamAudio chunks that forced discarding of queued playback audio."},
+        {"mod_audio_stream_playback_underruns_total", "counter", "READ ticks with active playback but less than one frame buffered."},
+        {"mod_audio_stream_slow_ticks_total", "counter", "READ callbacks slower than the session STREAM_SLOW_TICK_US threshold."},
+        {"mod_audio_stream_slow_messages_total", "counter", "Inbound messages whose handling exceeded the session STREAM_SLOW_TICK_US threshold."},
+        {"mod_audio_stream_skipped_ticks_total", "counter", "READ ticks whose caller audio was left in the media bug (websocket not connected or stream closing)."},
+        {"mod_audio_stream_vad_frames_total", "counter", "Caller frames classified by STREAM_VAD."},
+        {"mod_audio_stream_vad_suppressed_frames_total", "counter", "Caller frames STREAM_VAD did not stream as silence."},
+        {"mod_audio_stream_cache_hits_total", "counter", "playCached requests served from the clip cache."},
+        {"mod_audio_stream_cache_misses_total", "counter", "playCached requests for a clip that was not cached."},
+        {"mod_audio_stream_cache_evictions_total", "counter", "Cached clips evicted to stay under the cache size."},
+    };
+
+    const metric_desc histogram_desc[SM_HIST_MAX] = {
+        {"mod_audio_stream_json_parse_seconds", "histogram", "Time spent parsing inbound websocket JSON."},
+        {"mod_audio_stream_base64_decode_seconds", "histogram", "Time spent decoding base64 audio payloads."},
+        {"mod_audio_stream_opus_decode_seconds", "histogram", "Time spent decoding Opus streamAudio packets to playback PCM."},
+        {"mod_audio_stream_capture_callback_seconds", "histogram", "Duration of the media bug READ callback (playback injection + stream_frame)."},
+        {"mod_audio_stream_process_message_seconds", "histogram", "Time spent handling one inbound websocket message."},
+        {"mod_audio_stream_round_trip_seconds", "histogram", "Caller audio leaving stream_frame to the response audio being injected, measured with marks."},
+        {"mod_audio_stream_aec_seconds", "histogram", "STREAM_AEC echo cancellation of one captured frame."},
+        {"mod_audio_stream_preprocess_seconds", "histogram", "STREAM_DENOISE/STREAM_AGC preprocessing of one captured frame."},
+    };
+
+    std::atomic<metrics_shard *> shard_list{nullptr};
+    pthread_key_t shard_key;
+    /* published after shard_key is written; media threads may still read it while shutdown clears it */
+    std::atomic<bool> shard_key_created{false};
+
+    /* thread exit: the shard keeps its values and is handed to the next thread that needs one */
+    void release_shard(void *p) {
+        static_cast<metrics_shard *>(p)->owned.store(false, std::memory_order_release);
+    }
+
+    metrics_shard *acquire_shard() {
+        for (metrics_shard *s = shard_list.load(std::memory_order_acquire); s; s = s->next) {
+            bool expected = false;
+            if (!s->owned.load(std::memory_order_relaxed) &&
+                s->owned.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+                return s;
+            }
+        }
+
+        /* C++11 operator new ignores alignas, so allocate the cache-line aligned block ourselves */
+        void *mem = nullptr;
+        if (posix_memalign(&mem, 64, sizeof(metrics_shard)) != 0) {
+            return nullptr;
+        }
+        auto *s = new (mem) metrics_shard();
+        for (auto &c : s->counters) c.store(0, std::memory_order_relaxed);
+        for (auto &h : s->buckets) for (auto &b : h) b.store(0, std::memory_order_relaxed);
+        for (auto &v : s->sum_ns) v.store(0, std::memory_order_relaxed);
+        for (auto &v : s->max_ns) v.store(0, std::memory_order_relaxed);
+        s->owned.store(true, std::memory_order_relaxed);
+
+        metrics_shard *head = shard_list.load(std::memory_order_relaxed);
+        do {
+            s->next = head;
+        } while (!shard_list.compare_exchange_weak(head, s, std::memory_order_release, std::memory_order_relaxed));
+        return s;
+    }
+
+    inline metrics_shard *local_shard() {
+        if (!shard_key_created.load(std::memory_order_acquire)) return nullptr;
+        auto *s = static_cast<metrics_shard *>(pthread_getspecific(shard_key));
+        if (!s) {
+            s = acquire_shard();
+            if (s) pthread_setspecific(shard_key, s);
+        }
+        return s;
+    }
+
+    /* single writer per shard: a plain load/store pair is enough, no locked RMW on the hot path */
+    inline void shard_add(std::atomic<uint64_t> &slot, uint64_t value) {
+        slot.store(slot.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    /* index = octave * 8 + top 4 bits of the value; octave 0 holds the first 16 units linearly */
+    inline int lat_hist_index(uint64_t ns) {
+        uint64_t v = ns >> LAT_HIST_UNIT_SHIFT;
+        const uint64_t max_units = 1ULL << (LAT_HIST_SUB_BITS + LAT_HIST_OCTAVES);
+        if (v >= max_units) v = max_units - 1;
+        const int octave = (63 - __builtin_clzll(v | (1ULL << LAT_HIST_SUB_BITS))) - LAT_HIST_SUB_BITS;
+        return (octave << LAT_HIST_SUB_BITS) + (int)(v >> octave);
+    }
+
+    /* exclusive upper bound of a bucket, in ns */
+    inline uint64_t lat_hist_upper_ns(int index) {
+        const int octave = index < (2 << LAT_HIST_SUB_BITS) ? 0 : (index >> LAT_HIST_SUB_BITS) - 1;
+        const uint64_t mantissa = (uint64_t)index - ((uint64_t)octave << LAT_HIST_SUB_BITS);
+        return ((mantissa + 1) << octave) << LAT_HIST_UNIT_SHIFT;
+    }
+
+    template <typename T>
+    uint64_t lat_hist_percentile(const T *counts, uint64_t total, uint64_t max_ns, double q) {
+        if (!total) return 0;
+        uint64_t target = (uint64_t)(q * (double)total + 0.999999);
+        if (target < 1) target = 1;
+        uint64_t cumulative = 0;
+        for (int i = 0; i < LAT_HIST_BUCKETS; i++) {
+            cumulative += counts[i];
+            if (cumulative >= target) {
+                const uint64_t upper = lat_hist_upper_ns(i);
+                return upper < max_ns ? upper : max_ns;
+            }
+        }
+        return max_ns;
+    }
+
+    template <typename T>
+    cJSON *lat_hist_json(const T *counts, uint64_t total, uint64_t sum_ns, uint64_t max_ns, uint64_t slow) {
+        cJSON *json = cJSON_CreateObject();
+        cJSON_AddNumberToObject(json, "count", (double)total);
+        cJSON_AddNumberToObject(json, "avg_us", total ? (double)sum_ns / (double)total / 1000.0 : 0.0);
+        cJSON_AddNumberToObject(json, "p50_us", (double)lat_hist_percentile(counts, total, max_ns, 0.50) / 1000.0);
+        cJSON_AddNumberToObject(json, "p99_us", (double)lat_hist_percentile(counts, total, max_ns, 0.99) / 1000.0);
+        cJSON_AddNumberToObject(json, "p999_us", (double)lat_hist_percentile(counts, total, max_ns, 0.999) / 1000.0);
+        cJSON_AddNumberToObject(json, "max_us", (double)max_ns / 1000.0);
+        cJSON_AddNumberToObject(json, "slow", (double)slow);
+        return json;
+    }
+
+    inline void relaxed_add(uint64_t *slot, uint64_t value) {
+        __atomic_store_n(slot, __atomic_load_n(slot, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+    }
+
+    struct merged_hist {
+        uint64_t counts[LAT_HIST_BUCKETS];
+        uint64_t total;
+        uint64_t sum_ns;
+        uint64_t max_ns;
+    };
+
+    void merge_histogram(int h, merged_hist &out) {
+        memset(&out, 0, sizeof(out));
+        for (metrics_shard *s = shard_list.load(std::memory_order_acquire); s; s = s->next) {
+            for (int b = 0; b < LAT_HIST_BUCKETS; b++) {
+                const uint64_t n = s->buckets[h][b].load(std::memory_order_relaxed);
+                out.counts[b] += n;
+                out.total += n;
+            }
+            out.sum_ns += s->sum_ns[h].load(std::memory_order_relaxed);
+            const uint64_t max_ns = s->max_ns[h].load(std::memory_order_relaxed);
+            if (max_ns > out.max_ns) out.max_ns = max_ns;
+        }
+    }
+
+    uint64_t sum_counter(int c) {
+        uint64_t total = 0;
+        for (metrics_shard *s = shard_list.load(std::memory_order_acquire); s; s = s->next) {
+            total += s->counters[c].load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    void write_header(switch_stream_handle_t *stream, const metric_desc &d) {
+        stream->write_function(stream, "# HELP %s %s\n# TYPE %s %s\n", d.name, d.help, d.name, d.type);
+    }
+}
+
+extern "C" {
+
+    switch_status_t stream_metrics_init(void) {
+        if (!shard_key_created.load(std::memory_order_acquire)) {
+            if (pthread_key_create(&shard_key, release_shard) != 0) {
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "stream_metrics_init: pthread_key_create failed\n");
+                return SWITCH_STATUS_FALSE;
+            }
+            shard_key_created.store(true, std::memory_order_release);
+        }
+        return SWITCH_STATUS_SUCCESS;
+    }
+
+    void stream_metrics_shutdown(void) {
+        if (shard_key_created.exchange(false, std::memory_order_acq_rel)) {
+            pthread_key_delete(shard_key);
+        }
+        metrics_shard *s = shard_list.exchange(nullptr, std::memory_order_acq_rel);
+        while (s) {
+            metrics_shard *next = s->next;
+            s->~metrics_shard();
+            free(s);
+            s = next;
+        }
+    }
+
+    uint64_t stream_metrics_now_ns(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+    }
+
+    void stream_metrics_add(stream_counter_t counter, uint64_t value) {
+        metrics_shard *s = local_shard();
+        if (s) shard_add(s->counters[counter], value);
+    }
+
+    void stream_metrics_observe(stream_histogram_t histogram, uint64_t ns) {
+        metrics_shard *s = local_shard();
+        if (!s) return;
+        shard_add(s->buckets[histogram][lat_hist_index(ns)], 1);
+        shard_add(s->sum_ns[histogram], ns);
+        if (ns > s->max_ns[histogram].load(std::memory_order_relaxed)) {
+            s->max_ns[histogram].store(ns, std::memory_order_relaxed);
+        }
+    }
+
+    void stream_latency_record(stream_histogram_t histogram, lat_hist_t *session_hist, uint64_t ns, uint64_t slow_ns) {
+        const bool slow = slow_ns && ns > slow_ns;
+
+        stream_metrics_observe(histogram, ns);
+        if (slow) {
+            stream_metrics_add(histogram == SM_HIST_PROCESS_MESSAGE ? SM_SLOW_MESSAGES : SM_SLOW_TICKS, 1);
+        }
+
+        if (session_hist) {
+            const int i = lat_hist_index(ns);
+            __atomic_store_n(&session_hist->counts[i], __atomic_load_n(&session_hist->counts[i], __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+            relaxed_add(&session_hist->count, 1);
+            relaxed_add(&session_hist->sum_ns, ns);
+            if (ns > __atomic_load_n(&session_hist->max_ns, __ATOMIC_RELAXED)) {
+                __atomic_store_n(&session_hist->max_ns, ns, __ATOMIC_RELAXED);
+            }
+            if (slow) relaxed_add(&session_hist->slow, 1);
+        }
+    }
+
+    uint64_t stream_metrics_counter(stream_counter_t counter) {
+        return sum_counter(counter);
+    }
+
+    cJSON *lat_hist_summary(const lat_hist_t *hist) {
+        uint32_t counts[LAT_HIST_BUCKETS];
+        uint64_t total = 0;
+        for (int i = 0; i < LAT_HIST_BUCKETS; i++) {
+            counts[i] = __atomic_load_n(&hist->counts[i], __ATOMIC_RELAXED);
+            total += counts[i];
+        }
+        return lat_hist_json(counts, total,
+                             __atomic_load_n(&hist->sum_ns, __ATOMIC_RELAXED),
+                             __atomic_load_n(&hist->max_ns, __ATOMIC_RELAXED),
+                             __atomic_load_n(&hist->slow, __ATOMIC_RELAXED));
+    }
+
+    cJSON *stream_metrics_summary(void) {
+        merged_hist merged;
+        cJSON *json = cJSON_CreateObject();
+
+        merge_histogram(SM_HIST_CAPTURE_CALLBACK, merged);
+        cJSON_AddItemToObject(json, "tick", lat_hist_json(merged.counts, merged.total, merged.sum_ns, merged.max_ns, sum_counter(SM_SLOW_TICKS)));
+        merge_histogram(SM_HIST_PROCESS_MESSAGE, merged);
+        cJSON_AddItemToObject(json, "message", lat_hist_json(merged.counts, merged.total, merged.sum_ns, merged.max_ns, sum_counter(SM_SLOW_MESSAGES)));
+        const uint64_t started = sum_counter(SM_STREAMS_STARTED);
+        const uint64_t stopped = sum_counter(SM_STREAMS_STOPPED);
+        cJSON_AddNumberToObject(json, "streams_active", (double)(started > stopped ? started - stopped : 0));
+        return json;
+    }
+
+    void stream_metrics_render(switch_stream_handle_t *stream) {
+        uint64_t counters[SM_COUNTER_MAX];
+        for (int c = 0; c < SM_COUNTER_MAX; c++) {
+            counters[c] = sum_counter(c);
+        }
+
+        const uint64_t started = counters[SM_STREAMS_STARTED];
+        const uint64_t stopped = counters[SM_STREAMS_STOPPED];
+        stream->write_function(stream,
+            "# HELP mod_audio_stream_streams_active Streams currently attached to a channel.\n"
+            "# TYPE mod_audio_stream_streams_active gauge\n"
+            "mod_audio_stream_streams_active %llu\n",
+            (unsigned long long)(started > stopped ? started - stopped : 0));
+
+        for (int c = 0; c < SM_COUNTER_MAX; c++) {
+            write_header(stream, counter_desc[c]);
+            stream->write_function(stream, "%s %llu\n", counter_desc[c].name, (unsigned long long)counters[c]);
+        }
+
+        merged_hist merged;
+        for (int h = 0; h < SM_HIST_MAX; h++) {
+            merge_histogram(h, merged);
+
+            const char *name = histogram_desc[h].name;
+            uint64_t cumulative = 0;
+            int b = 0;
+            write_header(stream, histogram_desc[h]);
+            for (int le = 0; le < SM_PROM_BUCKETS; le++) {
+                const uint64_t le_ns = 1ULL << (SM_PROM_FIRST_SHIFT + le);
+                while (b < LAT_HIST_BUCKETS && lat_hist_upper_ns(b) <= le_ns) {
+                    cumulative += merged.counts[b++];
+                }
+                stream->write_function(stream, "%s_bucket{le=\"%.9g\"} %llu\n", name, (double)le_ns / 1e9, (unsigned long long)cumulative);
+            }
+            stream->write_function(stream, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)merged.total);
+            stream->write_function(stream, "%s_sum %.9f\n", name, (double)merged.sum_ns / 1e9);
+            stream->write_function(stream, "%s_count %llu\n", name, (unsigned long long)merged.total);
+        }
+    }
+
+    switch_status_t stream_metrics_write_textfile(const char *path) {
+        switch_stream_handle_t stream = { 0 };
+        char tmp_path[1024];
+        switch_status_t status = SWITCH_STATUS_FALSE;
+
+        if (zstr(path) || snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int)sizeof(tmp_path)) {
+            return SWITCH_STATUS_FALSE;
+        }
+
+        SWITCH_STANDARD_STREAM(stream);
+        stream_metrics_render(&stream);
+
+        /* write + rename so node_exporter never picks up a half-written file */
+        FILE *fp = fopen(tmp_path, "w");
+        if (fp) {
+            const size_t len = strlen((const char *)stream.data);
+            const size_t written = fwrite(stream.data, 1, len, fp);
+            if (fclose(fp) == 0 && written == len) {
+                status = (rename(tmp_path, path) == 0) ? SWITCH_STATUS_SUCCESS : SWITCH_STATUS_FALSE;
+            }
+            if (status != SWITCH_STATUS_SUCCESS) remove(tmp_path);
+        }
+        if (status != SWITCH_STATUS_SUCCESS) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "stream_metrics: unable to write %s\n", path);
+        }
+
+        switch_safe_free(stream.data);
+        return status;
+    }
+}
@@ -0,0 +1,105 @@
+#ifndef STREAM_METRICS_H
+#define STREAM_METRICS_H
+
+#include <switch.h>
+
+/*
+ * Module-wide metrics.
+ *
+ * Every thread that records a metric gets its own shard (counters + histogram
+ * buckets). Writers only touch their own shard with relaxed atomics, so the
+ * media path never contends with other calls; readers walk all shards and sum
+ * them when rendering.
+ */
+
+typedef enum {
+    SM_STREAMS_STARTED,
+    SM_STREAMS_STOPPED,
+    SM_CONNECT_SUCCESS,
+    SM_CONNECT_ERROR,
+    SM_CONNECTION_DROPPED,
+    SM_MESSAGES_IN,
+    SM_MESSAGES_OUT,
+    SM_BYTES_IN,
+    SM_BYTES_OUT,
+    SM_PLAYBACK_OVERRUNS,
+    SM_PLAYBACK_UNDERRUNS,
+    SM_SLOW_TICKS,
+    SM_SLOW_MESSAGES,
+    SM_SKIPPED_TICKS,
+    SM_VAD_FRAMES,
+    SM_VAD_SUPPRESSED,
+    SM_CACHE_HITS,
+    SM_CACHE_MISSES,
+    SM_CACHE_EVICTIONS,
+    SM_COUNTER_MAX
+} stream_counter_t;
+
+typedef enum {
+    SM_HIST_JSON_PARSE,
+    SM_HIST_BASE64_DECODE,
+    SM_HIST_OPUS_DECODE,
+    SM_HIST_CAPTURE_CALLBACK,
+    SM_HIST_PROCESS_MESSAGE,
+    SM_HIST_ROUND_TRIP,
+    SM_HIST_AEC,
+    SM_HIST_PREPROCESS,
+    SM_HIST_MAX
+} stream_histogram_t;
+
+/*
+ * HDR-style latency histogram: 8 linear sub-buckets per power of two (~12.5% relative
+ * error) over 128ns units, covering up to 2^33ns (~8.6s). Recording is a couple of
+ * shifts and one increment, cheap enough to stay on for every tick and message.
+ */
+#define LAT_HIST_UNIT_SHIFT  7
+#define LAT_HIST_SUB_BITS    3
+#define LAT_HIST_OCTAVES     23
+#define LAT_HIST_BUCKETS     ((LAT_HIST_OCTAVES + 1) << LAT_HIST_SUB_BITS)
+
+/* Prometheus export boundaries: le = 1.024us, 2.048us ... ~4.3s, plus +Inf */
+#define SM_PROM_FIRST_SHIFT  10
+#define SM_PROM_BUCKETS      23
+
+#define SM_DEFAULT_SLOW_US   5000   /* a quarter of the 20ms media tick */
+
+/* per-session histogram; a single thread records, any thread may read */
+typedef struct lat_hist {
+    uint32_t counts[LAT_HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t slow;
+} lat_hist_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+switch_status_t stream_metrics_init(void);
+void stream_metrics_shutdown(void);
+
+uint64_t stream_metrics_now_ns(void);
+void stream_metrics_add(stream_counter_t counter, uint64_t value);
+void stream_metrics_observe(stream_histogram_t histogram, uint64_t ns);
+
+/* record into the global histogram and, when given, the session one; counts slow samples above slow_ns */
+void stream_latency_record(stream_histogram_t histogram, lat_hist_t *session_hist, uint64_t ns, uint64_t slow_ns);
+
+/* current module-wide value of a counter */
+uint64_t stream_metrics_counter(stream_counter_t counter);
+
+/* {"count","avg_us","p50_us","p99_us","p999_us","max_us","slow"} */
+cJSON *lat_hist_summary(const lat_hist_t *hist);
+/* global percentiles for the READ tick and message handling */
+cJSON *stream_metrics_summary(void);
+
+/* Prometheus text exposition format (version 0.0.4) */
+void stream_metrics_render(switch_stream_handle_t *stream);
+switch_status_t stream_metrics_write_textfile(const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //STREAM_METRICS_H